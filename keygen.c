@@ -1,46 +1,202 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
-#include <time.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include "otp_keygen.h"
+
+#define OUT_BUFFER (1 << 20)		// Characters collected before each write()
+
+/*****************************
+ * One thread's share of a parallel run: key characters [start, end) of the file
+ *****************************/
+struct keyRange {
+	pthread_t thread;
+	int fd;
+	unsigned long long start;
+	unsigned long long end;
+	const unsigned char* table;
+};
+
+// Function prototypes
+static void generateKey(int, long long, unsigned long long, const unsigned char*);
+static int generateParallel(int, unsigned long long, int, const unsigned char*);
+static void* generateRange(void*);
+static void writeAll(int, long long, const char*, size_t);
 
-#define NUM_KEY_CHARS 27
+// Global vars
+static refillFn refillChacha;
+static mapFn mapChars;
 
 int main(int argc, char** argv){
 
-	// Init random seed
-	srand(time(0));
+	unsigned char table[256];
+	unsigned long long keyLen;
+	int outFD = 1;		// stdout unless -o is given
+	int numThreads = -1;	// -1 = generate in this thread
+	int opt;
+	char* end;
 
-	int randNum;
-	int lowerLimit = 65;	// 65 == 'A' in ASCII
-	int chars[NUM_KEY_CHARS];
-	int keyLen;
+	while((opt = getopt(argc, argv, "o:t:")) != -1){
+		switch(opt){
+			case 'o':
+				outFD = open(optarg, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+				if(outFD < 0){ perror("ERROR opening output file"); return 1; }
+				break;
+			case 't':
+				numThreads = atoi(optarg);
+				if(numThreads <= 0){ numThreads = sysconf(_SC_NPROCESSORS_ONLN); }
+				if(numThreads <= 0){ numThreads = 1; }
+				break;
+			default:
+				fprintf(stderr, "USAGE: %s [-o file [-t threads]] keylength\n", argv[0]);
+				return 1;
+		}
+	}
 
 	// Not enough arguments
-	if(argc < 2){
+	if(optind >= argc){
 		fprintf(stderr, "ERROR: Not enough arguments\n");
 		return 1;
-	}	
+	}
 
-	// Convert argument one (the length of the key) to an int
-	keyLen = atoi(argv[1]);
+	// Convert argument one (the length of the key) to a number. Pads can be many GB.
+	keyLen = strtoull(argv[optind], &end, 10);
 
-	if(keyLen < 1){
+	if(*end != '\0' || argv[optind][0] == '-' || keyLen < 1){
 		fprintf(stderr, "ERROR: Key length less than 1.\n");
 		return 1;
 	}
 
-	// Populate chars array with the characters we want in the keygen: A-Z, and ' '
-	for(int i = 0; i < NUM_KEY_CHARS-1; i++){	// -1 so we save a space for ' '
-		chars[i] = lowerLimit + i;
+	// Threads write at their own offsets, which needs a real file
+	if(numThreads > 0 && outFD == 1){
+		fprintf(stderr, "ERROR: -t needs -o\n");
+		return 1;
 	}
-	chars[NUM_KEY_CHARS-1] = ' ';	
 
-	// Generate random string of letters with specified length FROM our chars array
-	for(int i = 0; i < keyLen; i++){
-		randNum = (rand() % (NUM_KEY_CHARS));
-		printf("%c", chars[randNum]);
+	keygenKernels(&refillChacha, &mapChars);
+	buildCharTable(table);
+
+	if(numThreads > 0){
+		if(generateParallel(outFD, keyLen, numThreads, table) != 0){ return 1; }
+	}
+	else{
+		generateKey(outFD, -1, keyLen, table);
 	}
-	printf("\n");
+	writeAll(outFD, numThreads > 0 ? (long long)keyLen : -1, "\n", 1);
+
+	if(outFD != 1 && close(outFD) < 0){ perror("ERROR closing output file"); return 1; }
 
 	return 0;
 }
+
+/*****************************
+ * Generate keyLen random letters FROM our alphabet with a freshly
+ * seeded generator, one refill at a time, writing whenever the buffer is
+ * nearly full. The key goes to offset in fd, or to fd's current position if
+ * offset is -1.
+ *****************************/
+static void generateKey(int fd, long long offset, unsigned long long keyLen, const unsigned char* table){
+	struct chacha rng;
+	unsigned long long written = 0;
+	size_t have = 0;
+	char* buffer;
+
+	buffer = malloc(OUT_BUFFER);
+	if(buffer == NULL){ fprintf(stderr, "ERROR: out of memory\n"); exit(1); }
+
+	seedChacha(&rng);
+
+	while(written < keyLen){
+		refillChacha(&rng);
+		have += mapChars(buffer + have, rng.out, table);
+
+		if(have > OUT_BUFFER - RNG_BYTES || written + have >= keyLen){
+			if(have > keyLen - written){ have = keyLen - written; }
+			writeAll(fd, offset < 0 ? -1 : offset + (long long)written, buffer, have);
+			written += have;
+			have = 0;
+		}
+	}
+
+	free(buffer);
+}
+
+/*****************************
+ * Split the key into numThreads ranges and generate them side by side, each
+ * thread with its own independently seeded generator writing straight to its
+ * part of the file. The file is allocated up front so the threads don't
+ * fight over extending it. Reports the throughput on stderr when done.
+ *****************************/
+static int generateParallel(int fd, unsigned long long keyLen, int numThreads, const unsigned char* table){
+	struct keyRange* ranges;
+	struct timespec started, finished;
+	unsigned long long share;
+	double seconds;
+	int result;
+
+	clock_gettime(CLOCK_MONOTONIC, &started);
+
+	result = fallocate(fd, 0, 0, keyLen + 1);
+	if(result != 0 && errno != EOPNOTSUPP){ perror("ERROR allocating output file"); return 1; }
+
+	// Ranges are whole multiples of the write buffer, except the last one
+	if((unsigned long long)numThreads > keyLen / OUT_BUFFER + 1){ numThreads = keyLen / OUT_BUFFER + 1; }
+	share = (keyLen / numThreads + OUT_BUFFER - 1) / OUT_BUFFER * OUT_BUFFER;
+
+	ranges = calloc(numThreads, sizeof(struct keyRange));
+	if(ranges == NULL){ fprintf(stderr, "ERROR: out of memory\n"); return 1; }
+
+	for(int i = 0; i < numThreads; i++){
+		ranges[i].fd = fd;
+		ranges[i].start = i * share < keyLen ? i * share : keyLen;
+		ranges[i].end = i == numThreads - 1 || (i + 1) * share > keyLen ? keyLen : (i + 1) * share;
+		ranges[i].table = table;
+
+		result = pthread_create(&ranges[i].thread, NULL, generateRange, &ranges[i]);
+		if(result != 0){ errno = result; perror("ERROR starting thread"); exit(1); }
+	}
+	for(int i = 0; i < numThreads; i++){
+		pthread_join(ranges[i].thread, NULL);
+	}
+	free(ranges);
+
+	clock_gettime(CLOCK_MONOTONIC, &finished);
+	seconds = (finished.tv_sec - started.tv_sec) + (finished.tv_nsec - started.tv_nsec) / 1e9;
+	fprintf(stderr, "keygen: %llu characters in %.2f s (%.0f MB/s, %d threads)\n",
+		keyLen, seconds, keyLen / 1e6 / (seconds > 0 ? seconds : 1e-9), numThreads);
+
+	return 0;
+}
+
+static void* generateRange(void* arg){
+	struct keyRange* range = arg;
+
+	generateKey(range->fd, range->start, range->end - range->start, range->table);
+	return NULL;
+}
+
+/*****************************
+ * Write all of buf at offset in fd, or at fd's current position
+ * if offset is -1. Exits on failure.
+ *****************************/
+static void writeAll(int fd, long long offset, const char* buf, size_t len){
+	ssize_t n;
+
+	while(len > 0){
+		n = offset < 0 ? write(fd, buf, len) : pwrite(fd, buf, len, offset);
+		if(n < 0){
+			if(errno == EINTR){ continue; }
+			perror("ERROR writing key");
+			exit(1);
+		}
+		buf += n;
+		len -= n;
+		if(offset >= 0){ offset += n; }
+	}
+}
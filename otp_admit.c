@@ -0,0 +1,134 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include "otp_admit.h"
+#include "otp_proto.h"
+#include "otp_metrics.h"
+
+#define SHED_DRAIN 4		// Reads of what a shed client already sent, CHUNK_SIZE each
+
+// Function prototypes
+static void admitWaiting(struct admitQueue*);
+
+// Global vars
+static char drainBuffer[CHUNK_SIZE];
+
+/*****************************
+ * Set up an empty queue for policy. Returns -1 if it can't be allocated.
+ *****************************/
+int admitInit(struct admitQueue* queue, const struct admitPolicy* policy){
+	int room = policy->queueLen > 0 ? policy->queueLen : 1;
+
+	memset(queue, '\0', sizeof(*queue));
+	queue->policy = policy;
+	queue->fds = malloc(room * sizeof(int));
+	queue->since = malloc(room * sizeof(unsigned long long));
+	if(queue->fds == NULL || queue->since == NULL){
+		free(queue->fds);
+		free(queue->since);
+		return -1;
+	}
+	return 0;
+}
+
+/*****************************
+ * Connection fd was accepted but there is no slot for it. It waits at the
+ * back of the queue, or is shed right away if the queue is full.
+ *****************************/
+void admitPush(struct admitQueue* queue, int fd){
+	int tail;
+
+	if(queue->count >= queue->policy->queueLen){
+		admitShed(fd, queue->policy->queueMs);
+		return;
+	}
+
+	tail = (queue->head + queue->count) % queue->policy->queueLen;
+	queue->fds[tail] = fd;
+	queue->since[tail] = metricsNow();
+	queue->count++;
+	admitWaiting(queue);
+}
+
+/*****************************
+ * A slot is free: the connection that has waited longest, or -1 if none is
+ * waiting. Any that waited past the deadline are shed on the way.
+ *****************************/
+int admitPop(struct admitQueue* queue){
+	unsigned long long waited;
+	int fd;
+
+	while(queue->count > 0){
+		fd = queue->fds[queue->head];
+		waited = metricsNow() - queue->since[queue->head];
+		queue->head = (queue->head + 1) % queue->policy->queueLen;
+		queue->count--;
+		admitWaiting(queue);
+
+		if(waited >= queue->policy->queueMs * 1000000ULL){
+			admitShed(fd, queue->policy->queueMs);
+			continue;
+		}
+		metricsObserve(PHASE_QUEUE, waited);
+		return fd;
+	}
+	return -1;
+}
+
+/*****************************
+ * Shed every connection that has waited past the deadline. Returns the ms
+ * until the next one will have, for poll(), or -1 if none is waiting.
+ *****************************/
+int admitTimeout(struct admitQueue* queue){
+	unsigned long long deadline, now;
+
+	while(queue->count > 0){
+		deadline = queue->since[queue->head] + queue->policy->queueMs * 1000000ULL;
+		now = metricsNow();
+		if(now < deadline){ return (deadline - now + 999999) / 1000000; }
+
+		admitShed(queue->fds[queue->head], queue->policy->queueMs);
+		queue->head = (queue->head + 1) % queue->policy->queueLen;
+		queue->count--;
+		admitWaiting(queue);
+	}
+	return -1;
+}
+
+/*****************************
+ * In a forked child: close its copies of the connections the parent has
+ * waiting. The parent still owns them, and its counters aren't touched.
+ *****************************/
+void admitForget(struct admitQueue* queue){
+	for(int i = 0; i < queue->count; i++){
+		close(queue->fds[(queue->head + i) % queue->policy->queueLen]);
+	}
+	queue->count = 0;
+}
+
+/*****************************
+ * Turn connection fd away without serving it: a busy record saying when to
+ * retry, then close. It never blocks. What the client has sent already is
+ * read first, since closing with unread input would reset the connection
+ * and could take the busy record with it.
+ *****************************/
+void admitShed(int fd, unsigned int retryMs){
+	char reply[BIN_RECORD_SIZE + BIN_BUSY_SIZE];
+
+	formatBinRecord(reply, RECORD_BUSY, BIN_BUSY_SIZE);
+	formatBinBusy(reply + BIN_RECORD_SIZE, retryMs);
+	send(fd, reply, sizeof(reply), MSG_NOSIGNAL | MSG_DONTWAIT);
+	shutdown(fd, SHUT_WR);
+
+	for(int i = 0; i < SHED_DRAIN && recv(fd, drainBuffer, sizeof(drainBuffer), MSG_DONTWAIT) > 0; i++);
+	close(fd);
+	METRIC_ADD(shed, 1);
+}
+
+static void admitWaiting(struct admitQueue* queue){
+	__atomic_store_n(&metrics->waiting, queue->count, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,38 @@
+#ifndef OTP_ADMIT_H
+#define OTP_ADMIT_H
+
+#define DEFAULT_QUEUE 64			// Connections that may wait for admission
+#define DEFAULT_QUEUE_MS 250		// Longest a connection waits for admission
+
+/*****************************
+ * How many connections a daemon serves at once and what happens to the rest.
+ * Connections past maxActive wait in a queue of queueLen, oldest first, and
+ * are answered busy when the queue is full or they have waited queueMs. The
+ * busy reply tells the client to retry after queueMs, by which time every
+ * connection waiting now has been served or turned away.
+ *****************************/
+struct admitPolicy {
+	int maxActive;			// Connections served at once, 0 for no limit
+	int queueLen;			// Connections that may wait for a slot
+	unsigned int queueMs;	// Longest a connection waits before it is shed
+};
+
+/*****************************
+ * Accepted connections waiting for a slot, a ring of queueLen
+ *****************************/
+struct admitQueue {
+	const struct admitPolicy* policy;
+	int* fds;
+	unsigned long long* since;		// When each was accepted, metricsNow() ns
+	int head;
+	int count;
+};
+
+int admitInit(struct admitQueue*, const struct admitPolicy*);
+void admitPush(struct admitQueue*, int);
+int admitPop(struct admitQueue*);
+int admitTimeout(struct admitQueue*);
+void admitForget(struct admitQueue*);
+void admitShed(int, unsigned int);
+
+#endif
@@ -0,0 +1,763 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "otp_proto.h"
+#include "otp_cipher.h"
+
+/* argv[0] = otp_bench
+ * options: -c connections, -p requests in flight per connection (closed loop),
+ *          -r requests per second across all connections (open loop, 0 = closed loop),
+ *          -n requests, -d seconds (instead of -n), -s size (N, A-B or exp:MEAN),
+ *          -m enc, dec or mix, -j prints JSON instead of text
+ * then: one or more ports on localhost or UNIX socket paths, connections are
+ *       spread across them
+ */
+
+#define MAX_CONNS 4096
+#define MAX_PORTS 16
+#define MAX_INFLIGHT 256		// Requests one connection can have outstanding
+#define BENCH_PIECES 64			// Most pieces gathered into one sendmsg()
+#define RECV_BUFFER (256 * 1024)
+#define MAX_EVENTS 64
+#define HIST_BUCKETS 40			// Powers of two from 1 us up
+
+/*****************************
+ * How request sizes are picked
+ *****************************/
+enum sizeKind { SIZE_FIXED, SIZE_UNIFORM, SIZE_EXP };
+
+struct sizeDist {
+	enum sizeKind kind;
+	size_t min;
+	size_t max;				// Largest size this distribution can produce
+	double mean;
+};
+
+/*****************************
+ * One request: where its text and key come from in the shared buffers,
+ * and when it should have gone out
+ *****************************/
+struct benchRequest {
+	char header[BIN_HEADER_SIZE];
+	unsigned char op;
+	size_t size;
+	size_t textOff;
+	size_t keyOff;
+	unsigned long long start;	// Intended send time, ns
+	int bad;					// Reply already found wrong
+};
+
+/*****************************
+ * A connection with requests queued oldest first. Requests before sendPos
+ * have been queued for sending completely, the oldest is the one whose
+ * reply is arriving.
+ *****************************/
+struct benchConn {
+	int fd;
+	const char* port;		// Port number, or the path of a UNIX socket
+	unsigned int events;		// epoll events it is registered for
+
+	struct benchRequest queue[MAX_INFLIGHT];
+	int head;
+	int count;
+
+	int sendPos;				// Queue position of the request being sent
+	size_t sendOff;				// Its text characters queued so far
+	int headerQueued;
+	char records[BENCH_PIECES][BIN_RECORD_SIZE];
+	int numRecords;
+	struct iovec iov[BENCH_PIECES];
+	int first;
+	int queued;
+
+	char record[BIN_RECORD_SIZE];
+	size_t have;				// Record header bytes received
+	char type;
+	size_t left;				// Payload bytes still to come
+	size_t recvOff;				// Reply characters of the oldest request checked so far
+	char busy[BIN_BUSY_SIZE];	// Payload of a busy record
+	unsigned long long retryAt;	// Turned away busy: reconnect at this time, ns
+};
+
+/*****************************
+ * What a run measured
+ *****************************/
+struct benchResults {
+	unsigned long long ok;
+	unsigned long long failed;		// Error replies and broken connections
+	unsigned long long busy;		// Requests on connections the daemon turned away busy
+	unsigned long long mismatched;	// Replies that differ from the reference transform
+	unsigned long long bytes;		// Text characters in successful requests
+	unsigned long long* samples;	// Latency of each successful request, ns
+	size_t numSamples;
+	size_t room;
+};
+
+// Function prototypes
+static int parseSizeDist(const char*, struct sizeDist*);
+static size_t pickSize(const struct sizeDist*);
+static unsigned long long nextRandom();
+static unsigned long long nowNs();
+static void fillRandom(char*, size_t);
+static int openConn(struct benchConn*, const char*);
+static int canIssue(unsigned long long);
+static void issueRequest(struct benchConn*, unsigned long long);
+static void topUp(struct benchConn*);
+static void queuePieces(struct benchConn*);
+static int sendPending(struct benchConn*);
+static int receiveReplies(struct benchConn*);
+static void checkReply(struct benchConn*, const char*, size_t);
+static void finishRequest(struct benchConn*);
+static void kickConn(struct benchConn*);
+static void failConn(struct benchConn*, int);
+static void updateEvents(struct benchConn*);
+static void addSample(unsigned long long);
+static int compareSamples(const void*, const void*);
+static double percentile(double);
+static void printText(double);
+static void printJSON(double);
+
+// Global vars
+static struct benchConn* conns;
+static int numConns = 8;
+static int epollFD;
+static char* textBuf;			// Random text every request takes a slice of
+static char* keyBuf;			// Random key, likewise
+static size_t bufSize;
+static struct sizeDist sizes = { SIZE_FIXED, 1024, 1024, 1024 };
+static const char* modeName = "enc";
+static int mode = 0;			// 0 encrypt, 1 decrypt, 2 alternate
+static unsigned long long issued;
+static unsigned long long completed;
+static unsigned long long total = 10000;	// Requests to issue, -n
+static unsigned long long deadline;			// Stop issuing at this time if -d was given, ns
+static unsigned long long rngState = 0x9E3779B97F4A7C15ULL;
+static struct benchResults results;
+static int depth = 1;
+static double rate = 0;
+static char scratch[RECV_BUFFER];
+
+int main(int argc, char** argv){
+	struct epoll_event events[MAX_EVENTS];
+	const char* ports[MAX_PORTS];
+	int numPorts, opt, count, json = 0;
+	unsigned long long duration = 0, startNs, nextArrival, now;
+	int timeout, next = 0, full, status;
+	double elapsed;
+
+	while((opt = getopt(argc, argv, "c:p:r:n:d:s:m:j")) != -1){
+		switch(opt){
+			case 'c': numConns = atoi(optarg); break;
+			case 'p': depth = atoi(optarg); break;
+			case 'r': rate = atof(optarg); break;
+			case 'n': total = strtoull(optarg, NULL, 10); break;
+			case 'd': duration = strtoull(optarg, NULL, 10); break;
+			case 's':
+				if(parseSizeDist(optarg, &sizes) != 0){ fprintf(stderr, "ERROR: bad size %s\n", optarg); return 1; }
+				break;
+			case 'm':
+				modeName = optarg;
+				if(strcmp(optarg, "enc") == 0){ mode = 0; }
+				else if(strcmp(optarg, "dec") == 0){ mode = 1; }
+				else if(strcmp(optarg, "mix") == 0){ mode = 2; }
+				else{ fprintf(stderr, "ERROR: -m is enc, dec or mix\n"); return 1; }
+				break;
+			case 'j': json = 1; break;
+			default:
+				fprintf(stderr, "USAGE: %s [-c conns] [-p depth] [-r rate] [-n requests | -d seconds] [-s size] [-m enc|dec|mix] [-j] port|path [port|path ...]\n", argv[0]);
+				return 1;
+		}
+	}
+	if(optind >= argc || argc - optind > MAX_PORTS){
+		fprintf(stderr, "USAGE: %s [-c conns] [-p depth] [-r rate] [-n requests | -d seconds] [-s size] [-m enc|dec|mix] [-j] port|path [port|path ...]\n", argv[0]);
+		return 1;
+	}
+	if(numConns < 1 || numConns > MAX_CONNS){ fprintf(stderr, "ERROR: -c is 1 to %d\n", MAX_CONNS); return 1; }
+	if(depth < 1 || depth > MAX_INFLIGHT){ fprintf(stderr, "ERROR: -p is 1 to %d\n", MAX_INFLIGHT); return 1; }
+
+	numPorts = argc - optind;
+	for(int i = 0; i < numPorts; i++){
+		ports[i] = argv[optind + i];
+	}
+
+	// Every request takes its text and key from random places in these
+	bufSize = sizes.max * 2 + CHUNK_SIZE;
+	textBuf = malloc(bufSize);
+	keyBuf = malloc(bufSize);
+	conns = calloc(numConns, sizeof(*conns));
+	if(textBuf == NULL || keyBuf == NULL || conns == NULL){ fprintf(stderr, "ERROR: out of memory\n"); return 1; }
+	fillRandom(textBuf, bufSize);
+	fillRandom(keyBuf, bufSize);
+
+	epollFD = epoll_create1(EPOLL_CLOEXEC);
+	if(epollFD < 0){ perror("ERROR creating epoll instance"); return 1; }
+	for(int i = 0; i < numConns; i++){
+		if(openConn(&conns[i], ports[i % numPorts]) != 0){ return 1; }
+	}
+
+	startNs = nowNs();
+	nextArrival = startNs;
+	if(duration > 0){
+		deadline = startNs + duration * 1000000000ULL;
+		total = ~0ULL;
+	}
+
+	// Closed loop: fill every connection up to depth, each reply makes room for the next
+	if(rate <= 0){
+		for(int i = 0; i < numConns; i++){
+			topUp(&conns[i]);
+			kickConn(&conns[i]);
+		}
+	}
+
+	while(completed < issued || canIssue(nowNs())){
+		timeout = -1;
+		now = nowNs();
+
+		// Open loop: requests arrive on a Poisson schedule whether or not replies keep up,
+		// and their latency counts from when they should have gone out
+		if(rate > 0){
+			full = 0;
+			while(nextArrival <= now && canIssue(nextArrival)){
+				// Next connection round robin that has room
+				for(int tries = 0; tries < numConns && conns[next].count == MAX_INFLIGHT; tries++){
+					next = (next + 1) % numConns;
+				}
+				if(conns[next].count == MAX_INFLIGHT){ full = 1; break; }
+				issueRequest(&conns[next], nextArrival);
+				kickConn(&conns[next]);
+				next = (next + 1) % numConns;
+				nextArrival += (unsigned long long)(-log(1.0 - (nextRandom() >> 11) * (1.0 / 9007199254740992.0)) / rate * 1e9);
+			}
+			if(!full && canIssue(nextArrival)){
+				timeout = nextArrival > now ? (int)((nextArrival - now) / 1000000) : 0;
+			}
+		}
+		if(timeout < 0 && deadline > 0 && now < deadline){
+			timeout = (int)((deadline - now) / 1000000) + 1;
+		}
+
+		// Connections turned away busy come back when the daemon said to
+		for(int i = 0; i < numConns; i++){
+			if(conns[i].fd < 0 && conns[i].retryAt > now){
+				if(timeout < 0 || (conns[i].retryAt - now) / 1000000 + 1 < (unsigned long long)timeout){
+					timeout = (conns[i].retryAt - now) / 1000000 + 1;
+				}
+			}
+		}
+
+		count = epoll_wait(epollFD, events, MAX_EVENTS, timeout);
+		if(count < 0){
+			if(errno == EINTR){ continue; }
+			perror("ERROR on epoll_wait");
+			return 1;
+		}
+
+		for(int i = 0; i < count; i++){
+			struct benchConn* conn = events[i].data.ptr;
+
+			if(events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)){
+				status = receiveReplies(conn);
+				if(status != 0){ failConn(conn, status == -2); continue; }
+			}
+			if(rate <= 0){ topUp(conn); }
+			kickConn(conn);
+		}
+
+		// Broken connections come back here once their requests are written off
+		now = nowNs();
+		for(int i = 0; i < numConns; i++){
+			if(conns[i].fd >= 0 || conns[i].retryAt > now){ continue; }
+			if(openConn(&conns[i], conns[i].port) != 0){ return 1; }
+			if(rate <= 0){
+				topUp(&conns[i]);
+				kickConn(&conns[i]);
+			}
+		}
+	}
+
+	elapsed = (nowNs() - startNs) / 1e9;
+	qsort(results.samples, results.numSamples, sizeof(unsigned long long), compareSamples);
+	if(json){ printJSON(elapsed); }
+	else{ printText(elapsed); }
+
+	return (results.failed > 0 || results.mismatched > 0) ? 1 : 0;
+}
+
+/*****************************
+ * Read a size distribution: N, A-B for uniform sizes between A and B,
+ * or exp:MEAN for exponential sizes around MEAN (capped at 16 times it).
+ * Returns 1 if spec is malformed.
+ *****************************/
+static int parseSizeDist(const char* spec, struct sizeDist* dist){
+	char* end;
+
+	if(strncmp(spec, "exp:", 4) == 0){
+		dist->kind = SIZE_EXP;
+		dist->mean = strtod(spec + 4, &end);
+		if(*end != '\0' || dist->mean < 1){ return 1; }
+		dist->min = 1;
+		dist->max = (size_t)(dist->mean * 16);
+		return 0;
+	}
+
+	dist->min = strtoull(spec, &end, 10);
+	if(end == spec){ return 1; }
+	if(*end == '\0'){
+		dist->kind = SIZE_FIXED;
+		dist->max = dist->min;
+		dist->mean = dist->min;
+		return 0;
+	}
+	if(*end != '-'){ return 1; }
+	dist->max = strtoull(end + 1, &end, 10);
+	if(*end != '\0' || dist->max < dist->min){ return 1; }
+	dist->kind = SIZE_UNIFORM;
+	dist->mean = (dist->min + dist->max) / 2.0;
+	return 0;
+}
+
+static size_t pickSize(const struct sizeDist* dist){
+	double size;
+
+	switch(dist->kind){
+		case SIZE_UNIFORM:
+			return dist->min + nextRandom() % (dist->max - dist->min + 1);
+		case SIZE_EXP:
+			size = -log(1.0 - (nextRandom() >> 11) * (1.0 / 9007199254740992.0)) * dist->mean;
+			if(size < dist->min){ size = dist->min; }
+			if(size > dist->max){ size = dist->max; }
+			return (size_t)size;
+		default:
+			return dist->min;
+	}
+}
+
+/*****************************
+ * xorshift64*: plenty for picking sizes and offsets, and the same run
+ * every time
+ *****************************/
+static unsigned long long nextRandom(){
+	rngState ^= rngState >> 12;
+	rngState ^= rngState << 25;
+	rngState ^= rngState >> 27;
+	return rngState * 2685821657736338717ULL;
+}
+
+static unsigned long long nowNs(){
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*****************************
+ * Fill buf with characters from the 27 character alphabet
+ *****************************/
+static void fillRandom(char* buf, size_t len){
+	for(size_t i = 0; i < len; i++){
+		buf[i] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ "[nextRandom() % 27];
+	}
+}
+
+/*****************************
+ * Connect conn to port on localhost, or to the UNIX socket at port if it
+ * is a path, and add it to the epoll set.
+ * Returns -1 if the daemon can't be reached.
+ *****************************/
+static int openConn(struct benchConn* conn, const char* port){
+	struct sockaddr_in addr;
+	struct sockaddr_un unixAddr;
+	struct epoll_event ev;
+	int on = 1, local = strchr(port, '/') != NULL;
+
+	memset(conn, '\0', sizeof(*conn));
+	conn->port = port;
+
+	memset(&addr, '\0', sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(atoi(port));
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	memset(&unixAddr, '\0', sizeof(unixAddr));
+	unixAddr.sun_family = AF_UNIX;
+	strncpy(unixAddr.sun_path, port, sizeof(unixAddr.sun_path) - 1);
+
+	conn->fd = socket(local ? AF_UNIX : AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(conn->fd < 0){ perror("ERROR opening socket"); return -1; }
+	if(connect(conn->fd, local ? (struct sockaddr*)&unixAddr : (struct sockaddr*)&addr, local ? sizeof(unixAddr) : sizeof(addr)) < 0){
+		perror("ERROR connecting");
+		return -1;
+	}
+	if(!local){ setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)); }
+	fcntl(conn->fd, F_SETFL, fcntl(conn->fd, F_GETFL) | O_NONBLOCK);
+
+	conn->events = EPOLLIN;
+	memset(&ev, '\0', sizeof(ev));
+	ev.events = conn->events;
+	ev.data.ptr = conn;
+	if(epoll_ctl(epollFD, EPOLL_CTL_ADD, conn->fd, &ev) < 0){
+		perror("ERROR adding connection to epoll");
+		return -1;
+	}
+	return 0;
+}
+
+/*****************************
+ * Whether another request may go out at time now
+ *****************************/
+static int canIssue(unsigned long long now){
+	return issued < total && (deadline == 0 || now < deadline);
+}
+
+/*****************************
+ * Queue a new request on conn that should have gone out at start.
+ * The caller sends it.
+ *****************************/
+static void issueRequest(struct benchConn* conn, unsigned long long start){
+	struct benchRequest* req = &conn->queue[(conn->head + conn->count) % MAX_INFLIGHT];
+	struct binHeader fields;
+
+	req->size = pickSize(&sizes);
+	req->textOff = nextRandom() % (bufSize - req->size + 1);
+	req->keyOff = nextRandom() % (bufSize - req->size + 1);
+	req->op = (mode == 1 || (mode == 2 && issued % 2 == 1)) ? BIN_OP_DECRYPT : BIN_OP_ENCRYPT;
+	req->start = start;
+	req->bad = 0;
+
+	memset(&fields, '\0', sizeof(fields));
+	fields.op = req->op;
+	fields.textSize = req->size;
+	fields.keySize = req->size;
+	formatBinHeader(req->header, &fields);
+
+	conn->count++;
+	issued++;
+}
+
+/*****************************
+ * Closed loop: keep depth requests in flight on conn
+ *****************************/
+static void topUp(struct benchConn* conn){
+	unsigned long long now = nowNs();
+
+	while(conn->count < depth && canIssue(now)){
+		issueRequest(conn, now);
+	}
+}
+
+/*****************************
+ * Queue pieces for the requests not sent yet, as many as fit
+ *****************************/
+static void queuePieces(struct benchConn* conn){
+	struct benchRequest* req;
+	char* record;
+	size_t chunkLen;
+
+	while(conn->sendPos < conn->count && conn->queued + 4 <= BENCH_PIECES){
+		req = &conn->queue[(conn->head + conn->sendPos) % MAX_INFLIGHT];
+		if(!conn->headerQueued){
+			conn->iov[conn->queued].iov_base = req->header;
+			conn->iov[conn->queued++].iov_len = BIN_HEADER_SIZE;
+			conn->headerQueued = 1;
+		}
+
+		record = conn->records[conn->numRecords++];
+		conn->iov[conn->queued].iov_base = record;
+		conn->iov[conn->queued++].iov_len = BIN_RECORD_SIZE;
+
+		chunkLen = req->size - conn->sendOff;
+		if(chunkLen == 0){
+			formatBinRecord(record, RECORD_END, 0);
+			conn->sendPos++;
+			conn->sendOff = 0;
+			conn->headerQueued = 0;
+			continue;
+		}
+		if(chunkLen > CHUNK_SIZE){ chunkLen = CHUNK_SIZE; }
+		formatBinRecord(record, RECORD_DATA, chunkLen);
+		conn->iov[conn->queued].iov_base = textBuf + req->textOff + conn->sendOff;
+		conn->iov[conn->queued++].iov_len = chunkLen;
+		conn->iov[conn->queued].iov_base = keyBuf + req->keyOff + conn->sendOff;
+		conn->iov[conn->queued++].iov_len = chunkLen;
+		conn->sendOff += chunkLen;
+	}
+}
+
+/*****************************
+ * Send until the socket is full or there is nothing left.
+ * Returns -1 if the connection broke.
+ *****************************/
+static int sendPending(struct benchConn* conn){
+	struct msghdr msg;
+	ssize_t n;
+
+	memset(&msg, '\0', sizeof(msg));
+	while(1){
+		if(conn->first == conn->queued){
+			conn->first = conn->queued = conn->numRecords = 0;
+			queuePieces(conn);
+			if(conn->queued == 0){ return 0; }
+		}
+
+		msg.msg_iov = conn->iov + conn->first;
+		msg.msg_iovlen = conn->queued - conn->first;
+		n = sendmsg(conn->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if(n < 0){
+			if(errno == EINTR){ continue; }
+			return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+		}
+
+		while(n > 0){
+			if((size_t)n < conn->iov[conn->first].iov_len){
+				conn->iov[conn->first].iov_base = (char*)conn->iov[conn->first].iov_base + n;
+				conn->iov[conn->first].iov_len -= n;
+				break;
+			}
+			n -= conn->iov[conn->first].iov_len;
+			conn->first++;
+		}
+	}
+}
+
+/*****************************
+ * Read and check whatever replies have arrived.
+ * Returns -1 if the connection broke or the daemon sent an error, and -2 if
+ * the daemon turned it away busy, with conn->retryAt set to when to return.
+ *****************************/
+static int receiveReplies(struct benchConn* conn){
+	static char buffer[RECV_BUFFER];
+	unsigned int retryMs;
+	size_t len, pos;
+	ssize_t n;
+
+	while(1){
+		n = recv(conn->fd, buffer, sizeof(buffer), 0);
+		if(n < 0){
+			if(errno == EINTR){ continue; }
+			return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+		}
+		if(n == 0){ return -1; }
+
+		for(pos = 0; pos < (size_t)n; ){
+			if(conn->have < BIN_RECORD_SIZE){
+				len = BIN_RECORD_SIZE - conn->have;
+				if(len > n - pos){ len = n - pos; }
+				memcpy(conn->record + conn->have, buffer + pos, len);
+				conn->have += len;
+				pos += len;
+				if(conn->have < BIN_RECORD_SIZE){ continue; }
+
+				if(parseBinRecord(conn->record, &conn->type, &conn->left) != 0){ return -1; }
+				if(conn->type == RECORD_BUSY){
+					if(conn->left != BIN_BUSY_SIZE){ return -1; }
+					continue;		// The payload says when to come back
+				}
+				if(conn->count == 0){ return -1; }
+				if(conn->type == RECORD_END){
+					finishRequest(conn);
+					conn->have = 0;
+				}
+				else if(conn->type != RECORD_DATA){
+					return -1;		// The daemon gave up on the request and will say no more
+				}
+				else if(conn->left == 0){
+					conn->have = 0;
+				}
+				continue;
+			}
+
+			len = conn->left < n - pos ? conn->left : n - pos;
+			if(conn->type == RECORD_BUSY){
+				memcpy(conn->busy + BIN_BUSY_SIZE - conn->left, buffer + pos, len);
+				conn->left -= len;
+				pos += len;
+				if(conn->left == 0 && parseBinBusy(conn->busy, BIN_BUSY_SIZE, &retryMs) == 0){
+					conn->retryAt = nowNs() + retryMs * 1000000ULL;
+					return -2;
+				}
+				continue;
+			}
+			checkReply(conn, buffer + pos, len);
+			conn->left -= len;
+			pos += len;
+			if(conn->left == 0){ conn->have = 0; }
+		}
+	}
+}
+
+/*****************************
+ * Compare len reply characters of the oldest request with what the
+ * reference transform makes of the text and key that were sent
+ *****************************/
+static void checkReply(struct benchConn* conn, const char* reply, size_t len){
+	struct benchRequest* req = &conn->queue[conn->head];
+	char* text = textBuf + req->textOff + conn->recvOff;
+	char* key = keyBuf + req->keyOff + conn->recvOff;
+
+	if(req->bad || conn->recvOff + len > req->size){
+		req->bad = 1;		// More reply than text
+		return;
+	}
+	if(req->op == BIN_OP_DECRYPT){ decryptTextScalar(scratch, text, key, len); }
+	else{ encryptTextScalar(scratch, text, key, len); }
+
+	if(memcmp(scratch, reply, len) != 0){ req->bad = 1; }
+	conn->recvOff += len;
+}
+
+/*****************************
+ * The oldest request's end record is in: record how it went
+ *****************************/
+static void finishRequest(struct benchConn* conn){
+	struct benchRequest* req = &conn->queue[conn->head];
+
+	if(req->bad || conn->recvOff != req->size){
+		results.mismatched++;
+	}
+	else{
+		results.ok++;
+		results.bytes += req->size;
+		addSample(nowNs() - req->start);
+	}
+
+	conn->head = (conn->head + 1) % MAX_INFLIGHT;
+	conn->count--;
+	if(conn->sendPos > 0){ conn->sendPos--; }
+	conn->recvOff = 0;
+	completed++;
+}
+
+/*****************************
+ * Send what conn has queued and wait for the socket if some is left
+ *****************************/
+static void kickConn(struct benchConn* conn){
+	if(sendPending(conn) != 0){
+		failConn(conn, receiveReplies(conn) == -2);		// A busy daemon closes without reading
+		return;
+	}
+	updateEvents(conn);
+}
+
+/*****************************
+ * Write off everything outstanding on a broken connection, or one the daemon
+ * was too busy for, and close it. The main loop opens a fresh one in its
+ * place, after conn->retryAt for a busy one.
+ *****************************/
+static void failConn(struct benchConn* conn, int busy){
+	if(busy){ results.busy += conn->count; }
+	else{ results.failed += conn->count; }
+	completed += conn->count;
+	epoll_ctl(epollFD, EPOLL_CTL_DEL, conn->fd, NULL);
+	close(conn->fd);
+	conn->fd = -1;
+	conn->count = 0;
+}
+
+/*****************************
+ * Ask epoll for EPOLLOUT only while there is something left to send
+ *****************************/
+static void updateEvents(struct benchConn* conn){
+	struct epoll_event ev;
+	unsigned int want = EPOLLIN;
+
+	if(conn->fd < 0){ return; }
+	if(conn->first < conn->queued || conn->sendPos < conn->count){ want |= EPOLLOUT; }
+	if(want == conn->events){ return; }
+
+	memset(&ev, '\0', sizeof(ev));
+	ev.events = want;
+	ev.data.ptr = conn;
+	epoll_ctl(epollFD, EPOLL_CTL_MOD, conn->fd, &ev);
+	conn->events = want;
+}
+
+static void addSample(unsigned long long ns){
+	if(results.numSamples == results.room){
+		results.room = results.room ? results.room * 2 : 65536;
+		results.samples = realloc(results.samples, results.room * sizeof(unsigned long long));
+		if(results.samples == NULL){ fprintf(stderr, "ERROR: out of memory\n"); exit(1); }
+	}
+	results.samples[results.numSamples++] = ns;
+}
+
+static int compareSamples(const void* a, const void* b){
+	unsigned long long x = *(const unsigned long long*)a, y = *(const unsigned long long*)b;
+	return x < y ? -1 : x > y;
+}
+
+/*****************************
+ * Latency at fraction p of the sorted samples, in microseconds
+ *****************************/
+static double percentile(double p){
+	size_t index;
+
+	if(results.numSamples == 0){ return 0; }
+	index = (size_t)(p * (results.numSamples - 1) + 0.5);
+	return results.samples[index] / 1000.0;
+}
+
+static void printText(double elapsed){
+	unsigned long long hist[HIST_BUCKETS] = {0};
+	int bucket;
+
+	printf("otp_bench: %d connections, %s, sizes %s %zu-%zu, mode %s\n", numConns,
+		rate > 0 ? "open loop" : "closed loop", sizes.kind == SIZE_EXP ? "exp" : sizes.kind == SIZE_UNIFORM ? "uniform" : "fixed",
+		sizes.min, sizes.max, modeName);
+	if(rate > 0){ printf("offered      %.1f req/s\n", rate); }
+	else{ printf("depth        %d per connection\n", depth); }
+	printf("requests     %llu ok, %llu failed, %llu busy, %llu mismatched\n", results.ok, results.failed, results.busy, results.mismatched);
+	printf("elapsed      %.3f s\n", elapsed);
+	printf("throughput   %.1f req/s, %.2f MB/s\n", results.ok / elapsed, results.bytes / elapsed / 1e6);
+	printf("latency us   min %.1f  p50 %.1f  p90 %.1f  p99 %.1f  p999 %.1f  max %.1f\n",
+		percentile(0), percentile(0.5), percentile(0.9), percentile(0.99), percentile(0.999), percentile(1));
+
+	for(size_t i = 0; i < results.numSamples; i++){
+		bucket = 0;
+		while(bucket < HIST_BUCKETS - 1 && results.samples[i] >= (2000ULL << bucket)){ bucket++; }
+		hist[bucket]++;
+	}
+	printf("histogram    (us, upper bound: count)\n");
+	for(int i = 0; i < HIST_BUCKETS; i++){
+		if(hist[i] > 0){ printf("  %10llu: %llu\n", 2ULL << i, hist[i]); }
+	}
+}
+
+static void printJSON(double elapsed){
+	unsigned long long hist[HIST_BUCKETS] = {0};
+	int bucket, firstOut = 1;
+
+	for(size_t i = 0; i < results.numSamples; i++){
+		bucket = 0;
+		while(bucket < HIST_BUCKETS - 1 && results.samples[i] >= (2000ULL << bucket)){ bucket++; }
+		hist[bucket]++;
+	}
+
+	printf("{\"connections\": %d, \"depth\": %d, \"rate\": %.1f, \"mode\": \"%s\", ", numConns, depth, rate, modeName);
+	printf("\"size\": {\"kind\": \"%s\", \"min\": %zu, \"max\": %zu}, ",
+		sizes.kind == SIZE_EXP ? "exp" : sizes.kind == SIZE_UNIFORM ? "uniform" : "fixed", sizes.min, sizes.max);
+	printf("\"ok\": %llu, \"failed\": %llu, \"busy\": %llu, \"mismatched\": %llu, \"elapsed_s\": %.6f, ", results.ok, results.failed, results.busy, results.mismatched, elapsed);
+	printf("\"requests_per_s\": %.1f, \"bytes_per_s\": %.1f, ", results.ok / elapsed, results.bytes / elapsed);
+	printf("\"latency_us\": {\"min\": %.1f, \"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, \"p999\": %.1f, \"max\": %.1f}, ",
+		percentile(0), percentile(0.5), percentile(0.9), percentile(0.99), percentile(0.999), percentile(1));
+	printf("\"histogram_us\": [");
+	for(int i = 0; i < HIST_BUCKETS; i++){
+		if(hist[i] == 0){ continue; }
+		printf("%s{\"le\": %llu, \"count\": %llu}", firstOut ? "" : ", ", 2ULL << i, hist[i]);
+		firstOut = 0;
+	}
+	printf("]}\n");
+}
@@ -0,0 +1,414 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "otp_cipher.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
+/*****************************
+ * Vector kernels
+ *
+ * The key alphabet is A-Z plus ' ', and the scalar code below works on raw
+ * ASCII values. For text and key characters from that alphabet both
+ * transforms reduce to small unsigned sums that fit in a byte:
+ *
+ *   encrypt: (text + key - 78) mod 26 + 'A', where text + key - 78 is in [19, 102]
+ *   decrypt: (text - key + 78) mod 26 + 'A', where text - key + 78 is in [53, 136]
+ *
+ * 78 is a multiple of 26, so adding or removing it doesn't change the result.
+ * The mod is done without division by conditionally subtracting 104, 52 and 26:
+ * min(s, s - n) picks s - n when s >= n and s otherwise, because s - n wraps
+ * around to something larger than s. A text ' ' always maps to ' '.
+ *
+ * Validity is checked in the same pass, on the vectors already loaded. Any
+ * block holding a character outside the alphabet goes through the scalar code
+ * instead, which finds the exact offset to report.
+ *****************************/
+
+// Function prototypes
+static int encryptResolve(char*, char*, char*, int);
+static int decryptResolve(char*, char*, char*, int);
+static int alwaysSupported();
+static void buildTables();
+
+// Dispatch targets, chosen by cipherInit() on first use
+static transformFn encryptImpl = encryptResolve;
+static transformFn decryptImpl = decryptResolve;
+static const char* implName = NULL;
+
+// Table kernels: alphabet position of every byte (0xFF if outside it) and every result
+static unsigned char charIndex[256];
+static char encryptResults[27][27];
+static char decryptResults[27][27];
+static int tablesBuilt = 0;
+
+int encryptText(char* enctext, char* plaintext, char* keytext, int size){
+	return encryptImpl(enctext, plaintext, keytext, size);
+}
+
+int decryptText(char* enctext, char* plaintext, char* keytext, int size){
+	return decryptImpl(enctext, plaintext, keytext, size);
+}
+
+/*****************************
+ * 1 if c is in the key alphabet, A-Z or ' '
+ *****************************/
+int validChar(char c){
+	return (c >= 'A' && c <= 'Z') || c == ' ';
+}
+
+int encryptTextScalar(char* enctext, char* plaintext, char* keytext, int size){
+	int letter1, letter2;
+
+	for(int i = 0; i < size; i++){
+		if(!validChar(plaintext[i]) || !validChar(keytext[i])){
+			return i;
+		}
+		if(plaintext[i] == ' '){
+			enctext[i] = ' ';
+		}
+		else{
+			letter1 = plaintext[i];
+			letter2 = keytext[i];
+			enctext[i] = ((letter1 + letter2) % 26) + 65;	// +65 to bring the alphabet "up" to 'A' in the ascii table
+		}
+	}
+	return size;
+}
+
+int decryptTextScalar(char* enctext, char* plaintext, char* keytext, int size){
+	int letter1, letter2, temp;
+
+	for(int i = 0; i < size; i++){
+		if(!validChar(plaintext[i]) || !validChar(keytext[i])){
+			return i;
+		}
+		if(plaintext[i] == ' '){
+			enctext[i] = ' ';
+		}
+		else{
+			letter1 = plaintext[i];
+			letter2 = keytext[i];
+			temp = letter1-letter2;
+
+			if(temp < 0){
+				temp += 26;
+				temp += 65;
+			}
+			else{
+				temp %= 26;
+				temp += 65;
+			}
+			enctext[i] = temp;
+		}
+	}
+	return size;
+}
+
+#ifdef HAVE_X86_SIMD
+
+/*****************************
+ * SSE2, 16 characters at a time
+ *****************************/
+__attribute__((target("sse2")))
+static inline int valid128(__m128i t, __m128i k){
+	const __m128i a = _mm_set1_epi8('A');
+	const __m128i z = _mm_set1_epi8(25);
+	const __m128i sp = _mm_set1_epi8(' ');
+	__m128i tl = _mm_sub_epi8(t, a);
+	__m128i kl = _mm_sub_epi8(k, a);
+	__m128i tv = _mm_or_si128(_mm_cmpeq_epi8(_mm_min_epu8(tl, z), tl), _mm_cmpeq_epi8(t, sp));
+	__m128i kv = _mm_or_si128(_mm_cmpeq_epi8(_mm_min_epu8(kl, z), kl), _mm_cmpeq_epi8(k, sp));
+
+	return _mm_movemask_epi8(_mm_and_si128(tv, kv)) == 0xFFFF;
+}
+
+__attribute__((target("sse2")))
+static inline __m128i reduce128(__m128i s, __m128i t){
+	const __m128i sp = _mm_set1_epi8(' ');
+	__m128i isSpace = _mm_cmpeq_epi8(t, sp);
+
+	s = _mm_min_epu8(s, _mm_sub_epi8(s, _mm_set1_epi8(52)));
+	s = _mm_min_epu8(s, _mm_sub_epi8(s, _mm_set1_epi8(26)));
+	s = _mm_add_epi8(s, _mm_set1_epi8('A'));
+	return _mm_or_si128(_mm_and_si128(isSpace, sp), _mm_andnot_si128(isSpace, s));
+}
+
+__attribute__((target("sse2")))
+static int encryptSSE2(char* out, char* text, char* key, int size){
+	int i = 0;
+
+	for(; i + 16 <= size; i += 16){
+		__m128i t = _mm_loadu_si128((const __m128i*)(text + i));
+		__m128i k = _mm_loadu_si128((const __m128i*)(key + i));
+
+		if(!valid128(t, k)){
+			return i + encryptTextScalar(out + i, text + i, key + i, 16);
+		}
+		__m128i s = _mm_sub_epi8(_mm_add_epi8(t, k), _mm_set1_epi8(78));
+		_mm_storeu_si128((__m128i*)(out + i), reduce128(s, t));
+	}
+	return i + encryptTextScalar(out + i, text + i, key + i, size - i);
+}
+
+__attribute__((target("sse2")))
+static int decryptSSE2(char* out, char* text, char* key, int size){
+	int i = 0;
+
+	for(; i + 16 <= size; i += 16){
+		__m128i t = _mm_loadu_si128((const __m128i*)(text + i));
+		__m128i k = _mm_loadu_si128((const __m128i*)(key + i));
+
+		if(!valid128(t, k)){
+			return i + decryptTextScalar(out + i, text + i, key + i, 16);
+		}
+		__m128i s = _mm_add_epi8(_mm_sub_epi8(t, k), _mm_set1_epi8(78));
+		s = _mm_min_epu8(s, _mm_sub_epi8(s, _mm_set1_epi8(104)));
+		_mm_storeu_si128((__m128i*)(out + i), reduce128(s, t));
+	}
+	return i + decryptTextScalar(out + i, text + i, key + i, size - i);
+}
+
+/*****************************
+ * AVX2, 32 characters at a time
+ *****************************/
+__attribute__((target("avx2")))
+static inline int valid256(__m256i t, __m256i k){
+	const __m256i a = _mm256_set1_epi8('A');
+	const __m256i z = _mm256_set1_epi8(25);
+	const __m256i sp = _mm256_set1_epi8(' ');
+	__m256i tl = _mm256_sub_epi8(t, a);
+	__m256i kl = _mm256_sub_epi8(k, a);
+	__m256i tv = _mm256_or_si256(_mm256_cmpeq_epi8(_mm256_min_epu8(tl, z), tl), _mm256_cmpeq_epi8(t, sp));
+	__m256i kv = _mm256_or_si256(_mm256_cmpeq_epi8(_mm256_min_epu8(kl, z), kl), _mm256_cmpeq_epi8(k, sp));
+
+	return _mm256_movemask_epi8(_mm256_and_si256(tv, kv)) == -1;
+}
+
+__attribute__((target("avx2")))
+static inline __m256i reduce256(__m256i s, __m256i t){
+	const __m256i sp = _mm256_set1_epi8(' ');
+
+	s = _mm256_min_epu8(s, _mm256_sub_epi8(s, _mm256_set1_epi8(52)));
+	s = _mm256_min_epu8(s, _mm256_sub_epi8(s, _mm256_set1_epi8(26)));
+	s = _mm256_add_epi8(s, _mm256_set1_epi8('A'));
+	return _mm256_blendv_epi8(s, sp, _mm256_cmpeq_epi8(t, sp));
+}
+
+__attribute__((target("avx2")))
+static int encryptAVX2(char* out, char* text, char* key, int size){
+	int i = 0;
+
+	for(; i + 32 <= size; i += 32){
+		__m256i t = _mm256_loadu_si256((const __m256i*)(text + i));
+		__m256i k = _mm256_loadu_si256((const __m256i*)(key + i));
+
+		if(!valid256(t, k)){
+			return i + encryptTextScalar(out + i, text + i, key + i, 32);
+		}
+		__m256i s = _mm256_sub_epi8(_mm256_add_epi8(t, k), _mm256_set1_epi8(78));
+		_mm256_storeu_si256((__m256i*)(out + i), reduce256(s, t));
+	}
+	return i + encryptSSE2(out + i, text + i, key + i, size - i);
+}
+
+__attribute__((target("avx2")))
+static int decryptAVX2(char* out, char* text, char* key, int size){
+	int i = 0;
+
+	for(; i + 32 <= size; i += 32){
+		__m256i t = _mm256_loadu_si256((const __m256i*)(text + i));
+		__m256i k = _mm256_loadu_si256((const __m256i*)(key + i));
+
+		if(!valid256(t, k)){
+			return i + decryptTextScalar(out + i, text + i, key + i, 32);
+		}
+		__m256i s = _mm256_add_epi8(_mm256_sub_epi8(t, k), _mm256_set1_epi8(78));
+		s = _mm256_min_epu8(s, _mm256_sub_epi8(s, _mm256_set1_epi8(104)));
+		_mm256_storeu_si256((__m256i*)(out + i), reduce256(s, t));
+	}
+	return i + decryptSSE2(out + i, text + i, key + i, size - i);
+}
+
+/*****************************
+ * AVX-512BW, 64 characters at a time. Compares produce mask registers,
+ * so the space blend and the validity check are single instructions.
+ *****************************/
+__attribute__((target("avx512f,avx512bw")))
+static inline int valid512(__m512i t, __m512i k){
+	const __m512i a = _mm512_set1_epi8('A');
+	const __m512i z = _mm512_set1_epi8(25);
+	const __m512i sp = _mm512_set1_epi8(' ');
+	__mmask64 tv = _mm512_cmple_epu8_mask(_mm512_sub_epi8(t, a), z) | _mm512_cmpeq_epi8_mask(t, sp);
+	__mmask64 kv = _mm512_cmple_epu8_mask(_mm512_sub_epi8(k, a), z) | _mm512_cmpeq_epi8_mask(k, sp);
+
+	return (tv & kv) == ~(__mmask64)0;
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static inline __m512i reduce512(__m512i s, __m512i t){
+	const __m512i sp = _mm512_set1_epi8(' ');
+
+	s = _mm512_min_epu8(s, _mm512_sub_epi8(s, _mm512_set1_epi8(52)));
+	s = _mm512_min_epu8(s, _mm512_sub_epi8(s, _mm512_set1_epi8(26)));
+	s = _mm512_add_epi8(s, _mm512_set1_epi8('A'));
+	return _mm512_mask_blend_epi8(_mm512_cmpeq_epi8_mask(t, sp), s, sp);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static int encryptAVX512(char* out, char* text, char* key, int size){
+	int i = 0;
+
+	for(; i + 64 <= size; i += 64){
+		__m512i t = _mm512_loadu_si512((const void*)(text + i));
+		__m512i k = _mm512_loadu_si512((const void*)(key + i));
+
+		if(!valid512(t, k)){
+			return i + encryptTextScalar(out + i, text + i, key + i, 64);
+		}
+		__m512i s = _mm512_sub_epi8(_mm512_add_epi8(t, k), _mm512_set1_epi8(78));
+		_mm512_storeu_si512((void*)(out + i), reduce512(s, t));
+	}
+	return i + encryptSSE2(out + i, text + i, key + i, size - i);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static int decryptAVX512(char* out, char* text, char* key, int size){
+	int i = 0;
+
+	for(; i + 64 <= size; i += 64){
+		__m512i t = _mm512_loadu_si512((const void*)(text + i));
+		__m512i k = _mm512_loadu_si512((const void*)(key + i));
+
+		if(!valid512(t, k)){
+			return i + decryptTextScalar(out + i, text + i, key + i, 64);
+		}
+		__m512i s = _mm512_add_epi8(_mm512_sub_epi8(t, k), _mm512_set1_epi8(78));
+		s = _mm512_min_epu8(s, _mm512_sub_epi8(s, _mm512_set1_epi8(104)));
+		_mm512_storeu_si512((void*)(out + i), reduce512(s, t));
+	}
+	return i + decryptSSE2(out + i, text + i, key + i, size - i);
+}
+
+static int haveSSE2(){ __builtin_cpu_init(); return __builtin_cpu_supports("sse2") != 0; }
+static int haveAVX2(){ __builtin_cpu_init(); return __builtin_cpu_supports("avx2") != 0; }
+static int haveAVX512(){ __builtin_cpu_init(); return __builtin_cpu_supports("avx512bw") != 0; }
+
+#endif
+
+/*****************************
+ * Table driven, one lookup per character. Portable, and faster than the
+ * scalar code wherever there are no vector kernels.
+ *****************************/
+static int encryptTable(char* out, char* text, char* key, int size){
+	unsigned char t, k;
+
+	if(!tablesBuilt){ buildTables(); }
+	for(int i = 0; i < size; i++){
+		t = charIndex[(unsigned char)text[i]];
+		k = charIndex[(unsigned char)key[i]];
+		if((t | k) & 0x80){ return i; }
+		out[i] = encryptResults[t][k];
+	}
+	return size;
+}
+
+static int decryptTable(char* out, char* text, char* key, int size){
+	unsigned char t, k;
+
+	if(!tablesBuilt){ buildTables(); }
+	for(int i = 0; i < size; i++){
+		t = charIndex[(unsigned char)text[i]];
+		k = charIndex[(unsigned char)key[i]];
+		if((t | k) & 0x80){ return i; }
+		out[i] = decryptResults[t][k];
+	}
+	return size;
+}
+
+/*****************************
+ * Fill the lookup tables from the scalar code, so they can't disagree with it
+ *****************************/
+static void buildTables(){
+	const char* alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZ ";
+
+	memset(charIndex, 0xFF, sizeof(charIndex));
+	for(int t = 0; t < 27; t++){
+		charIndex[(unsigned char)alphabet[t]] = t;
+		for(int k = 0; k < 27; k++){
+			encryptTextScalar(&encryptResults[t][k], (char*)alphabet + t, (char*)alphabet + k, 1);
+			decryptTextScalar(&decryptResults[t][k], (char*)alphabet + t, (char*)alphabet + k, 1);
+		}
+	}
+	tablesBuilt = 1;
+}
+
+// Best first. cipherInit() takes the first one the CPU supports.
+static const struct cipherImpl impls[] = {
+#ifdef HAVE_X86_SIMD
+	{ "avx512", haveAVX512, encryptAVX512, decryptAVX512 },
+	{ "avx2", haveAVX2, encryptAVX2, decryptAVX2 },
+	{ "sse2", haveSSE2, encryptSSE2, decryptSSE2 },
+#endif
+	{ "table", alwaysSupported, encryptTable, decryptTable },
+	{ "scalar", alwaysSupported, encryptTextScalar, decryptTextScalar },
+};
+
+static int alwaysSupported(){ return 1; }
+
+/*****************************
+ * Pick the fastest implementation this CPU supports. OTP_CIPHER=<name> in the
+ * environment forces a specific one, as long as the CPU can run it.
+ * Returns the name of the implementation in use.
+ *****************************/
+const char* cipherInit(){
+	const char* forced = getenv("OTP_CIPHER");
+	int count = sizeof(impls) / sizeof(impls[0]);
+
+	if(implName != NULL){ return implName; }
+
+	for(int i = 0; i < count; i++){
+		if(forced != NULL && strcmp(forced, impls[i].name) != 0){ continue; }
+		if(!impls[i].supported()){ continue; }
+
+		encryptImpl = impls[i].encrypt;
+		decryptImpl = impls[i].decrypt;
+		implName = impls[i].name;
+		return implName;
+	}
+
+	if(forced != NULL){
+		fprintf(stderr, "WARNING: OTP_CIPHER=%s is not available here, using the default.\n", forced);
+		unsetenv("OTP_CIPHER");
+		return cipherInit();
+	}
+
+	// Unreachable: the scalar implementation is always supported
+	encryptImpl = encryptTextScalar;
+	decryptImpl = decryptTextScalar;
+	implName = "scalar";
+	return implName;
+}
+
+/*****************************
+ * Every implementation compiled in, best first, whether or not this CPU
+ * supports it. Used by the benchmarks to compare them side by side.
+ *****************************/
+const struct cipherImpl* cipherImpls(int* count){
+	*count = sizeof(impls) / sizeof(impls[0]);
+	return impls;
+}
+
+static int encryptResolve(char* enctext, char* plaintext, char* keytext, int size){
+	cipherInit();
+	return encryptImpl(enctext, plaintext, keytext, size);
+}
+
+static int decryptResolve(char* enctext, char* plaintext, char* keytext, int size){
+	cipherInit();
+	return decryptImpl(enctext, plaintext, keytext, size);
+}
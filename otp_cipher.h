@@ -0,0 +1,32 @@
+#ifndef OTP_CIPHER_H
+#define OTP_CIPHER_H
+
+/*****************************
+ * Transforms size characters of text with key into out, checking both as it
+ * goes. Returns size, or the offset of the first position where the text or
+ * the key holds a character outside A-Z and ' '. Output before that offset
+ * is complete and nothing from it on is written, so text can be out.
+ *****************************/
+typedef int (*transformFn)(char*, char*, char*, int);
+
+/*****************************
+ * One implementation of the 27 character transform. The scalar
+ * implementation is the reference every other one must match.
+ *****************************/
+struct cipherImpl {
+	const char* name;
+	int (*supported)(void);		// 1 if this CPU can run it
+	transformFn encrypt;
+	transformFn decrypt;
+};
+
+int encryptText(char*, char*, char*, int);
+int decryptText(char*, char*, char*, int);
+int encryptTextScalar(char*, char*, char*, int);
+int decryptTextScalar(char*, char*, char*, int);
+int validChar(char);
+
+const char* cipherInit();
+const struct cipherImpl* cipherImpls(int*);
+
+#endif
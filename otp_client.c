@@ -0,0 +1,978 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <sys/un.h>
+#include "otp_client.h"
+
+#define h_addr h_addr_list[0] /* for backward compatibility */
+
+#define SEND_PIECES 64	// Most pieces gathered into one sendmsg()
+#define PIPE_WINDOW (4 * CHUNK_SIZE)	// Streamed text sent but not answered yet
+#define PIPE_NEWLINES 4096	// Newlines waiting to be put back in the output
+
+/*****************************
+ * Sending side of a session. Nothing is built in memory: each request header,
+ * record header, text chunk and key chunk is sent from where it already
+ * lives, and as many of them as fit are gathered into one sendmsg(), so a
+ * run of small requests goes out in a single system call.
+ *****************************/
+struct sendState {
+	const struct otpMessage* msgs;
+	int count;
+	int current;		// Message being queued
+	size_t offset;		// Text characters of it already queued in records
+	int headerQueued;	// Its request header is queued
+	char records[SEND_PIECES][BIN_RECORD_SIZE];
+	int numRecords;
+	struct iovec iov[SEND_PIECES];
+	int first;			// First piece not completely sent
+	int queued;			// Pieces queued
+};
+
+/*****************************
+ * Both sides of streaming an input of unknown length. Text is read a chunk at
+ * a time and only while less than PIPE_WINDOW of it is unanswered. Newlines
+ * are taken out before sending, since the cipher has no place for them, and
+ * put back at the same text offsets in the output.
+ *****************************/
+struct pipeState {
+	int inFD;
+	const char* key;	// NULL when the header refers to a key the daemon holds
+	size_t keyLimit;	// Text characters the key can cover
+	char raw[CHUNK_SIZE];
+	char text[CHUNK_SIZE];	// Chunk being sent, newlines removed
+	char record[BIN_RECORD_SIZE];
+	struct iovec iov[4];	// Request header + record header + text + key
+	int first;
+	int queued;
+	size_t sent;		// Text characters queued so far
+	size_t answered;	// Text characters written out so far
+	size_t newlines[PIPE_NEWLINES];	// Text offsets the newlines go back at
+	size_t nlHead;
+	size_t nlCount;
+	int ended;			// End of input seen and end record queued
+};
+
+/*****************************
+ * Receiving side: which record we are in and how much of it is left
+ *****************************/
+struct recvState {
+	char record[BIN_RECORD_SIZE];
+	size_t have;		// Record header bytes received
+	char type;
+	size_t left;		// Payload bytes still to come
+	char errorMsg[256];
+	size_t errorLen;
+	int replies;		// End records received
+	int expected;		// End records the session is waiting for
+	int newlines;		// Write a newline after each reply
+	struct pipeState* pipe;	// Streaming input: data goes through pipeOut()
+	int passedFD;		// Descriptor that came with the last read, if havePassedFD
+	int havePassedFD;
+	int finished;		// Every reply, or an error record, fully received
+};
+
+// Function prototypes
+static void queuePieces(struct sendState*);
+static void pushPiece(struct sendState*, const char*, size_t);
+static void advanceSent(struct sendState*, size_t);
+static int readPipe(struct pipeState*);
+static void pipeOut(struct pipeState*, const char*, size_t);
+static unsigned long long readKeyId(const char*, int*, size_t*);
+static int registerKeyFile(int, int, size_t, unsigned long long);
+static void writeOut(const char*, size_t);
+static void copyOut(int);
+static int receiveReply(int, struct recvState*);
+static int replyResult(struct recvState*);
+
+// Global vars
+static const char* socketPath = NULL;	// Daemon's UNIX socket, NULL to use TCP
+
+/*****************************
+ * Make connectDaemon() use the daemon's UNIX socket at path rather than TCP.
+ * Client and daemon always share a host, and this skips the TCP/IP stack.
+ *****************************/
+void useSocketPath(const char* path){
+	socketPath = path;
+}
+
+/*****************************
+ * Connect to the daemon listening on portNumber on this machine, or on the
+ * socket given to useSocketPath(). Exits on failure.
+ *****************************/
+int connectDaemon(int portNumber){
+	int socketFD;
+	struct sockaddr_in serverAddress;
+	struct sockaddr_un unixAddress;
+	struct hostent* serverHostInfo;
+
+	if(socketPath != NULL){
+		memset(&unixAddress, '\0', sizeof(unixAddress));
+		unixAddress.sun_family = AF_UNIX;
+		if(strlen(socketPath) >= sizeof(unixAddress.sun_path)){ fprintf(stderr, "CLIENT: ERROR, socket path too long\n"); exit(1); }
+		strcpy(unixAddress.sun_path, socketPath);
+
+		socketFD = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (socketFD < 0) { perror("CLIENT: ERROR opening socket"); exit(0); }
+		if (connect(socketFD, (struct sockaddr*)&unixAddress, sizeof(unixAddress)) < 0)
+			{ perror("CLIENT: ERROR connecting"); exit(0); }
+		return socketFD;
+	}
+
+	// Set up the server address struct
+	memset((char*)&serverAddress, '\0', sizeof(serverAddress)); // Clear out the address struct
+	serverAddress.sin_family = AF_INET; 						// Create a network-capable socket
+	serverAddress.sin_port = htons(portNumber); 				// Store the port number
+	serverHostInfo = gethostbyname("localhost"); 				// Convert the machine name into a special form of address
+
+	if (serverHostInfo == NULL) { fprintf(stderr, "CLIENT: ERROR, no such host\n"); exit(0); }
+	memcpy((char*)&serverAddress.sin_addr.s_addr, (char*)serverHostInfo->h_addr, serverHostInfo->h_length); // Copy in the address
+
+	// Set up the socket
+	socketFD = socket(AF_INET, SOCK_STREAM, 0); 				// Create the socket
+	if (socketFD < 0) { perror("CLIENT: ERROR opening socket"); exit(0); }
+
+	// Connect to server
+	if (connect(socketFD, (struct sockaddr*)&serverAddress, sizeof(serverAddress)) < 0) // Connect socket to address
+		{ perror("CLIENT: ERROR connecting"); exit(0); }
+
+	return socketFD;
+}
+
+/*****************************
+ * Send count messages back to back on one connection, each as a request
+ * header followed by records of text and key, and write the transformed
+ * texts to stdout as they come back, with a newline after each if newlines
+ * is set. Sending and receiving run side by side, so neither end ever has to
+ * hold more than a chunk, requests are pipelined without waiting for
+ * replies, and large messages cannot deadlock with both sides in send().
+ * Returns 0 on success, 1 if the daemon answered with an error and 2 if it
+ * does not know the key a header refers to.
+ *****************************/
+int streamRequests(int socketFD, const struct otpMessage* msgs, int count, int newlines){
+	struct sendState out;
+	struct recvState in;
+	struct pollfd pfd;
+	struct msghdr msg;
+	ssize_t n;
+
+	memset(&out, '\0', sizeof(out));
+	out.msgs = msgs;
+	out.count = count;
+	queuePieces(&out);
+
+	memset(&in, '\0', sizeof(in));
+	in.expected = count;
+	in.newlines = newlines;
+	in.finished = count == 0;
+
+	memset(&msg, '\0', sizeof(msg));
+
+	while(!in.finished){
+		pfd.fd = socketFD;
+		pfd.events = POLLIN | (out.first < out.queued ? POLLOUT : 0);
+		pfd.revents = 0;
+
+		if(poll(&pfd, 1, -1) < 0){
+			if(errno == EINTR){ continue; }
+			perror("CLIENT: ERROR polling socket");
+			exit(1);
+		}
+
+		if(pfd.revents & POLLOUT){
+			msg.msg_iov = out.iov + out.first;
+			msg.msg_iovlen = out.queued - out.first;
+			n = sendmsg(socketFD, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);	// Never block with the reply unread
+			if(n < 0 && (errno == EPIPE || errno == ECONNRESET)){
+				out.first = out.queued;		// Daemon gave up on a request, its reason is in the reply
+				out.current = out.count;
+				continue;
+			}
+			if(n < 0 && errno != EINTR && errno != EAGAIN){
+				perror("CLIENT: ERROR writing to socket");
+				exit(1);
+			}
+			if(n > 0){ advanceSent(&out, n); }
+		}
+
+		if(pfd.revents & (POLLIN | POLLHUP | POLLERR)){
+			if(receiveReply(socketFD, &in) != 0){
+				fprintf(stderr, "CLIENT: ERROR connection closed before the reply was complete\n");
+				exit(1);
+			}
+		}
+	}
+
+	return replyResult(&in);
+}
+
+/*****************************
+ * Split a mapped input into messages. In session mode every line of the file
+ * is a message, otherwise the text before the first newline is the only one.
+ * Stores the total text size in total and returns the number of messages.
+ * Headers and keys are left for the caller to fill in.
+ *****************************/
+int splitMessages(const struct inputFile* file, int session, struct otpMessage** msgs, size_t* total){
+	const char* pos = file->data;
+	const char* end = file->data + file->mapped;
+	const char* newline;
+	int count = 0, room = 1;
+
+	*msgs = malloc(sizeof(struct otpMessage));
+	if(*msgs == NULL){ fprintf(stderr, "ERROR: out of memory.\n"); exit(1); }
+	*total = 0;
+
+	if(!session){
+		(*msgs)[0].text = file->data;
+		(*msgs)[0].textSize = file->size;
+		*total = file->size;
+		return 1;
+	}
+
+	while(pos < end){
+		if(count == room){
+			room *= 2;
+			*msgs = realloc(*msgs, room * sizeof(struct otpMessage));
+			if(*msgs == NULL){ fprintf(stderr, "ERROR: out of memory.\n"); exit(1); }
+		}
+		newline = memchr(pos, '\n', end - pos);
+		if(newline == NULL){ newline = end; }
+
+		(*msgs)[count].text = pos;
+		(*msgs)[count].textSize = newline - pos;
+		*total += newline - pos;
+		count++;
+		pos = newline + 1;
+	}
+	return count;
+}
+
+/*****************************
+ * Give every message its own stretch of key, one after the other from the
+ * start of key, and a request header carrying it
+ *****************************/
+void attachKey(struct otpMessage* msgs, int count, unsigned char op, const char* key, size_t keySize){
+	struct binHeader req = { .op = op };
+	size_t offset = 0;
+
+	for(int i = 0; i < count; i++){
+		msgs[i].key = key + offset;
+		req.textSize = msgs[i].textSize;
+		req.keySize = count == 1 ? keySize : msgs[i].textSize;
+		formatBinHeader(msgs[i].header, &req);
+		msgs[i].headerLen = BIN_HEADER_SIZE;
+		offset += msgs[i].textSize;
+	}
+}
+
+/*****************************
+ * Send the text read from inFD as one request, starting with header, and
+ * write the transformed text to stdout as it comes back. Newlines in the
+ * input go straight to the output and use no key. key covers up to keyLimit
+ * characters, which the header announces as the text size since the real
+ * size isn't known until the input ends. Returns like streamRequests().
+ *****************************/
+int streamInput(int socketFD, const char* header, size_t headerLen, int inFD, const char* key, size_t keyLimit){
+	struct pipeState* out;
+	struct recvState in;
+	struct pollfd pfd[2];
+	struct msghdr msg;
+	ssize_t n;
+	int result, on = 1;
+
+	// Records go out as soon as input arrives, rather than waiting on acks
+	setsockopt(socketFD, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+	out = calloc(1, sizeof(*out));
+	if(out == NULL){ fprintf(stderr, "ERROR: out of memory.\n"); exit(1); }
+	out->inFD = inFD;
+	out->key = key;
+	out->keyLimit = keyLimit;
+	out->iov[0].iov_base = (char*)header;
+	out->iov[0].iov_len = headerLen;
+	out->queued = 1;
+
+	memset(&in, '\0', sizeof(in));
+	in.expected = 1;
+	in.pipe = out;
+
+	memset(&msg, '\0', sizeof(msg));
+
+	while(!in.finished){
+		// Read more only once the last chunk is gone and the window has room.
+		// A negative fd keeps poll() from reporting a hung up pipe meanwhile.
+		pfd[0].fd = (out->first == out->queued && !out->ended && out->sent - out->answered < PIPE_WINDOW) ? inFD : -1;
+		pfd[0].events = POLLIN;
+		pfd[1].fd = socketFD;
+		pfd[1].events = POLLIN | (out->first < out->queued ? POLLOUT : 0);
+		pfd[0].revents = pfd[1].revents = 0;
+
+		if(poll(pfd, 2, -1) < 0){
+			if(errno == EINTR){ continue; }
+			perror("CLIENT: ERROR polling socket");
+			exit(1);
+		}
+
+		if(pfd[0].revents & (POLLIN | POLLHUP | POLLERR)){
+			if(readPipe(out) != 0){ exit(1); }
+		}
+
+		if(pfd[1].revents & POLLOUT){
+			msg.msg_iov = out->iov + out->first;
+			msg.msg_iovlen = out->queued - out->first;
+			n = sendmsg(socketFD, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+			if(n < 0 && (errno == EPIPE || errno == ECONNRESET)){
+				out->first = out->queued;	// Daemon gave up, its reason is in the reply
+				out->ended = 1;
+				continue;
+			}
+			if(n < 0 && errno != EINTR && errno != EAGAIN){
+				perror("CLIENT: ERROR writing to socket");
+				exit(1);
+			}
+			while(n > 0){
+				if((size_t)n < out->iov[out->first].iov_len){
+					out->iov[out->first].iov_base = (char*)out->iov[out->first].iov_base + n;
+					out->iov[out->first].iov_len -= n;
+					break;
+				}
+				n -= out->iov[out->first].iov_len;
+				out->first++;
+			}
+		}
+
+		if(pfd[1].revents & (POLLIN | POLLHUP | POLLERR)){
+			if(receiveReply(socketFD, &in) != 0){
+				fprintf(stderr, "CLIENT: ERROR connection closed before the reply was complete\n");
+				exit(1);
+			}
+		}
+	}
+
+	// Newlines after the last of the text
+	if(in.type == RECORD_END){ pipeOut(out, NULL, 0); }
+
+	result = replyResult(&in);
+	free(out);
+	return result;
+}
+
+/*****************************
+ * Read what inFD has, take the newlines out and queue the rest as a data
+ * record, or queue the end record at the end of the input. Returns -1 if
+ * the input can't be read or is longer than the key.
+ *****************************/
+static int readPipe(struct pipeState* out){
+	size_t room = PIPE_NEWLINES - out->nlCount;
+	size_t textLen = 0;
+	ssize_t n;
+
+	// Every byte read could be a newline, so never read more than fit
+	if(room == 0){ return 0; }
+	n = read(out->inFD, out->raw, room < CHUNK_SIZE ? room : CHUNK_SIZE);
+	if(n < 0){
+		if(errno == EINTR || errno == EAGAIN){ return 0; }
+		perror("CLIENT: ERROR reading input");
+		return -1;
+	}
+
+	for(ssize_t i = 0; i < n; i++){
+		if(out->raw[i] == '\n'){
+			out->newlines[(out->nlHead + out->nlCount++) % PIPE_NEWLINES] = out->sent + textLen;
+		}
+		else{
+			out->text[textLen++] = out->raw[i];
+		}
+	}
+
+	out->first = 0;
+	out->queued = 0;
+	if(n == 0){
+		formatBinRecord(out->record, RECORD_END, 0);
+		out->iov[out->queued].iov_base = out->record;
+		out->iov[out->queued++].iov_len = BIN_RECORD_SIZE;
+		out->ended = 1;
+		return 0;
+	}
+	if(textLen == 0){
+		pipeOut(out, NULL, 0);		// Only newlines, they may be due already
+		return 0;
+	}
+	if(out->sent + textLen > out->keyLimit){
+		fprintf(stderr, "ERROR: plaintext size is greater than keysize.\n");
+		return -1;
+	}
+
+	formatBinRecord(out->record, RECORD_DATA, textLen);
+	out->iov[out->queued].iov_base = out->record;
+	out->iov[out->queued++].iov_len = BIN_RECORD_SIZE;
+	out->iov[out->queued].iov_base = out->text;
+	out->iov[out->queued++].iov_len = textLen;
+	if(out->key != NULL){
+		out->iov[out->queued].iov_base = (char*)out->key + out->sent;
+		out->iov[out->queued++].iov_len = textLen;
+	}
+	out->sent += textLen;
+	return 0;
+}
+
+/*****************************
+ * Write len characters of reply text, putting each newline back once the
+ * text before it is out. With len 0 this just writes the newlines that are due.
+ *****************************/
+static void pipeOut(struct pipeState* out, const char* buf, size_t len){
+	size_t take;
+
+	for(;;){
+		while(out->nlCount > 0 && out->newlines[out->nlHead] == out->answered){
+			writeOut("\n", 1);
+			out->nlHead = (out->nlHead + 1) % PIPE_NEWLINES;
+			out->nlCount--;
+		}
+		if(len == 0){ return; }
+
+		take = len;
+		if(out->nlCount > 0 && out->newlines[out->nlHead] - out->answered < take){
+			take = out->newlines[out->nlHead] - out->answered;
+		}
+		writeOut(buf, take);
+		out->answered += take;
+		buf += take;
+		len -= take;
+	}
+}
+
+/*****************************
+ * Open path for streaming when it can't be mapped: "-" for stdin, or
+ * anything that isn't a regular file, like a pipe. Returns -1 for a
+ * regular file, which is better mapped with mapInput().
+ *****************************/
+int openStream(const char* path){
+	struct stat info;
+	int fd;
+
+	if(strcmp(path, "-") == 0){ return STDIN_FILENO; }
+	if(stat(path, &info) < 0 || S_ISREG(info.st_mode)){ return -1; }
+
+	fd = open(path, O_RDONLY);
+	if(fd < 0){
+		fprintf(stderr, "ERROR: could not open %s.\n", path);
+		exit(1);
+	}
+	return fd;
+}
+
+/*****************************
+ * Transform the first textSize characters of the file at textPath with the
+ * key file at keyPath by passing the daemon both descriptors over its UNIX
+ * socket. The result comes back as a descriptor too and goes to stdout
+ * without passing through this process. Returns like streamRequests().
+ *****************************/
+int fdRequest(int socketFD, unsigned char op, const char* textPath, size_t textSize, const char* keyPath, size_t keySize){
+	char header[BIN_HEADER_SIZE];
+	struct binHeader req = { .op = op, .flags = BIN_FLAG_FDS, .textSize = textSize, .keySize = keySize };
+	union { struct cmsghdr align; char buf[CMSG_SPACE(2 * sizeof(int))]; } control;
+	struct iovec iov = { header, BIN_HEADER_SIZE };
+	struct msghdr msg;
+	struct cmsghdr* cmsg;
+	struct recvState in;
+	int fds[2];
+	ssize_t n;
+
+	fds[0] = open(textPath, O_RDONLY | O_CLOEXEC);
+	fds[1] = open(keyPath, O_RDONLY | O_CLOEXEC);
+	if(fds[0] < 0 || fds[1] < 0){ perror("CLIENT: ERROR opening input"); exit(1); }
+	formatBinHeader(header, &req);
+
+	memset(&msg, '\0', sizeof(msg));
+	memset(&control, '\0', sizeof(control));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+	// A stream socket takes a 40 byte header whole
+	n = sendmsg(socketFD, &msg, MSG_NOSIGNAL);
+	if(n != BIN_HEADER_SIZE){ perror("CLIENT: ERROR writing to socket"); exit(1); }
+	close(fds[0]);
+	close(fds[1]);
+
+	memset(&in, '\0', sizeof(in));
+	in.expected = 1;
+	while(!in.finished){
+		if(receiveReply(socketFD, &in) != 0){
+			fprintf(stderr, "CLIENT: ERROR connection closed before the reply was complete\n");
+			exit(1);
+		}
+	}
+	return replyResult(&in);
+}
+
+/*****************************
+ * Store keySize characters of key in the daemon's key registry under id.
+ * The daemon answers once the key is safely stored.
+ * Returns 0 on success and 1 if the daemon did not take the key.
+ *****************************/
+int registerKey(int socketFD, unsigned long long id, const char* key, size_t keySize){
+	char header[BIN_HEADER_SIZE];
+	struct binHeader req = { .op = BIN_OP_REGISTER, .keySize = keySize, .keyId = id };
+	struct recvState in;
+	size_t sent = 0;
+	ssize_t n;
+
+	formatBinHeader(header, &req);
+	if(send(socketFD, header, BIN_HEADER_SIZE, MSG_NOSIGNAL) != BIN_HEADER_SIZE){
+		perror("CLIENT: ERROR writing to socket");
+		exit(1);
+	}
+
+	// The daemon says nothing until the whole key is in, unless it gives up
+	// early, in which case the send fails and the reason is in the reply.
+	while(sent < keySize){
+		n = send(socketFD, key + sent, keySize - sent, MSG_NOSIGNAL);
+		if(n < 0){
+			if(errno == EINTR){ continue; }
+			break;
+		}
+		sent += n;
+	}
+
+	memset(&in, '\0', sizeof(in));
+	in.expected = 1;
+	while(!in.finished){
+		if(receiveReply(socketFD, &in) != 0){
+			fprintf(stderr, "CLIENT: ERROR connection closed before the key was stored\n");
+			exit(1);
+		}
+	}
+	return replyResult(&in);
+}
+
+/*****************************
+ * Send msgs using keyPath as a key the daemon on portNumber holds, the first
+ * message starting keyOffset characters into it and each later one where the
+ * one before stopped. Only the key's id goes over the wire. If the daemon
+ * doesn't know the key yet it is registered once and the messages are sent
+ * again. flags may add BIN_FLAG_ALLOCATE, which has the daemon pick the
+ * offsets instead. Returns like streamRequests().
+ *****************************/
+int keyRefRequest(int portNumber, unsigned char op, unsigned char flags, struct otpMessage* msgs, int count, const char* keyPath, size_t keyOffset, int newlines){
+	struct binHeader req = { .op = op, .flags = BIN_FLAG_KEY_REF | flags };
+	unsigned long long id;
+	size_t keySize, textSize = 0;
+	int keyFD, socketFD, result;
+
+	id = readKeyId(keyPath, &keyFD, &keySize);
+	req.keyId = id;
+
+	for(int i = 0; i < count; i++){
+		msgs[i].key = NULL;
+		req.textSize = msgs[i].textSize;
+		req.keyOffset = keyOffset + textSize;
+		formatBinHeader(msgs[i].header, &req);
+		msgs[i].headerLen = BIN_HEADER_SIZE;
+		textSize += msgs[i].textSize;
+	}
+	if(keyOffset > keySize || textSize > keySize - keyOffset){
+		fprintf(stderr, "ERROR: plaintext size is greater than keysize.\n");
+		exit(1);
+	}
+
+	socketFD = connectDaemon(portNumber);
+	result = streamRequests(socketFD, msgs, count, newlines);
+	close(socketFD);
+	if(result != 2){
+		close(keyFD);
+		return result;
+	}
+
+	// First use of this key: hand it over and try again
+	result = registerKeyFile(portNumber, keyFD, keySize, id);
+	close(keyFD);
+	if(result != 0){ return result; }
+
+	socketFD = connectDaemon(portNumber);
+	result = streamRequests(socketFD, msgs, count, newlines);
+	close(socketFD);
+	if(result == 2){
+		fprintf(stderr, "ERROR: daemon lost the key after registering it.\n");
+		return 1;
+	}
+	return result;
+}
+
+/*****************************
+ * keyRefRequest() for text read from inFD as it comes. Input can't be sent
+ * twice, so an empty request checks first that the daemon holds the key,
+ * and the text follows on the same connection.
+ *****************************/
+int keyRefStream(int portNumber, unsigned char op, int inFD, const char* keyPath, size_t keyOffset){
+	struct binHeader req = { .op = op, .flags = BIN_FLAG_KEY_REF, .keyOffset = keyOffset };
+	struct otpMessage probe;
+	unsigned long long id;
+	size_t keySize;
+	int keyFD, socketFD, result;
+
+	id = readKeyId(keyPath, &keyFD, &keySize);
+	if(keyOffset > keySize){
+		fprintf(stderr, "ERROR: plaintext size is greater than keysize.\n");
+		exit(1);
+	}
+
+	memset(&probe, '\0', sizeof(probe));
+	req.keyId = id;
+	formatBinHeader(probe.header, &req);
+	probe.headerLen = BIN_HEADER_SIZE;
+
+	socketFD = connectDaemon(portNumber);
+	result = streamRequests(socketFD, &probe, 1, 0);
+	if(result == 2){
+		close(socketFD);
+		result = registerKeyFile(portNumber, keyFD, keySize, id);
+		if(result != 0){ close(keyFD); return result; }
+
+		socketFD = connectDaemon(portNumber);
+		result = streamRequests(socketFD, &probe, 1, 0);
+		if(result == 2){
+			fprintf(stderr, "ERROR: daemon lost the key after registering it.\n");
+			result = 1;
+		}
+	}
+	close(keyFD);
+
+	if(result == 0){
+		req.textSize = keySize - keyOffset;
+		formatBinHeader(probe.header, &req);
+		result = streamInput(socketFD, probe.header, BIN_HEADER_SIZE, inFD, NULL, keySize - keyOffset);
+	}
+	close(socketFD);
+	return result;
+}
+
+/*****************************
+ * Open keyPath and work out its size and id. The key is the file without
+ * its trailing newline. Its id only needs the two ends of it, the middle is
+ * never read here. Exits if the key can't be read.
+ *****************************/
+static unsigned long long readKeyId(const char* keyPath, int* keyFD, size_t* keySize){
+	char head[KEY_SAMPLE], tail[KEY_SAMPLE];
+	struct stat info;
+	size_t sample;
+
+	*keyFD = open(keyPath, O_RDONLY);
+	if(*keyFD < 0 || fstat(*keyFD, &info) < 0 || info.st_size == 0){
+		fprintf(stderr, "ERROR: keyfile does not exist or is null.\n");
+		exit(1);
+	}
+
+	*keySize = info.st_size;
+	if(pread(*keyFD, tail, 1, *keySize - 1) == 1 && tail[0] == '\n'){ (*keySize)--; }
+	sample = *keySize < KEY_SAMPLE ? *keySize : KEY_SAMPLE;
+	if(pread(*keyFD, head, sample, 0) != (ssize_t)sample || pread(*keyFD, tail, sample, *keySize - sample) != (ssize_t)sample){
+		fprintf(stderr, "ERROR: could not read key file.\n");
+		exit(1);
+	}
+	return keyId(head, tail, *keySize);
+}
+
+/*****************************
+ * Map the key open on keyFD and register it with the daemon on portNumber.
+ * Returns like registerKey().
+ *****************************/
+static int registerKeyFile(int portNumber, int keyFD, size_t keySize, unsigned long long id){
+	char* key;
+	int socketFD, result;
+
+	key = mmap(NULL, keySize > 0 ? keySize : 1, PROT_READ, MAP_SHARED, keyFD, 0);
+	if(key == MAP_FAILED){ perror("ERROR mapping key file"); exit(1); }
+
+	socketFD = connectDaemon(portNumber);
+	result = registerKey(socketFD, id, key, keySize);
+	close(socketFD);
+	munmap(key, keySize);
+	return result;
+}
+
+/*****************************
+ * Report how a finished reply ended, printing the daemon's message if it failed
+ *****************************/
+static int replyResult(struct recvState* in){
+	size_t offset;
+	unsigned int retryMs;
+	char where;
+
+	if(in->type == RECORD_DATA || in->type == RECORD_END){ return 0; }
+	if(in->type == RECORD_UNKNOWN_KEY){ return 2; }	// Caller decides if that's an error
+
+	if(in->type == RECORD_BUSY && parseBinBusy(in->errorMsg, in->errorLen, &retryMs) == 0){
+		fprintf(stderr, "ERROR: daemon is busy, try again in %u ms.\n", retryMs);
+		return 1;
+	}
+
+	if(in->type == RECORD_BAD_CHAR && parseBinBadChar(in->errorMsg, in->errorLen, &offset, &where) == 0){
+		fprintf(stderr, "ERROR: bad characters found in %s file at offset %zu.\n", where == BAD_CHAR_KEY ? "key" : "plaintext", offset);
+		return 1;
+	}
+
+	fprintf(stderr, "%.*s\n", (int)in->errorLen, in->errorMsg);
+	return 1;
+}
+
+/*****************************
+ * Queue pieces after whatever is already queued, for as many records as fit:
+ * each message's header, a data record while it has text left, then its end
+ * record, then on to the next message.
+ *****************************/
+static void queuePieces(struct sendState* out){
+	const struct otpMessage* msg;
+	char* record;
+	size_t chunkLen;
+
+	// A data record with the request header in front of it takes 4 pieces
+	while(out->current < out->count && out->queued + 4 <= SEND_PIECES){
+		msg = &out->msgs[out->current];
+		if(!out->headerQueued){
+			pushPiece(out, msg->header, msg->headerLen);
+			out->headerQueued = 1;
+		}
+
+		record = out->records[out->numRecords++];
+		chunkLen = msg->textSize - out->offset;
+		if(chunkLen == 0){
+			formatBinRecord(record, RECORD_END, 0);
+			pushPiece(out, record, BIN_RECORD_SIZE);
+			out->current++;
+			out->offset = 0;
+			out->headerQueued = 0;
+			continue;
+		}
+
+		if(chunkLen > CHUNK_SIZE){ chunkLen = CHUNK_SIZE; }
+		formatBinRecord(record, RECORD_DATA, chunkLen);
+		pushPiece(out, record, BIN_RECORD_SIZE);
+		pushPiece(out, msg->text + out->offset, chunkLen);
+		if(msg->key != NULL){ pushPiece(out, msg->key + out->offset, chunkLen); }
+		out->offset += chunkLen;
+	}
+}
+
+static void pushPiece(struct sendState* out, const char* data, size_t len){
+	out->iov[out->queued].iov_base = (char*)data;
+	out->iov[out->queued++].iov_len = len;
+}
+
+/*****************************
+ * Account for n bytes sent from the queued pieces, and queue
+ * more once all of them are gone
+ *****************************/
+static void advanceSent(struct sendState* out, size_t n){
+	while(n > 0){
+		if(n < out->iov[out->first].iov_len){
+			out->iov[out->first].iov_base = (char*)out->iov[out->first].iov_base + n;
+			out->iov[out->first].iov_len -= n;
+			return;
+		}
+		n -= out->iov[out->first].iov_len;
+		out->first++;
+	}
+
+	if(out->first == out->queued){
+		out->first = 0;
+		out->queued = 0;
+		out->numRecords = 0;
+		queuePieces(out);
+	}
+}
+
+/*****************************
+ * Read whatever reply bytes are available and hand data payloads to stdout,
+ * and the key offsets of slice records to stderr.
+ * Bytes past the last expected reply are left alone.
+ * Returns 1 if the daemon closed the connection early.
+ *****************************/
+static int receiveReply(int socketFD, struct recvState* in){
+	char buffer[CHUNK_SIZE];
+	union { struct cmsghdr align; char buf[CMSG_SPACE(sizeof(int))]; } control;
+	struct iovec iov = { buffer, sizeof(buffer) };
+	struct msghdr msg;
+	struct cmsghdr* cmsg;
+	size_t len, pos = 0;
+	ssize_t n;
+
+	// recvmsg() rather than recv() so a reply descriptor from a UNIX socket daemon is kept
+	memset(&msg, '\0', sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+	n = recvmsg(socketFD, &msg, MSG_CMSG_CLOEXEC);
+	if(n > 0 && msg.msg_controllen > 0){
+		cmsg = CMSG_FIRSTHDR(&msg);
+		if(cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS && cmsg->cmsg_len == CMSG_LEN(sizeof(int))){
+			if(in->havePassedFD){ close(in->passedFD); }
+			memcpy(&in->passedFD, CMSG_DATA(cmsg), sizeof(int));
+			in->havePassedFD = 1;
+		}
+	}
+	if(n < 0){
+		if(errno == EINTR || errno == EAGAIN){ return 0; }
+		perror("CLIENT: ERROR reading from socket");
+		exit(1);
+	}
+	if(n == 0){ return 1; }
+
+	while(pos < (size_t)n && !in->finished){
+		// Collect a record header
+		if(in->have < BIN_RECORD_SIZE){
+			len = BIN_RECORD_SIZE - in->have;
+			if(len > n - pos){ len = n - pos; }
+			memcpy(in->record + in->have, buffer + pos, len);
+			in->have += len;
+			pos += len;
+
+			if(in->have == BIN_RECORD_SIZE){
+				if(parseBinRecord(in->record, &in->type, &in->left) != 0){ return 1; }
+				if(in->type == RECORD_FD){
+					// The reply is the file whose descriptor came with this record
+					if(!in->havePassedFD){ fprintf(stderr, "CLIENT: ERROR reply descriptor missing\n"); exit(1); }
+					copyOut(in->passedFD);
+					close(in->passedFD);
+					in->havePassedFD = 0;
+					in->have = 0;
+				}
+				else if(in->type == RECORD_END){
+					if(in->newlines){ writeOut("\n", 1); }
+					in->have = 0;
+					in->finished = ++in->replies == in->expected;
+				}
+			}
+			continue;
+		}
+
+		// Payload of the current record
+		len = in->left;
+		if(len > n - pos){ len = n - pos; }
+
+		if(in->type == RECORD_DATA && in->pipe != NULL){
+			pipeOut(in->pipe, buffer + pos, len);
+		}
+		else if(in->type == RECORD_DATA){
+			writeOut(buffer + pos, len);
+		}
+		else{
+			size_t room = sizeof(in->errorMsg) - in->errorLen;
+			memcpy(in->errorMsg + in->errorLen, buffer + pos, len < room ? len : room);
+			in->errorLen += len < room ? len : room;
+		}
+		in->left -= len;
+		pos += len;
+
+		if(in->left == 0 && in->type == RECORD_SLICE){
+			// Where the daemon's slice of the key starts, needed to decrypt the reply
+			if(parseBinSlice(in->errorMsg, in->errorLen, &len) != 0){ return 1; }
+			fprintf(stderr, "KEY OFFSET: %zu\n", len);
+			in->errorLen = 0;
+			in->have = 0;
+		}
+		else if(in->left == 0){
+			if(in->type != RECORD_DATA){ in->finished = 1; }
+			in->have = 0;
+		}
+	}
+
+	return 0;
+}
+
+/*****************************
+ * Write all of the file open on fd to stdout, within the kernel when it can
+ *****************************/
+static void copyOut(int fd){
+	char buffer[CHUNK_SIZE];
+	off_t offset = 0;
+	ssize_t n;
+
+	while((n = sendfile(STDOUT_FILENO, fd, &offset, 1 << 30)) > 0 || (n < 0 && errno == EINTR));
+	if(n == 0){ return; }
+	if(errno != EINVAL && errno != ENOSYS){
+		perror("CLIENT: ERROR writing to stdout");
+		exit(1);
+	}
+
+	// Stdout is something sendfile() can't write to
+	while((n = pread(fd, buffer, sizeof(buffer), offset)) > 0){
+		writeOut(buffer, n);
+		offset += n;
+	}
+}
+
+/*****************************
+ * Write reply text straight to stdout, skipping stdio's small buffer
+ *****************************/
+static void writeOut(const char* buf, size_t len){
+	ssize_t n;
+
+	while(len > 0){
+		n = write(STDOUT_FILENO, buf, len);
+		if(n < 0){
+			if(errno == EINTR){ continue; }
+			perror("CLIENT: ERROR writing to stdout");
+			exit(1);
+		}
+		buf += n;
+		len -= n;
+	}
+}
+
+/*****************************
+ * Map the file at path. The text is everything up to the first newline, or
+ * the end of the file. Its characters are not checked here: the daemon does
+ * that while it transforms them. Returns -1 if the file can't be read.
+ *****************************/
+int mapInput(const char* path, struct inputFile* file){
+	struct stat info;
+	const char* end;
+	int fd;
+
+	memset(file, '\0', sizeof(*file));
+	file->data = "";
+
+	fd = open(path, O_RDONLY);
+	if(fd < 0){ return -1; }
+	if(fstat(fd, &info) < 0){ close(fd); return -1; }
+
+	if(info.st_size > 0){
+		file->data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if(file->data == MAP_FAILED){ close(fd); return -1; }
+		file->mapped = info.st_size;
+		madvise((void*)file->data, file->mapped, MADV_SEQUENTIAL);
+	}
+	close(fd);
+
+	end = memchr(file->data, '\n', file->mapped);
+	file->size = end != NULL ? (size_t)(end - file->data) : file->mapped;
+	return 0;
+}
+
+void unmapInput(struct inputFile* file){
+	if(file->mapped > 0){ munmap((void*)file->data, file->mapped); }
+	file->mapped = 0;
+}
@@ -0,0 +1,44 @@
+#ifndef OTP_CLIENT_H
+#define OTP_CLIENT_H
+
+#include <stddef.h>
+#include "otp_proto.h"
+
+#define FD_PASS_MIN (1 << 20)	// Smallest text worth passing to the daemon as a descriptor
+
+/*****************************
+ * An input file mapped into memory. size counts the characters before the
+ * first newline, which is all the clients ever use.
+ *****************************/
+struct inputFile {
+	const char* data;
+	size_t size;
+	size_t mapped;		// Length of the mapping, 0 if nothing is mapped
+};
+
+/*****************************
+ * One request of a session: a header, and the text and key it covers
+ *****************************/
+struct otpMessage {
+	char header[BIN_HEADER_SIZE];
+	size_t headerLen;
+	const char* text;
+	size_t textSize;
+	const char* key;	// NULL when the header refers to a key the daemon holds
+};
+
+int mapInput(const char*, struct inputFile*);
+void unmapInput(struct inputFile*);
+void useSocketPath(const char*);
+int connectDaemon(int);
+int streamRequests(int, const struct otpMessage*, int, int);
+int splitMessages(const struct inputFile*, int, struct otpMessage**, size_t*);
+void attachKey(struct otpMessage*, int, unsigned char, const char*, size_t);
+int registerKey(int, unsigned long long, const char*, size_t);
+int keyRefRequest(int, unsigned char, unsigned char, struct otpMessage*, int, const char*, size_t, int);
+int openStream(const char*);
+int streamInput(int, const char*, size_t, int, const char*, size_t);
+int keyRefStream(int, unsigned char, int, const char*, size_t);
+int fdRequest(int, unsigned char, const char*, size_t, const char*, size_t);
+
+#endif
@@ -0,0 +1,1308 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+#include "otp_conn.h"
+#include "otp_metrics.h"
+#include "otp_pool.h"
+#include "otp_pads.h"
+
+#define CHUNK_HEADROOM RECORD_SIZE		// Streamed: room in front of the text chunk for its reply record header
+
+// A connection's buffer: reply record header, text chunk, key chunk. CHUNK_SIZE is
+// 64 KB less 16 bytes so this is 11 + 2 * 65520 = 131051 bytes and fits the pool's
+// 128 KB class, where full 64 KB chunks would take a 256 KB buffer for 11 bytes.
+#define CHUNK_BUFFER (CHUNK_HEADROOM + 2 * CHUNK_SIZE)
+
+// Function prototypes
+static void connFail(struct otpConn*, const char*);
+static void connReject(struct otpConn*, char, const char*, size_t);
+static void connBadChar(struct otpConn*, const char*, int);
+static void connAdvance(struct otpConn*);
+static void parseHeader(struct otpConn*);
+static void parseKeyHeader(struct otpConn*);
+static void parseBinaryRequest(struct otpConn*);
+static int pickTransform(struct otpConn*, unsigned int);
+static void startKeyRequest(struct otpConn*, int, int, size_t, size_t, unsigned long long);
+static void startFDRequest(struct otpConn*, const struct binHeader*);
+static void transformFileChunk(struct otpConn*);
+static void endFileRequest(struct otpConn*);
+static int readAt(int, char*, size_t, size_t);
+static void closePassedFDs(struct otpConn*);
+static void queueStats(struct otpConn*);
+static size_t recordSize(const struct otpConn*);
+static size_t putRecord(const struct otpConn*, char*, char, size_t);
+static void parseStreamRecord(struct otpConn*);
+static void receiveUpload(struct otpConn*, size_t);
+static int allocBuffers(struct otpConn*);
+static void nextRequest(struct otpConn*);
+static void transformKeyChunk(struct otpConn*);
+static void transformStreamChunk(struct otpConn*);
+static size_t nextChunk(size_t);
+static void headerParsed(struct otpConn*);
+static void transformTimed(struct otpConn*, unsigned long long);
+static void requestDone(struct otpConn*, enum metricsOutcome);
+static int midRequest(const struct otpConn*);
+static unsigned long long earliest(unsigned long long, unsigned long long);
+static int waitReady(struct otpConn*, short);
+
+// Global vars
+static struct connLimits limits = { DEFAULT_IDLE_MS, DEFAULT_HEADER_MS, DEFAULT_BODY_MS };
+static int zeroCopy = 0;		// New connections may send zero-copy
+
+/*****************************
+ * Set up conn to read a new request from fd
+ *****************************/
+void connInit(struct otpConn* conn, int fd, const struct otpService* svc){
+	memset(conn, '\0', sizeof(*conn));
+	conn->fd = fd;
+	conn->svc = svc;
+	conn->state = CONN_HEADER;
+	conn->headerLen = HEADER_SIZE;
+	conn->upload.fd = -1;
+	conn->resultFD = -1;
+	conn->sendFD = -1;
+	conn->zeroCopy = zeroCopy && setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &zeroCopy, sizeof(zeroCopy)) == 0;
+	conn->trace.conn = METRIC_ADD(accepted, 1);
+	conn->trace.op = '-';
+	conn->lastActive = metricsNow();
+	if(tracing){ conn->trace.stamps[TRACE_ACCEPT] = conn->lastActive; }
+}
+
+/*****************************
+ * Release the buffers owned by conn. Does not close the socket.
+ *****************************/
+void connFree(struct otpConn* conn){
+	// Anything but a clean end between requests means the client cut a request off
+	if(midRequest(conn)){ requestDone(conn, OUTCOME_ABORTED); }
+	if(conn->traceWaiting){ traceCommit(&conn->finished); }		// Reply never fully sent
+	METRIC_ADD(closed, 1);
+
+	keysUploadAbort(&conn->upload);
+	closePassedFDs(conn);
+	if(conn->resultFD >= 0){ close(conn->resultFD); }
+	if(conn->sendFD >= 0){ close(conn->sendFD); }
+	conn->resultFD = conn->sendFD = -1;
+	if(conn->zcPending > 0){
+		// The kernel may still be sending from them, so they can't be handed out again
+		poolDrop(conn->text, conn->textAlloc);
+		poolDrop(conn->in, CHUNK_BUFFER);
+	}
+	else{
+		poolPut(conn->text, conn->textAlloc);
+		poolPut(conn->in, CHUNK_BUFFER);
+	}
+	conn->text = NULL;
+	conn->in = NULL;
+}
+
+/*****************************
+ * Whether conn is done with. Zero-copy sends have to be reaped first, or
+ * the kernel's notifications would be lost with the socket.
+ *****************************/
+int connFinished(struct otpConn* conn){
+	return conn->state == CONN_DONE && conn->zcPending == 0;
+}
+
+/*****************************
+ * The client closed its side. Between requests, or after a rejected request,
+ * that ends the session once pending output is sent. Returns -1 if a request
+ * was cut off.
+ *****************************/
+int connEndOfInput(struct otpConn* conn){
+	if(conn->state == CONN_DISCARD){
+		conn->state = CONN_DONE;
+		return 0;
+	}
+	if(conn->state != CONN_HEADER || conn->have != 0){ return -1; }
+	conn->state = CONN_CLOSING;
+	connAdvance(conn);
+	return 0;
+}
+
+/*****************************
+ * Use limits for every connection from now on
+ *****************************/
+void connSetLimits(const struct connLimits* newLimits){
+	limits = *newLimits;
+}
+
+/*****************************
+ * When conn runs out of time at the rate it is going, metricsNow() ns, or 0
+ * if it never does. Moves on as bytes move, so a driver asks again after
+ * every bit of I/O.
+ *****************************/
+unsigned long long connDeadline(const struct otpConn* conn){
+	const unsigned long long* stamps = conn->trace.stamps;
+	unsigned long long deadline = 0;
+
+	if(limits.idleMs > 0){ deadline = conn->lastActive + limits.idleMs * 1000000ULL; }
+
+	switch(conn->state){
+		case CONN_HEADER:
+			if(limits.headerMs > 0 && conn->have > 0 && stamps[TRACE_HEADER_START] != 0){
+				deadline = earliest(deadline, stamps[TRACE_HEADER_START] + limits.headerMs * 1000000ULL);
+			}
+			break;
+		case CONN_TEXT:
+		case CONN_KEY:
+		case CONN_DRAIN:
+		case CONN_RECORD:
+		case CONN_CHUNK:
+		case CONN_UPLOAD:
+			if(limits.bodyMs > 0 && stamps[TRACE_HEADER] != 0){
+				deadline = earliest(deadline, stamps[TRACE_HEADER] + limits.bodyMs * 1000000ULL);
+			}
+			break;
+		default:
+			break;
+	}
+	return deadline;
+}
+
+/*****************************
+ * Deadline, metricsNow() ns or 0 for none, for a metrics scrape accepted now.
+ * A scrape is all header, so it gets as long as a request header, or the idle
+ * limit if that is shorter, for the whole exchange.
+ *****************************/
+unsigned long long connScrapeDeadline(){
+	unsigned int ms = limits.headerMs;
+
+	if(limits.idleMs > 0 && (ms == 0 || limits.idleMs < ms)){ ms = limits.idleMs; }
+	return ms > 0 ? metricsNow() + ms * 1000000ULL : 0;
+}
+
+/*****************************
+ * conn's deadline passed. Count it, and the request it cut off if any; the
+ * connection is finished and the driver closes it without a reply, since a
+ * client this slow may not read one either.
+ *****************************/
+void connExpire(struct otpConn* conn){
+	METRIC_ADD(expired, 1);
+	if(midRequest(conn)){ requestDone(conn, OUTCOME_TIMEOUT); }
+	conn->state = CONN_DONE;
+}
+
+/*****************************
+ * Whether conn has work to do that no socket I/O brings on. The driver
+ * calls connWork() for it on its next turn, and again until it isn't.
+ *****************************/
+int connBusy(const struct otpConn* conn){
+	return conn->state == CONN_FILE;
+}
+
+/*****************************
+ * Do the next piece of that work: one chunk, so a big file doesn't hold up
+ * the driver's other connections
+ *****************************/
+void connWork(struct otpConn* conn){
+	if(conn->state != CONN_FILE){ return; }
+	conn->lastActive = metricsNow();
+	transformFileChunk(conn);
+	connAdvance(conn);
+}
+
+/*****************************
+ * Point buf/len at the space the next received bytes should go to.
+ * Returns 0 if the connection does not want to read right now.
+ *****************************/
+int connReadBuffer(struct otpConn* conn, char** buf, size_t* len){
+	switch(conn->state){
+		case CONN_HEADER:
+			*buf = conn->header + conn->have;
+			*len = conn->headerLen - conn->have;
+			return 1;
+		case CONN_TEXT:
+			*buf = conn->text + conn->have;
+			*len = conn->textSize - conn->have;
+			return 1;
+		case CONN_KEY:
+			*buf = conn->in + conn->have;
+			*len = conn->chunkLen - conn->have;
+			return 1;
+		case CONN_DRAIN:
+			*buf = conn->in;
+			*len = nextChunk(conn->keySize - conn->textSize - conn->drained);
+			return 1;
+		case CONN_RECORD:
+			*buf = conn->record + conn->have;
+			*len = recordSize(conn) - conn->have;
+			return 1;
+		case CONN_CHUNK:
+			// The previous reply chunk goes out of in, and zero-copy only lets go of it later
+			if(conn->chunkReady || conn->pendLen > 0 || conn->zcPending > 0){ return 0; }
+			*buf = conn->in + CHUNK_HEADROOM + conn->have;
+			*len = (conn->keyData != NULL ? 1 : 2) * conn->chunkLen - conn->have;
+			return 1;
+		case CONN_UPLOAD:
+			if(conn->zcPending > 0){ return 0; }
+			*buf = conn->in;
+			*len = nextChunk(conn->keySize - conn->have);
+			return 1;
+		case CONN_DISCARD:
+			// The error reply has gone out, so errBuf is free when the chunk buffer isn't
+			if(conn->in != NULL && conn->zcPending == 0){
+				*buf = conn->in;
+				*len = CHUNK_BUFFER;
+			}
+			else{
+				*buf = conn->errBuf;
+				*len = sizeof(conn->errBuf);
+			}
+			return 1;
+		default:
+			return 0;
+	}
+}
+
+/*****************************
+ * Account for n bytes the driver placed in the buffer from connReadBuffer(),
+ * and move the request along once the current piece is complete.
+ *****************************/
+void connReceived(struct otpConn* conn, size_t n){
+	METRIC_ADD(bytesIn, n);
+	conn->lastActive = metricsNow();
+	if(tracing && conn->state != CONN_HEADER && conn->state != CONN_DISCARD){
+		conn->trace.stamps[TRACE_BODY] = conn->lastActive;
+	}
+
+	switch(conn->state){
+		case CONN_HEADER:
+			if(conn->have == 0){ conn->trace.stamps[TRACE_HEADER_START] = conn->lastActive; }
+			conn->have += n;
+			if(conn->have == conn->headerLen){
+				// Every header starts with HEADER_SIZE bytes, the origin says if more follow
+				if(conn->headerLen < headerSize(conn->header[0])){
+					conn->headerLen = headerSize(conn->header[0]);
+				}
+				else if(conn->headerLen == BIN_HEADER_SIZE){
+					headerParsed(conn);
+					parseBinaryRequest(conn);
+				}
+				else if(conn->headerLen == EXT_HEADER_SIZE){
+					headerParsed(conn);
+					parseKeyHeader(conn);
+				}
+				else{
+					headerParsed(conn);
+					parseHeader(conn);
+				}
+			}
+			break;
+		case CONN_TEXT:
+			conn->have += n;
+			if(conn->have == conn->textSize){
+				conn->have = 0;
+				conn->chunkLen = nextChunk(conn->textSize);
+				conn->state = CONN_KEY;
+			}
+			break;
+		case CONN_KEY:
+			conn->have += n;
+			if(conn->have == conn->chunkLen){ transformKeyChunk(conn); }
+			break;
+		case CONN_DRAIN:
+			conn->drained += n;
+			if(conn->drained == conn->keySize - conn->textSize){
+				conn->state = CONN_CLOSING;
+				requestDone(conn, OUTCOME_OK);		// Already counted unless there was no text
+			}
+			break;
+		case CONN_RECORD:
+			conn->have += n;
+			if(conn->have == recordSize(conn)){ parseStreamRecord(conn); }
+			break;
+		case CONN_CHUNK:
+			conn->have += n;
+			if(conn->have == (conn->keyData != NULL ? 1 : 2) * conn->chunkLen){ conn->chunkReady = 1; }
+			break;
+		case CONN_UPLOAD:
+			receiveUpload(conn, n);
+			break;
+		default:
+			break;
+	}
+	connAdvance(conn);
+}
+
+/*****************************
+ * Point buf/len at output waiting to be sent.
+ * Returns 0 if there is nothing to send right now.
+ *****************************/
+int connWriteBuffer(struct otpConn* conn, const char** buf, size_t* len){
+	if(conn->pendLen == 0){ return 0; }
+	*buf = conn->pend;
+	*len = conn->pendLen;
+	return 1;
+}
+
+/*****************************
+ * Account for n bytes of output the driver sent
+ *****************************/
+void connSent(struct otpConn* conn, size_t n){
+	METRIC_ADD(bytesOut, n);
+	conn->lastActive = metricsNow();
+	conn->pend += n;
+	conn->pendLen -= n;
+	if(!conn->streamed){ conn->sent += n; }
+	connAdvance(conn);
+}
+
+/*****************************
+ * Once pending output is gone, start whatever was waiting on it:
+ * a received chunk, an error reply, the reply end record, or closing.
+ *****************************/
+static void connAdvance(struct otpConn* conn){
+	if(conn->pendLen > 0){ return; }
+
+	if(conn->traceWaiting && conn->errLen == 0){
+		conn->finished.stamps[TRACE_SENT] = metricsNow();
+		conn->traceWaiting = 0;
+		traceCommit(&conn->finished);
+	}
+
+	if(conn->errLen > 0){
+		conn->pend = conn->errBuf;
+		conn->pendLen = conn->errLen;
+		conn->errLen = 0;
+		return;
+	}
+	if(conn->chunkReady){
+		transformStreamChunk(conn);
+		connAdvance(conn);		// Sends the error instead if the chunk was rejected
+		return;
+	}
+	if(conn->state == CONN_ENDING){
+		conn->pend = conn->out;
+		conn->pendLen = 0;
+		if(conn->resultFD >= 0){
+			// The result goes out with its record, now that nothing else is in front of it
+			conn->pendLen = putRecord(conn, conn->out, RECORD_FD, 0);
+			conn->sendFD = conn->resultFD;
+			conn->resultFD = -1;
+		}
+		conn->pendLen += putRecord(conn, conn->out + conn->pendLen, RECORD_END, 0);
+		requestDone(conn, OUTCOME_OK);
+		nextRequest(conn);		// Framed requests can be followed by more on the same connection
+		return;
+	}
+	if(conn->state == CONN_CLOSING){
+		// Closing on unread input would reset the connection and could destroy
+		// the reply before the client reads it, so a pipelining client is
+		// left to hang up first
+		conn->state = conn->discard ? CONN_DISCARD : CONN_DONE;
+	}
+}
+
+/*****************************
+ * Abandon the request and queue msg as the reply. Legacy clients get the raw
+ * message like they always have, streamed clients get it in an error record.
+ *****************************/
+static void connFail(struct otpConn* conn, const char* msg){
+	connReject(conn, RECORD_ERROR, msg, strlen(msg));
+}
+
+/*****************************
+ * connFail() with a choice of record type for streamed clients,
+ * and a payload of len bytes that need not be text
+ *****************************/
+static void connReject(struct otpConn* conn, char type, const char* msg, size_t len){
+	size_t headLen = recordSize(conn);
+
+	keysUploadAbort(&conn->upload);
+	requestDone(conn, type == RECORD_BAD_CHAR ? OUTCOME_BAD_CHAR : type == RECORD_UNKNOWN_KEY ? OUTCOME_UNKNOWN_KEY : OUTCOME_ERROR);
+
+	if(conn->streamed){
+		if(len > sizeof(conn->errBuf) - headLen){ len = sizeof(conn->errBuf) - headLen; }
+		putRecord(conn, conn->errBuf, type, len);
+		memcpy(conn->errBuf + headLen, msg, len);
+		conn->errLen = headLen + len;
+	}
+	else{
+		if(len > sizeof(conn->errBuf)){ len = sizeof(conn->errBuf); }
+		memcpy(conn->errBuf, msg, len);
+		conn->errLen = len;
+	}
+	conn->chunkReady = 0;
+	conn->discard = conn->streamed;
+	conn->state = CONN_CLOSING;
+}
+
+/*****************************
+ * The transform stopped at offset into the current chunk of text. Work out
+ * whether the text or the key is at fault and reject the request, saying
+ * where in the text it happened.
+ *****************************/
+static void connBadChar(struct otpConn* conn, const char* text, int offset){
+	char where = validChar(text[offset]) ? BAD_CHAR_KEY : BAD_CHAR_TEXT;
+	size_t at = conn->done + offset;
+	char msg[BAD_CHAR_SIZE];
+	char legacyMsg[80];
+
+	if(!conn->streamed){
+		snprintf(legacyMsg, sizeof(legacyMsg), "ERROR: bad character in the %s at offset %zu.", where == BAD_CHAR_KEY ? "key" : "text", at);
+		connFail(conn, legacyMsg);
+		return;
+	}
+	if(conn->binary){
+		formatBinBadChar(msg, at, where);
+		connReject(conn, RECORD_BAD_CHAR, msg, BIN_BAD_CHAR_SIZE);
+		return;
+	}
+	formatBadChar(msg, at, where);
+	connReject(conn, RECORD_BAD_CHAR, msg, BAD_CHAR_SIZE);
+}
+
+/*****************************
+ * Work out what kind of request this is and get ready for its body
+ *****************************/
+static void parseHeader(struct otpConn* conn){
+	char origin = conn->header[0];
+
+	conn->have = 0;
+	conn->streamed = (origin == ORIGIN_ENC_STREAM || origin == ORIGIN_DEC_STREAM);
+	conn->binary = 0;
+
+	if(pickTransform(conn, (origin == ORIGIN_ENC || origin == ORIGIN_ENC_STREAM) ? SERVE_ENCRYPT
+		: (origin == ORIGIN_DEC || origin == ORIGIN_DEC_STREAM) ? SERVE_DECRYPT : 0) != 0){
+		return;
+	}
+	if(parseSize(conn->header + 1, &conn->textSize) != 0 || parseSize(conn->header + 1 + SIZE_FIELD, &conn->keySize) != 0){
+		connFail(conn, "ERROR: malformed request header.");
+		return;
+	}
+	if(conn->keySize < conn->textSize){
+		connFail(conn, "ERROR: key is shorter than the plaintext.");
+		return;
+	}
+
+	if(conn->streamed){
+		if(allocBuffers(conn) != 0){ connFail(conn, "ERROR: out of memory."); return; }
+		conn->state = CONN_RECORD;
+		return;
+	}
+
+	// Legacy requests send the whole plaintext before any key, so the plaintext
+	// has to be held. The key is only ever held one chunk at a time.
+	if(conn->textSize > LEGACY_TEXT_MAX){ connFail(conn, "ERROR: plaintext too large."); return; }
+	conn->textAlloc = conn->textSize;
+	conn->text = poolGet(conn->textAlloc);
+	if(allocBuffers(conn) != 0 || conn->text == NULL){ connFail(conn, "ERROR: plaintext too large."); return; }
+
+	if(conn->textSize > 0){
+		conn->state = CONN_TEXT;
+	}
+	else if(conn->keySize > 0){
+		conn->state = CONN_DRAIN;
+	}
+	else{
+		conn->state = CONN_CLOSING;
+		requestDone(conn, OUTCOME_OK);		// Nothing to transform
+	}
+}
+
+/*****************************
+ * Key reference or registration header. Either way the key itself comes from
+ * (or goes to) the key registry rather than travelling with the text.
+ *****************************/
+static void parseKeyHeader(struct otpConn* conn){
+	char origin = conn->header[0];
+	unsigned long long id;
+	size_t size, offset;
+
+	conn->have = 0;
+	conn->streamed = 1;
+	conn->binary = 0;
+
+	if(origin != ORIGIN_REGISTER && pickTransform(conn, origin == ORIGIN_ENC_KEYREF ? SERVE_ENCRYPT
+		: origin == ORIGIN_DEC_KEYREF ? SERVE_DECRYPT : 0) != 0){
+		return;
+	}
+	if(parseSize(conn->header + 1, &size) != 0 || parseSize(conn->header + 1 + SIZE_FIELD, &offset) != 0
+		|| parseKeyId(conn->header + HEADER_SIZE, &id) != 0){
+		connFail(conn, "ERROR: malformed request header.");
+		return;
+	}
+	startKeyRequest(conn, origin == ORIGIN_REGISTER, 0, size, offset, id);
+}
+
+/*****************************
+ * Binary header: one fixed layout for every operation, see otp_proto.h
+ *****************************/
+static void parseBinaryRequest(struct otpConn* conn){
+	struct binHeader req;
+
+	conn->have = 0;
+	conn->streamed = 1;
+	conn->binary = 1;
+
+	switch(parseBinHeader(conn->header, &req)){
+		case 0:
+			break;
+		case 2:
+			connFail(conn, "ERROR: unsupported protocol version.");
+			return;
+		default:
+			connFail(conn, "ERROR: malformed request header.");
+			return;
+	}
+
+	switch(req.op){
+		case BIN_OP_ENCRYPT:
+		case BIN_OP_DECRYPT:
+			break;
+		case BIN_OP_REGISTER:
+			startKeyRequest(conn, 1, 0, req.keySize, 0, req.keyId);
+			return;
+		case BIN_OP_PING:
+		case BIN_OP_STATS:
+			if(req.op == BIN_OP_STATS){ queueStats(conn); }
+			conn->state = CONN_ENDING;		// No body, the end record follows any reply
+			return;
+		default:
+			connFail(conn, "ERROR: unknown operation.");
+			return;
+	}
+
+	if(pickTransform(conn, req.op == BIN_OP_DECRYPT ? SERVE_DECRYPT : SERVE_ENCRYPT) != 0){
+		return;
+	}
+	if(req.flags & BIN_FLAG_FDS){
+		startFDRequest(conn, &req);
+		return;
+	}
+	if((req.flags & BIN_FLAG_ALLOCATE) && (req.op != BIN_OP_ENCRYPT || !(req.flags & BIN_FLAG_KEY_REF) || (req.flags & BIN_FLAG_FDS))){
+		connFail(conn, "ERROR: only key reference encryption allocates key slices.");
+		return;
+	}
+	if(req.flags & BIN_FLAG_KEY_REF){
+		startKeyRequest(conn, 0, (req.flags & BIN_FLAG_ALLOCATE) != 0, req.textSize, req.keyOffset, req.keyId);
+		return;
+	}
+	if(req.keySize < req.textSize){
+		connFail(conn, "ERROR: key is shorter than the plaintext.");
+		return;
+	}
+
+	if(allocBuffers(conn) != 0){ connFail(conn, "ERROR: out of memory."); return; }
+	conn->textSize = req.textSize;
+	conn->keySize = req.keySize;
+	conn->state = CONN_RECORD;
+}
+
+/*****************************
+ * Use the transform for op, one of the SERVE_* values, if this daemon serves
+ * it. Otherwise, or if op is 0 because the request asked for something
+ * unknown, reject the request and return -1.
+ *****************************/
+static int pickTransform(struct otpConn* conn, unsigned int op){
+	if(op == 0 || (conn->svc->ops & op) == 0){
+		fprintf(stderr, "SERVER %s\n", conn->svc->rejectMsg);
+		connFail(conn, conn->svc->rejectMsg);
+		return -1;
+	}
+	conn->transform = op == SERVE_DECRYPT ? decryptText : encryptText;
+	conn->trace.op = op == SERVE_DECRYPT ? 'd' : 'e';
+	return 0;
+}
+
+/*****************************
+ * Start a request against the key registry: registering size characters of
+ * key under id, or transforming up to size characters of text with key id
+ * from offset on. With allocate set the offset is ignored: the request gets
+ * a slice of the key nothing else got, which the reply names first.
+ *****************************/
+static void startKeyRequest(struct otpConn* conn, int registering, int allocate, size_t size, size_t offset, unsigned long long id){
+	char msg[64];
+	const struct otpKey* key;
+	int result;
+
+	if(!keysEnabled()){
+		connFail(conn, "ERROR: this daemon has no key registry.");
+		return;
+	}
+
+	if(allocBuffers(conn) != 0){ connFail(conn, "ERROR: out of memory."); return; }
+
+	if(registering){
+		conn->trace.op = 'r';
+		conn->keySize = size;
+		if(keysUploadBegin(&conn->upload, id, size) != 0){
+			connFail(conn, "ERROR: could not store key.");
+			return;
+		}
+		conn->state = CONN_UPLOAD;
+		return;
+	}
+
+	key = keysFind(id);
+	if(key == NULL){
+		snprintf(msg, sizeof(msg), "ERROR: unknown key %016llx.", id);
+		connReject(conn, RECORD_UNKNOWN_KEY, msg, strlen(msg));
+		return;
+	}
+	if(allocate){
+		result = padsAllocate(key, size, &offset);
+		if(result != 0){
+			connFail(conn, result > 0 ? "ERROR: key has too little left for the plaintext." : "ERROR: could not record the key slice.");
+			return;
+		}
+		formatBinRecord(conn->out, RECORD_SLICE, BIN_SLICE_SIZE);
+		formatBinSlice(conn->out + BIN_RECORD_SIZE, offset);
+		conn->pend = conn->out;
+		conn->pendLen = BIN_RECORD_SIZE + BIN_SLICE_SIZE;
+	}
+	if(offset > key->size || size > key->size - offset){
+		connFail(conn, "ERROR: key is shorter than the plaintext.");
+		return;
+	}
+
+	conn->textSize = size;
+	conn->keySize = key->size - offset;
+	conn->keyData = key->data + offset;
+	conn->state = CONN_RECORD;
+}
+
+/*****************************
+ * Descriptor request: the text and key are the files whose descriptors came
+ * with the header. Transform them into a new memory file, which goes back to
+ * the client with a RECORD_FD record, so no text crosses the socket. The
+ * files are read, not mapped: the client can still truncate them, and a
+ * mapping would fault the whole process when that happens. Nothing here waits
+ * on the socket, so the driver moves it along with connWork(), a chunk per
+ * turn of its loop, and the other clients get their turns in between.
+ *****************************/
+static void startFDRequest(struct otpConn* conn, const struct binHeader* req){
+	struct stat textInfo, keyInfo;
+
+	if(req->flags & BIN_FLAG_KEY_REF){ connFail(conn, "ERROR: descriptor requests carry their own key."); return; }
+	if(conn->numPassed != 2){ connFail(conn, "ERROR: request needs a text and a key descriptor."); return; }
+	if(req->keySize < req->textSize){ connFail(conn, "ERROR: key is shorter than the plaintext."); return; }
+	if(fstat(conn->passedFDs[0], &textInfo) != 0 || fstat(conn->passedFDs[1], &keyInfo) != 0
+		|| (size_t)textInfo.st_size < req->textSize || (size_t)keyInfo.st_size < req->keySize){
+		connFail(conn, "ERROR: text or key file is shorter than the request says.");
+		return;
+	}
+	if(allocBuffers(conn) != 0){ connFail(conn, "ERROR: out of memory."); return; }
+
+	conn->resultFD = memfd_create("otp-result", MFD_CLOEXEC);
+	if(conn->resultFD < 0 || ftruncate(conn->resultFD, req->textSize) != 0){
+		connFail(conn, "ERROR: could not create the result.");
+		return;
+	}
+
+	conn->textSize = req->textSize;
+	conn->done = 0;
+	conn->state = req->textSize > 0 ? CONN_FILE : CONN_ENDING;
+	if(conn->state == CONN_ENDING){ closePassedFDs(conn); }
+}
+
+/*****************************
+ * Descriptor request: read the next chunk of text and key, transform it and
+ * write it to the result. The reply end record can follow the last one.
+ *****************************/
+static void transformFileChunk(struct otpConn* conn){
+	char* text = conn->in + CHUNK_HEADROOM;
+	char* key = text + CHUNK_SIZE;
+	size_t len = nextChunk(conn->textSize - conn->done);
+	unsigned long long start;
+	int n;
+
+	if(readAt(conn->passedFDs[0], text, len, conn->done) != 0 || readAt(conn->passedFDs[1], key, len, conn->done) != 0){
+		connFail(conn, "ERROR: text or key file got shorter while being read.");
+		endFileRequest(conn);
+		return;
+	}
+	start = metricsNow();
+	n = conn->transform(text, text, key, len);
+	transformTimed(conn, start);
+	if(n < (int)len){
+		connBadChar(conn, text, n);
+		endFileRequest(conn);
+		return;
+	}
+	if(pwrite(conn->resultFD, text, len, conn->done) != (ssize_t)len){
+		connFail(conn, "ERROR: could not write the result.");
+		endFileRequest(conn);
+		return;
+	}
+	conn->done += len;
+	METRIC_ADD(transformed, len);
+
+	if(conn->done == conn->textSize){
+		endFileRequest(conn);
+		conn->state = CONN_ENDING;
+	}
+}
+
+/*****************************
+ * Descriptor request: done with the client's files. The result goes back
+ * only if the request didn't fail.
+ *****************************/
+static void endFileRequest(struct otpConn* conn){
+	closePassedFDs(conn);
+	if(conn->state == CONN_CLOSING){
+		close(conn->resultFD);
+		conn->resultFD = -1;
+	}
+}
+
+/*****************************
+ * Read len bytes at offset of fd into buf. Returns -1 if they aren't all there.
+ *****************************/
+static int readAt(int fd, char* buf, size_t len, size_t offset){
+	ssize_t n;
+
+	while(len > 0){
+		n = pread(fd, buf, len, offset);
+		if(n < 0 && errno == EINTR){ continue; }
+		if(n <= 0){ return -1; }
+		buf += n;
+		len -= n;
+		offset += n;
+	}
+	return 0;
+}
+
+/*****************************
+ * Close the descriptors that came with the current request
+ *****************************/
+static void closePassedFDs(struct otpConn* conn){
+	for(int i = 0; i < conn->numPassed; i++){
+		close(conn->passedFDs[i]);
+	}
+	conn->numPassed = 0;
+}
+
+/*****************************
+ * Stats: queue a data record of the daemon's counters, every worker's added up
+ *****************************/
+static void queueStats(struct otpConn* conn){
+	char* body = conn->out + BIN_RECORD_SIZE;
+	struct workerMetrics total;
+	int len;
+
+	metricsTotals(&total);
+	len = snprintf(body, sizeof(conn->out) - BIN_RECORD_SIZE, "connections %llu\nrequests %llu\nbytes %llu\nerrors %llu\n",
+		total.accepted, total.requests[OUTCOME_OK], total.transformed,
+		total.requests[OUTCOME_ERROR] + total.requests[OUTCOME_BAD_CHAR] + total.requests[OUTCOME_UNKNOWN_KEY]);
+	if(len >= (int)(sizeof(conn->out) - BIN_RECORD_SIZE)){ len = sizeof(conn->out) - BIN_RECORD_SIZE - 1; }
+	formatBinRecord(conn->out, RECORD_DATA, len);
+	conn->pend = conn->out;
+	conn->pendLen = BIN_RECORD_SIZE + len;
+}
+
+/*****************************
+ * Registration: write the next piece of the key out, and
+ * publish the key once all of it is in
+ *****************************/
+static void receiveUpload(struct otpConn* conn, size_t n){
+	if(keysUploadWrite(&conn->upload, conn->in, n) != 0){
+		connFail(conn, "ERROR: could not store key.");
+		return;
+	}
+
+	conn->have += n;
+	if(conn->have < conn->keySize){ return; }
+
+	if(keysUploadFinish(&conn->upload) != 0){
+		connFail(conn, "ERROR: key does not match its id.");
+		return;
+	}
+	conn->state = CONN_ENDING;
+}
+
+/*****************************
+ * A streamed record header is in: either a data chunk follows or the request is over
+ *****************************/
+static void parseStreamRecord(struct otpConn* conn){
+	char type;
+	size_t size;
+
+	conn->have = 0;
+
+	if((conn->binary ? parseBinRecord(conn->record, &type, &size) : parseRecord(conn->record, &type, &size)) != 0
+		|| type == RECORD_ERROR){
+		connFail(conn, "ERROR: malformed record.");
+		return;
+	}
+	if(type == RECORD_END){
+		conn->state = CONN_ENDING;
+		return;
+	}
+	if(size == 0 || size > CHUNK_SIZE){
+		connFail(conn, "ERROR: bad record size.");
+		return;
+	}
+	if(conn->done + size > conn->textSize){
+		connFail(conn, "ERROR: more plaintext than the header announced.");
+		return;
+	}
+
+	conn->chunkLen = size;
+	conn->state = CONN_CHUNK;
+}
+
+/*****************************
+ * Legacy: a key chunk is in. Transform the matching plaintext in place and
+ * queue it, so it goes back while the next key chunk is still arriving.
+ *****************************/
+static void transformKeyChunk(struct otpConn* conn){
+	unsigned long long start = metricsNow();
+	int n = conn->transform(conn->text + conn->done, conn->text + conn->done, conn->in, conn->chunkLen);
+
+	transformTimed(conn, start);
+	if(n < (int)conn->chunkLen){
+		connBadChar(conn, conn->text + conn->done, n);
+		return;
+	}
+	conn->done += conn->chunkLen;
+	conn->have = 0;
+	METRIC_ADD(transformed, conn->chunkLen);
+	if(conn->done == conn->textSize){ requestDone(conn, OUTCOME_OK); }
+
+	conn->pend = conn->text + conn->sent;
+	conn->pendLen = conn->done - conn->sent;
+
+	if(conn->done < conn->textSize){
+		conn->chunkLen = nextChunk(conn->textSize - conn->done);
+	}
+	else if(conn->keySize > conn->textSize){
+		conn->state = CONN_DRAIN;
+	}
+	else{
+		conn->state = CONN_CLOSING;
+	}
+}
+
+/*****************************
+ * Streamed: a text chunk and its key are in and nothing is pending. Transform
+ * the text in place, queue it behind its record header in the room left in
+ * front of it, and go back to reading record headers.
+ *****************************/
+static void transformStreamChunk(struct otpConn* conn){
+	char* text = conn->in + CHUNK_HEADROOM;
+	char* key = conn->keyData != NULL ? (char*)conn->keyData + conn->done : text + conn->chunkLen;
+	size_t headLen = recordSize(conn);
+	unsigned long long start = metricsNow();
+	int n = conn->transform(text, text, key, conn->chunkLen);
+
+	transformTimed(conn, start);
+	if(n < (int)conn->chunkLen){
+		connBadChar(conn, text, n);
+		return;
+	}
+	putRecord(conn, text - headLen, RECORD_DATA, conn->chunkLen);
+	conn->pend = text - headLen;
+	conn->pendLen = headLen + conn->chunkLen;
+
+	conn->done += conn->chunkLen;
+	METRIC_ADD(transformed, conn->chunkLen);
+	conn->chunkReady = 0;
+	conn->have = 0;
+	conn->state = CONN_RECORD;
+}
+
+/*****************************
+ * Get the chunk buffer from the pool the first time a request needs it.
+ * It is kept for every later request on the connection. Returns -1 if out
+ * of memory.
+ *****************************/
+static int allocBuffers(struct otpConn* conn){
+	if(conn->in == NULL){ conn->in = poolGet(CHUNK_BUFFER); }
+	return conn->in == NULL ? -1 : 0;
+}
+
+/*****************************
+ * A framed request is complete and its end record is queued. Start reading
+ * the next request header straight away, so a client can pipeline requests
+ * on one connection. The end record in out is still safe: out is only
+ * reused once the pending output is gone.
+ *****************************/
+static void nextRequest(struct otpConn* conn){
+	conn->state = CONN_HEADER;
+	conn->headerLen = HEADER_SIZE;
+	conn->have = 0;
+	conn->textSize = 0;
+	conn->keySize = 0;
+	conn->keyData = NULL;
+	conn->done = 0;
+	conn->chunkLen = 0;
+	conn->counted = 0;
+	closePassedFDs(conn);		// Sent with a request that had no use for them
+}
+
+/*****************************
+ * Size of a record header in the framing the current request uses
+ *****************************/
+static size_t recordSize(const struct otpConn* conn){
+	return conn->binary ? BIN_RECORD_SIZE : RECORD_SIZE;
+}
+
+/*****************************
+ * Write a record header into buf in the framing the current request uses.
+ * Returns its size.
+ *****************************/
+static size_t putRecord(const struct otpConn* conn, char* buf, char type, size_t size){
+	if(conn->binary){
+		formatBinRecord(buf, type, size);
+		return BIN_RECORD_SIZE;
+	}
+	formatRecord(buf, type, size);
+	return RECORD_SIZE;
+}
+
+static size_t nextChunk(size_t remaining){
+	return remaining < CHUNK_SIZE ? remaining : CHUNK_SIZE;
+}
+
+/*****************************
+ * The whole header is in: that ends its phase and starts the request's
+ *****************************/
+static void headerParsed(struct otpConn* conn){
+	conn->trace.stamps[TRACE_HEADER] = metricsNow();
+	metricsObserve(PHASE_HEADER, conn->trace.stamps[TRACE_HEADER] - conn->trace.stamps[TRACE_HEADER_START]);
+}
+
+/*****************************
+ * A chunk went through the transform, which started at start
+ *****************************/
+static void transformTimed(struct otpConn* conn, unsigned long long start){
+	unsigned long long end = metricsNow();
+
+	metricsObserve(PHASE_TRANSFORM, end - start);
+	conn->trace.transformNs += end - start;
+	conn->trace.stamps[TRACE_TRANSFORM] = end;
+}
+
+/*****************************
+ * Count the current request's outcome, once. Only requests that got their
+ * whole reply go into the request latency histogram. When tracing, the
+ * timeline waits in finished until the reply is sent, and the next request
+ * on the connection starts a fresh one.
+ *****************************/
+static void requestDone(struct otpConn* conn, enum metricsOutcome outcome){
+	unsigned long long now;
+
+	if(conn->counted){ return; }
+	conn->counted = 1;
+	METRIC_ADD(requests[outcome], 1);
+	if(outcome != OUTCOME_OK && !tracing){ return; }
+
+	now = metricsNow();
+	if(outcome == OUTCOME_OK){ metricsObserve(PHASE_REQUEST, now - conn->trace.stamps[TRACE_HEADER]); }
+	if(!tracing){ return; }
+
+	if(conn->traceWaiting){ traceCommit(&conn->finished); }		// Never got its reply out
+	conn->trace.stamps[TRACE_QUEUED] = now;
+	conn->trace.outcome = outcome;
+	conn->trace.chars = conn->done;
+	conn->finished = conn->trace;
+	conn->traceWaiting = 1;
+
+	memset(conn->trace.stamps, 0, sizeof(conn->trace.stamps));
+	conn->trace.transformNs = 0;
+	conn->trace.op = '-';
+}
+
+/*****************************
+ * Whether conn is in the middle of a request that hasn't been counted:
+ * anywhere but cleanly between requests or already given up
+ *****************************/
+static int midRequest(const struct otpConn* conn){
+	return !conn->counted && conn->state != CONN_DONE && conn->state != CONN_CLOSING && conn->state != CONN_DISCARD
+		&& (conn->state != CONN_HEADER || conn->have > 0);
+}
+
+/*****************************
+ * The earlier of two deadlines, where 0 is never
+ *****************************/
+static unsigned long long earliest(unsigned long long a, unsigned long long b){
+	if(a == 0){ return b; }
+	if(b == 0){ return a; }
+	return a < b ? a : b;
+}
+
+/*****************************
+ * Serve requests on a blocking socket until the client is done. Pending output
+ * is always sent before reading more, so the reply to one chunk goes out while
+ * the kernel is already buffering the next. Each call tries the socket without
+ * blocking first and only waits, in poll() up to the connection's deadline,
+ * when it has to. Returns 0 on success, -1 if the connection failed or expired.
+ *****************************/
+int serveConnection(int fd, const struct otpService* svc){
+	struct otpConn conn;
+	const char* outBuf;
+	char* inBuf;
+	size_t len;
+	ssize_t n;
+	int result = 0;
+
+	connInit(&conn, fd, svc);
+
+	while(!connFinished(&conn)){
+		if(connWriteBuffer(&conn, &outBuf, &len)){
+			n = connSend(&conn, outBuf, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+			if(n < 0){
+				if(errno == EINTR){ continue; }
+				if(errno == EAGAIN || errno == EWOULDBLOCK){
+					if(waitReady(&conn, POLLOUT) == 0){ continue; }
+					result = -1;
+					break;
+				}
+				perror("ERROR writing to socket");
+				result = -1;
+				break;
+			}
+			connSent(&conn, n);
+		}
+		else if(connReadBuffer(&conn, &inBuf, &len)){
+			n = connRecv(&conn, inBuf, len, MSG_DONTWAIT);
+			if(n < 0){
+				if(errno == EINTR){ continue; }
+				if(errno == EAGAIN || errno == EWOULDBLOCK){
+					if(waitReady(&conn, POLLIN) == 0){ continue; }
+					result = -1;
+					break;
+				}
+				perror("ERROR reading from socket");
+				result = -1;
+				break;
+			}
+			if(n == 0){
+				// Between requests this is just the client ending its session
+				if(connEndOfInput(&conn) != 0){
+					fprintf(stderr, "ERROR return chars == 0, maybe shutdown happened on client.\n");
+					result = -1;
+					break;
+				}
+				continue;
+			}
+			connReceived(&conn, n);
+		}
+		else if(connBusy(&conn)){
+			connWork(&conn);
+		}
+		else{
+			break;
+		}
+	}
+
+	connFree(&conn);
+	poolDrain();		// This process ends with the connection
+	return result;
+}
+
+/*****************************
+ * Wait until conn's socket is ready for events or its deadline passes.
+ * Returns -1, with the connection expired, if the deadline came first.
+ *****************************/
+static int waitReady(struct otpConn* conn, short events){
+	struct pollfd pfd = { conn->fd, events, 0 };
+	unsigned long long deadline, now;
+	int timeout, ready;
+
+	while(1){
+		deadline = connDeadline(conn);
+		now = metricsNow();
+		if(deadline != 0 && now >= deadline){
+			connExpire(conn);
+			return -1;
+		}
+		timeout = deadline == 0 ? -1 : (int)((deadline - now + 999999) / 1000000);
+
+		ready = poll(&pfd, 1, timeout);
+		if(ready > 0){ return 0; }
+		if(ready < 0 && errno != EINTR){ return 0; }		// Let the I/O call report it
+	}
+}
+
+/*****************************
+ * Set msg up to receive into buf, with room in control for the descriptors
+ * a request comes with. Once the receive is done, connTakeFDs() keeps them.
+ *****************************/
+void connPrepareRecv(struct msghdr* msg, struct iovec* iov, union connControl* control, char* buf, size_t len){
+	iov->iov_base = buf;
+	iov->iov_len = len;
+	memset(msg, '\0', sizeof(*msg));
+	msg->msg_iov = iov;
+	msg->msg_iovlen = 1;
+	msg->msg_control = control->buf;
+	msg->msg_controllen = sizeof(control->buf);
+}
+
+/*****************************
+ * Keep the descriptors that arrived in msg for the request being received
+ *****************************/
+void connTakeFDs(struct otpConn* conn, struct msghdr* msg){
+	struct cmsghdr* cmsg;
+	size_t count;
+	int fd;
+
+	if(msg->msg_controllen == 0){ return; }
+	for(cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg)){
+		if(cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS){ continue; }
+		count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		for(size_t i = 0; i < count; i++){
+			memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+			if(conn->numPassed < MAX_PASSED_FDS){ conn->passedFDs[conn->numPassed++] = fd; }
+			else{ close(fd); }		// More than any request uses
+		}
+	}
+}
+
+/*****************************
+ * Set msg up to send buf, carrying the descriptor waiting in sendFD if there
+ * is one. Once any of it has gone, call connGaveFD().
+ *****************************/
+void connPrepareSend(struct otpConn* conn, struct msghdr* msg, struct iovec* iov, union connControl* control, const char* buf, size_t len){
+	struct cmsghdr* cmsg;
+
+	iov->iov_base = (char*)buf;
+	iov->iov_len = len;
+	memset(msg, '\0', sizeof(*msg));
+	msg->msg_iov = iov;
+	msg->msg_iovlen = 1;
+	if(conn->sendFD < 0){ return; }
+
+	memset(control, '\0', sizeof(*control));
+	msg->msg_control = control->buf;
+	msg->msg_controllen = CMSG_SPACE(sizeof(int));
+	cmsg = CMSG_FIRSTHDR(msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &conn->sendFD, sizeof(int));
+}
+
+void connGaveFD(struct otpConn* conn){
+	if(conn->sendFD < 0){ return; }
+	close(conn->sendFD);		// The client holds its own reference now
+	conn->sendFD = -1;
+}
+
+/*****************************
+ * recv() into buf for conn, keeping any descriptors that come along for the
+ * request. Returns like recv().
+ *****************************/
+ssize_t connRecv(struct otpConn* conn, char* buf, size_t len, int flags){
+	union connControl control;
+	struct iovec iov;
+	struct msghdr msg;
+	ssize_t n;
+
+	connPrepareRecv(&msg, &iov, &control, buf, len);
+	n = recvmsg(conn->fd, &msg, flags | MSG_CMSG_CLOEXEC);
+	if(n > 0){ connTakeFDs(conn, &msg); }
+	return n;
+}
+
+/*****************************
+ * send() buf for conn, passing the descriptor waiting in sendFD along with
+ * its first byte, and zero-copy if connZeroCopy() says so. A driver that
+ * uses it calls connReapZeroCopy() whenever connZeroCopy sends are pending.
+ * Returns like send().
+ *****************************/
+ssize_t connSend(struct otpConn* conn, const char* buf, size_t len, int flags){
+	union connControl control;
+	struct iovec iov;
+	struct msghdr msg;
+	ssize_t n;
+
+	if(conn->sendFD < 0 && connZeroCopy(conn, len)){
+		n = send(conn->fd, buf, len, flags | MSG_ZEROCOPY);
+		if(n >= 0){
+			connZeroCopyQueued(conn);
+			return n;
+		}
+		if(errno != ENOBUFS){ return n; }
+		// Out of memory for pinned pages: copy this one
+	}
+	if(conn->sendFD < 0){ return send(conn->fd, buf, len, flags); }
+
+	connPrepareSend(conn, &msg, &iov, &control, buf, len);
+	n = sendmsg(conn->fd, &msg, flags);
+	if(n > 0){ connGaveFD(conn); }
+	return n;
+}
+
+/*****************************
+ * Let connections accepted from now on send large replies zero-copy. Only
+ * sockets that take SO_ZEROCOPY do, which leaves out UNIX sockets.
+ *****************************/
+void connUseZeroCopy(int on){
+	zeroCopy = on;
+}
+
+/*****************************
+ * Whether len bytes of output should go out zero-copy
+ *****************************/
+int connZeroCopy(const struct otpConn* conn, size_t len){
+	return conn->zeroCopy && conn->sendFD < 0 && len >= ZEROCOPY_MIN;
+}
+
+/*****************************
+ * A zero-copy send of the pending output went out; the kernel says when it
+ * is done with the pages
+ *****************************/
+void connZeroCopyQueued(struct otpConn* conn){
+	conn->zcPending++;
+	METRIC_ADD(zeroCopySends, 1);
+}
+
+/*****************************
+ * The kernel is done with the pages of count zero-copy sends. If it had to
+ * copy them after all, as it does over loopback, zero-copy only costs the
+ * notifications, so the connection stops using it.
+ *****************************/
+void connZeroCopyDone(struct otpConn* conn, unsigned int count, int copied){
+	conn->zcPending -= count < conn->zcPending ? count : conn->zcPending;
+	if(copied){
+		METRIC_ADD(zeroCopyCopied, count);
+		conn->zeroCopy = 0;
+	}
+}
+
+/*****************************
+ * Read the MSG_ZEROCOPY notifications queued on conn's socket. Returns -1
+ * if the error queue held a real error.
+ *****************************/
+int connReapZeroCopy(struct otpConn* conn){
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_in6))];
+	} control;
+	struct sock_extended_err* err;
+	struct cmsghdr* cmsg;
+	struct msghdr msg;
+
+	while(conn->zcPending > 0){
+		memset(&msg, '\0', sizeof(msg));
+		msg.msg_control = control.buf;
+		msg.msg_controllen = sizeof(control.buf);
+		if(recvmsg(conn->fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0){
+			return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+		}
+
+		for(cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)){
+			if(!(cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR)
+				&& !(cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR)){
+				continue;
+			}
+			err = (struct sock_extended_err*)CMSG_DATA(cmsg);
+			if(err->ee_origin != SO_EE_ORIGIN_ZEROCOPY || err->ee_errno != 0){ return -1; }
+			// ee_info to ee_data is the range of sends, counted from the first
+			connZeroCopyDone(conn, err->ee_data - err->ee_info + 1, err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED);
+		}
+	}
+	return 0;
+}
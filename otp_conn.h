@@ -0,0 +1,158 @@
+#ifndef OTP_CONN_H
+#define OTP_CONN_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include "otp_proto.h"
+#include "otp_cipher.h"
+#include "otp_keys.h"
+#include "otp_trace.h"
+
+#define SERVE_ENCRYPT 0x01		// Daemon accepts encryption requests
+#define SERVE_DECRYPT 0x02		// Daemon accepts decryption requests
+#define MAX_PASSED_FDS 2		// Descriptors one request comes with: text and key
+#define DEFAULT_IDLE_MS 60000	// Default connLimits
+#define DEFAULT_HEADER_MS 10000
+#define DEFAULT_BODY_MS 0
+#define ZEROCOPY_MIN 16384		// Smallest reply worth sending zero-copy, pinning pages costs more than copying less
+
+/*****************************
+ * Describes what a daemon accepts. Each request says by its origin or opcode
+ * which way it goes, and gets the matching transform if the daemon serves it.
+ *****************************/
+struct otpService {
+	unsigned int ops;		// SERVE_* values this daemon serves
+	const char* rejectMsg;	// Sent back when a request asks for something else
+};
+
+/*****************************
+ * How long a client may take before its connection is closed, in ms, 0 for
+ * no limit. The idle limit applies throughout, between requests too, so a
+ * client that stops reading its reply runs into it as well.
+ *****************************/
+struct connLimits {
+	unsigned int idleMs;	// No bytes moved either way
+	unsigned int headerMs;	// First header byte to the whole header
+	unsigned int bodyMs;	// Whole header to the last request byte
+};
+
+/*****************************
+ * Ancillary data for the descriptors one recvmsg() or sendmsg() carries
+ *****************************/
+union connControl {
+	struct cmsghdr align;
+	char buf[CMSG_SPACE(MAX_PASSED_FDS * sizeof(int))];
+};
+
+enum connState {
+	CONN_HEADER,	// Reading the request header
+	CONN_TEXT,		// Legacy: reading the whole plaintext
+	CONN_KEY,		// Legacy: reading the next key chunk
+	CONN_DRAIN,		// Legacy: discarding key characters past the end of the plaintext
+	CONN_RECORD,	// Streamed: reading the next record header
+	CONN_CHUNK,		// Streamed: reading the text and key of a data record
+	CONN_UPLOAD,	// Registration: reading the key being registered
+	CONN_FILE,		// Descriptor request: transforming the files that came with it
+	CONN_ENDING,	// Streamed: end record received, reply end record not queued yet.
+					// Once it is queued the connection waits for the next request.
+	CONN_CLOSING,	// Nothing more to read, flushing what is left
+	CONN_DISCARD,	// Streamed: rejected, dropping input until the client hangs up
+	CONN_DONE		// Request finished, connection can be closed
+};
+
+/*****************************
+ * Per-connection request state. The connection never touches the socket itself:
+ * a driver asks for the buffer to fill (connReadBuffer) or drain (connWriteBuffer),
+ * does the I/O however it likes, and reports back how many bytes moved.
+ * connRecv() and connSend() do the I/O on fd for drivers that use the socket
+ * directly, carrying the descriptors a UNIX socket client passes along;
+ * drivers that submit their own recvmsg()/sendmsg() build them with
+ * connPrepareRecv() and connPrepareSend() instead.
+ * connDeadline() says when the driver should give up on the client and call
+ * connExpire() instead. Work that waits on no I/O, connBusy() says, is done a
+ * piece at a time with connWork() whenever the driver gets to it. Large
+ * replies may go out zero-copy when connZeroCopy() says so: the driver reports
+ * each such send with connZeroCopyQueued() and the kernel's notification that
+ * it is done with the pages with connZeroCopyDone(), and the connection
+ * neither reuses the buffer nor finishes until then.
+ *****************************/
+struct otpConn {
+	int fd;
+	const struct otpService* svc;
+	enum connState state;
+	int streamed;			// 1 if the request uses records
+	int binary;				// 1 if the request uses the binary header and records
+	transformFn transform;	// encryptText() or decryptText(), picked from the header
+
+	char header[MAX_HEADER_SIZE];
+	size_t headerLen;		// Header bytes expected, grows once the origin is known
+	char record[RECORD_SIZE];
+	size_t textSize;
+	size_t keySize;
+	size_t have;			// Bytes received for the current state
+
+	const char* keyData;	// Key reference: registered key, starting at the requested offset
+	struct keyUpload upload;	// Registration: where the key is being written
+
+	char* text;				// Legacy: whole plaintext, transformed in place
+	size_t textAlloc;		// Size text was got from the pool with
+	size_t done;			// Text characters transformed so far
+	size_t sent;			// Legacy: text characters sent back so far
+	size_t drained;			// Legacy: surplus key characters discarded so far
+
+	char* in;				// Key chunk (legacy) or reply record header + text chunk + key chunk (streamed),
+							// the text transformed in place and sent from there
+	char out[RECORD_SIZE + 256];	// Streamed: reply records without text, descriptor and end records or stats
+	size_t chunkLen;		// Characters in the chunk being received
+	int chunkReady;			// Streamed: chunk received, waiting for pending output to drain
+
+	const char* pend;		// Output waiting to be sent
+	size_t pendLen;
+	unsigned long long lastActive;	// When bytes last moved either way, metricsNow() ns
+
+	int passedFDs[MAX_PASSED_FDS];	// Descriptors received with the current header
+	int numPassed;
+	int resultFD;			// Descriptor request: memory file holding the reply, until its record is queued
+	int sendFD;				// Descriptor to send with the next output, -1 if none
+	int zeroCopy;			// Large output may go out zero-copy, see connZeroCopy()
+	unsigned int zcPending;	// Zero-copy sends the kernel may still be reading from
+
+	char errBuf[RECORD_SIZE + 128];
+	size_t errLen;			// Error reply waiting for pending output to drain
+	int discard;			// Go to CONN_DISCARD rather than CONN_DONE once flushed
+
+	struct traceRecord trace;		// The current request's timeline
+	struct traceRecord finished;	// The last finished request's, until its reply is sent
+	int traceWaiting;		// finished is waiting for its reply to go out
+	int counted;			// The current request's outcome is in the metrics
+};
+
+void connInit(struct otpConn*, int, const struct otpService*);
+void connFree(struct otpConn*);
+int connReadBuffer(struct otpConn*, char**, size_t*);
+void connReceived(struct otpConn*, size_t);
+int connWriteBuffer(struct otpConn*, const char**, size_t*);
+void connSent(struct otpConn*, size_t);
+int connFinished(struct otpConn*);
+int connEndOfInput(struct otpConn*);
+int connBusy(const struct otpConn*);
+void connWork(struct otpConn*);
+void connSetLimits(const struct connLimits*);
+unsigned long long connDeadline(const struct otpConn*);
+unsigned long long connScrapeDeadline();
+void connExpire(struct otpConn*);
+void connPrepareRecv(struct msghdr*, struct iovec*, union connControl*, char*, size_t);
+void connTakeFDs(struct otpConn*, struct msghdr*);
+void connPrepareSend(struct otpConn*, struct msghdr*, struct iovec*, union connControl*, const char*, size_t);
+void connGaveFD(struct otpConn*);
+void connUseZeroCopy(int);
+int connZeroCopy(const struct otpConn*, size_t);
+void connZeroCopyQueued(struct otpConn*);
+void connZeroCopyDone(struct otpConn*, unsigned int, int);
+int connReapZeroCopy(struct otpConn*);
+ssize_t connRecv(struct otpConn*, char*, size_t, int);
+ssize_t connSend(struct otpConn*, const char*, size_t, int);
+int serveConnection(int, const struct otpService*);
+
+#endif
@@ -0,0 +1,16 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "otp_daemon.h"
+
+/* argv[0] = otp_d
+ * argv[1..] = options, see daemonMain()
+ * then: one or more ports
+ */
+
+// Requests this daemon serves: both ways, each request picks one
+const struct otpService service = { SERVE_ENCRYPT | SERVE_DECRYPT, "ERROR: Connection not from otp_enc or otp_dec." };
+
+int main(int argc, char *argv[])
+{
+	return daemonMain(argc, argv, &service);
+}
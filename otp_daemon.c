@@ -0,0 +1,649 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <sched.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include "otp_daemon.h"
+#include "otp_loop.h"
+#include "otp_uring.h"
+#include "otp_admit.h"
+#include "otp_cipher.h"
+#include "otp_keys.h"
+#include "otp_metrics.h"
+#include "otp_trace.h"
+
+static void error(const char *msg) { perror(msg); exit(1); } // Error function used for reporting issues
+
+#define MAX_FORKS 5		// Connections served at once in fork mode, unless -c says otherwise
+#define MAX_PORTS 16	// Most ports one daemon listens on
+#define MAX_SCRAPERS 8	// Metrics scrapes answered at once in fork mode, outside admission control
+#define RESPAWN_QUICK 2	// A worker that exits within this many seconds of starting counts as a quick death
+#define RESPAWN_TRIES 5	// Quick deaths in a row after which a worker is given up on
+
+// Function prototypes
+static int openListener(int, int, int);
+static int openUnixListener(const char*, int);
+static void openListeners(char* const*, int, int, int, int*);
+static int openMetricsListener(const char*);
+static void runForkServer(const int*, int, const struct otpService*);
+static void forkChild(int, int, struct admitQueue*, const int*, int, const struct otpService*);
+static int childSlotFree();
+static void serveLoop(const int*, int, const struct otpService*);
+static int runWorkers(char* const*, int, int, const struct otpService*);
+static pid_t spawnWorker(char* const*, int, int, const struct otpService*);
+static void catchStop(int);
+static void raiseFileLimit();
+static void checkForTerm();
+static void parseLimits(const char*);
+static void setupSignals();
+static void catchSIGCHLD(int);
+
+// Global vars
+static int numChildren = 0;				// Fork mode: children serving clients
+static pid_t scrapers[MAX_SCRAPERS];	// Fork mode: children answering scrapes, which don't count in numChildren
+static int numScrapers = 0;
+static volatile sig_atomic_t stopRequested = 0;
+static int metricsSocketFD = -1;		// Listening socket for metrics scrapes, -1 if there is none
+static int unixSocketFDs[MAX_PORTS];	// UNIX socket listeners by argument position, shared by every worker
+static int backlog = SOMAXCONN;			// Accept queue length of every listening socket
+static struct admitPolicy admission = { -1, DEFAULT_QUEUE, DEFAULT_QUEUE_MS };
+static int useUring = 0;				// -i uring: event loops run on io_uring where the kernel has it
+
+/*****************************
+ * Shared main() for the daemons. Parses the command line, opens a listening
+ * socket for every port given and hands them to the selected server model.
+ * An argument with a '/' in it is the path of a UNIX socket to listen on
+ * instead, for clients on the same host:
+ *   (default)  one process, every connection in an epoll event loop
+ *   -w N       N event loop worker processes, each with its own SO_REUSEPORT
+ *              listening socket. N = 0 starts one worker per online core
+ *   -f         fork a child per connection
+ * -i uring runs the event loops on io_uring instead of epoll, falling back
+ * to epoll on kernels without it (-i epoll is the default). -z sends replies
+ * of ZEROCOPY_MIN or more zero-copy from the event loops, which pays off on
+ * real NICs; over loopback the kernel copies anyway and each connection
+ * stops trying after its first such send.
+ * -k dir serves key reference requests from the key files in dir and stores
+ * registered keys there. -m port (on localhost) or -m /path (a UNIX socket)
+ * serves the daemon's metrics, see otp_metrics.h. -t file records the
+ * timeline of every request into per-worker rings in file, for otp_tracedump,
+ * and -l ms logs the timeline of any request slower than ms.
+ * Admission control: -c N serves at most N connections at once, per worker
+ * (default MAX_FORKS with -f, no limit otherwise). Connections past that wait
+ * for a slot in a queue of -q N (DEFAULT_QUEUE) for up to -d ms
+ * (DEFAULT_QUEUE_MS), and are answered busy when it is full or they time out.
+ * -b N is the kernel's accept queue length for each listening socket.
+ * -T idle[,header[,body]] sets the connection deadlines in ms, 0 for none
+ * (see struct connLimits; default DEFAULT_IDLE_MS, DEFAULT_HEADER_MS and
+ * DEFAULT_BODY_MS). A client that runs past one is disconnected, so a stalled
+ * or trickling client can't hold on to a slot.
+ *****************************/
+int daemonMain(int argc, char *argv[], const struct otpService* svc)
+{
+	int listenSocketFDs[MAX_PORTS];
+	char* const* ports;
+	int numPorts, opt;
+	int forkMode = 0;
+	const char* tracePath = NULL;
+	int numWorkers = -1;		// -1 = no workers, serve from this process
+	int zeroCopy = 0;
+
+	while((opt = getopt(argc, argv, "b:c:d:fi:k:l:m:q:t:T:w:z")) != -1){
+		switch(opt){
+			case 'b':
+				backlog = atoi(optarg);
+				if(backlog <= 0){ backlog = SOMAXCONN; }
+				break;
+			case 'c':
+				admission.maxActive = atoi(optarg);
+				if(admission.maxActive < 0){ admission.maxActive = 0; }
+				break;
+			case 'd':
+				admission.queueMs = strtoul(optarg, NULL, 10);
+				break;
+			case 'f':
+				forkMode = 1;
+				break;
+			case 'i':
+				if(strcmp(optarg, "uring") == 0){ useUring = 1; }
+				else if(strcmp(optarg, "epoll") == 0){ useUring = 0; }
+				else{ fprintf(stderr,"ERROR: -i takes epoll or uring\n"); exit(1); }
+				break;
+			case 'k':
+				// Load the keys before any workers are forked so they share the mappings
+				if(keysOpen(optarg) < 0){ error("ERROR opening key directory"); }
+				break;
+			case 'l':
+				traceSlowAfter(atof(optarg) * 1e6);
+				break;
+			case 'm':
+				metricsSocketFD = openMetricsListener(optarg);
+				break;
+			case 'q':
+				admission.queueLen = atoi(optarg);
+				if(admission.queueLen < 0){ admission.queueLen = 0; }
+				break;
+			case 't':
+				tracePath = optarg;
+				break;
+			case 'T':
+				parseLimits(optarg);
+				break;
+			case 'w':
+				numWorkers = atoi(optarg);
+				if(numWorkers <= 0){ numWorkers = sysconf(_SC_NPROCESSORS_ONLN); }
+				if(numWorkers <= 0){ numWorkers = 1; }
+				break;
+			case 'z':
+				zeroCopy = 1;
+				break;
+			default:
+				fprintf(stderr,"USAGE: %s [-f | -w workers] [-i epoll|uring] [-z] [-c maxconns] [-q queuelen] [-d queuems] [-b backlog] [-T idle,header,body] [-k keydir] [-m metricsport|path] [-t tracefile] [-l slowms] port|path [port|path ...]\n", argv[0]);
+				exit(1);
+		}
+	}
+	if (optind >= argc) { fprintf(stderr,"USAGE: %s [-f | -w workers] [-i epoll|uring] [-z] [-c maxconns] [-q queuelen] [-d queuems] [-b backlog] [-T idle,header,body] [-k keydir] [-m metricsport|path] [-t tracefile] [-l slowms] port|path [port|path ...]\n", argv[0]); exit(1); } // Check usage & args
+	if (forkMode && numWorkers > 0) { fprintf(stderr,"ERROR: -f and -w can't be combined\n"); exit(1); }
+	if (forkMode && useUring) { fprintf(stderr,"ERROR: -f and -i uring can't be combined\n"); exit(1); }
+	if (forkMode && zeroCopy) { fprintf(stderr,"ERROR: -f and -z can't be combined\n"); exit(1); }
+	if (argc - optind > MAX_PORTS) { fprintf(stderr,"ERROR: at most %d ports\n", MAX_PORTS); exit(1); }
+	if (admission.maxActive < 0) { admission.maxActive = forkMode ? MAX_FORKS : 0; }
+	connUseZeroCopy(zeroCopy);
+
+	// UNIX sockets can't be load balanced with SO_REUSEPORT, so each is opened
+	// once here and every worker accepts from the same one
+	ports = argv + optind;
+	numPorts = argc - optind;
+	for(int i = 0; i < numPorts; i++){
+		unixSocketFDs[i] = strchr(ports[i], '/') != NULL ? openUnixListener(ports[i], backlog) : -1;
+	}
+
+	// Pick the transform kernels once, before any workers are forked
+	cipherInit();
+
+	// Counters live in shared memory, one slot per worker, so any process can report all of them
+	if(metricsInit(numWorkers > 0 ? numWorkers : 1) != 0){ error("ERROR mapping metrics"); }
+	if(tracePath != NULL && traceOpen(tracePath, numWorkers > 0 ? numWorkers : 1) != 0){ error("ERROR creating trace file"); }
+
+	if(numWorkers > 0){
+		return runWorkers(ports, numPorts, numWorkers, svc);
+	}
+
+	if(forkMode){
+		openListeners(ports, numPorts, backlog, 0, listenSocketFDs); 		// Flip the sockets on
+		runForkServer(listenSocketFDs, numPorts, svc);
+	}
+	else{
+		openListeners(ports, numPorts, backlog, 0, listenSocketFDs);	// The event loop drains the queues as fast as clients arrive
+		signal(SIGPIPE, SIG_IGN);
+		raiseFileLimit();
+		serveLoop(listenSocketFDs, numPorts, svc);
+	}
+
+	// Close the listening sockets
+	for(int i = 0; i < numPorts; i++){
+		close(listenSocketFDs[i]);
+	}
+
+	return 1;
+}
+
+/*****************************
+ * Create a TCP socket listening on portNumber on any address. With reusePort
+ * set, several sockets can bind the same port and the kernel spreads incoming
+ * connections across them. Exits on failure.
+ *****************************/
+static int openListener(int portNumber, int backlog, int reusePort){
+	int listenSocketFD, on = 1;
+	struct sockaddr_in serverAddress;
+
+	// Set up the address struct for this process (the server)
+	memset((char *)&serverAddress, '\0', sizeof(serverAddress)); 	// Clear out the address struct
+	serverAddress.sin_family = AF_INET; 							// Create a network-capable socket
+	serverAddress.sin_port = htons(portNumber); 					// Store the port number
+	serverAddress.sin_addr.s_addr = INADDR_ANY; 					// Any address is allowed for connection to this process
+
+	// Set up the socket
+	listenSocketFD = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0); // Create the socket
+	if (listenSocketFD < 0) error("ERROR opening socket");
+
+	if (reusePort && setsockopt(listenSocketFD, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0)
+		error("ERROR setting SO_REUSEPORT");
+
+	// Shed connections are closed from this end and linger in TIME_WAIT, which
+	// would otherwise keep a restarted daemon from binding the port for a minute
+	setsockopt(listenSocketFD, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+	// Accepted sockets inherit this. Replies go out as a data record and then a small
+	// end record, and Nagle would hold the end record back for the client's delayed ACK.
+	setsockopt(listenSocketFD, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+	// Enable the socket to begin listening
+	if (bind(listenSocketFD, (struct sockaddr *)&serverAddress, sizeof(serverAddress)) < 0) // Connect socket to port
+		error("ERROR on binding");
+	if (listen(listenSocketFD, backlog) < 0)
+		error("ERROR on listen");
+
+	return listenSocketFD;
+}
+
+/*****************************
+ * Listening socket for metrics scrapes: a port on localhost only, or a UNIX
+ * socket if where contains a '/'. Every worker shares this one socket.
+ *****************************/
+static int openMetricsListener(const char* where){
+	struct sockaddr_in inetAddress;
+	int fd, on = 1;
+
+	if(strchr(where, '/') != NULL){ return openUnixListener(where, 16); }
+
+	memset(&inetAddress, '\0', sizeof(inetAddress));
+	inetAddress.sin_family = AF_INET;
+	inetAddress.sin_port = htons(atoi(where));
+	inetAddress.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(fd < 0) error("ERROR opening metrics socket");
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	if(bind(fd, (struct sockaddr*)&inetAddress, sizeof(inetAddress)) < 0) error("ERROR binding metrics socket");
+	if(listen(fd, 16) < 0) error("ERROR on listen for metrics");
+	return fd;
+}
+
+/*****************************
+ * Listening UNIX stream socket at path, replacing whatever an earlier run
+ * left there. Exits on failure.
+ *****************************/
+static int openUnixListener(const char* path, int backlog){
+	struct sockaddr_un address;
+	int fd;
+
+	memset(&address, '\0', sizeof(address));
+	address.sun_family = AF_UNIX;
+	if(strlen(path) >= sizeof(address.sun_path)){ fprintf(stderr, "ERROR: socket path too long: %s\n", path); exit(1); }
+	strcpy(address.sun_path, path);
+	unlink(path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(fd < 0) error("ERROR opening socket");
+	if(bind(fd, (struct sockaddr*)&address, sizeof(address)) < 0) error("ERROR on binding");
+	if(listen(fd, backlog) < 0) error("ERROR on listen");
+	return fd;
+}
+
+/*****************************
+ * openListener() for each of count ports, storing the sockets in listenSocketFDs.
+ * Paths get the UNIX socket daemonMain() already opened.
+ *****************************/
+static void openListeners(char* const* ports, int count, int backlog, int reusePort, int* listenSocketFDs){
+	for(int i = 0; i < count; i++){
+		listenSocketFDs[i] = unixSocketFDs[i] >= 0 ? unixSocketFDs[i] : openListener(atoi(ports[i]), backlog, reusePort);
+	}
+}
+
+/*****************************
+ * Serve from an event loop until it fails: the io_uring one if -i uring
+ * asked for it and the kernel has it, the epoll one otherwise
+ *****************************/
+static void serveLoop(const int* listenSocketFDs, int numPorts, const struct otpService* svc){
+	if(useUring){
+		if(runUringLoop(listenSocketFDs, numPorts, metricsSocketFD, &admission, svc) != 1){ return; }
+		fprintf(stderr, "SERVER: io_uring unavailable (%s), serving with epoll\n", strerror(errno));
+	}
+	runEventLoop(listenSocketFDs, numPorts, metricsSocketFD, &admission, svc);
+}
+
+/*****************************
+ * Start numWorkers long-lived event loop processes and keep them running.
+ * Each worker gets its own SO_REUSEPORT socket for every port, so the kernel
+ * load balances accepts between them and there is no shared accept queue to
+ * fight over.
+ * A worker that dies is replaced. One that keeps dying right after it starts
+ * is replaced a second later, then two, and so on, and after RESPAWN_TRIES
+ * such deaths in a row it is left dead; with no workers left the daemon
+ * exits. SIGINT/SIGTERM stop all of them.
+ * Returns 1 if every worker was given up on, 0 if asked to stop.
+ *****************************/
+static int runWorkers(char* const* ports, int numPorts, int numWorkers, const struct otpService* svc){
+	struct sigaction stop_action = {0};
+	pid_t* workerPids;
+	time_t* started;
+	time_t* restartAt;		// When a dead worker is due to be replaced, 0 if it isn't
+	int* quickDeaths;
+	pid_t pid;
+	int status, pending, alive, running = numWorkers;
+
+	workerPids = calloc(numWorkers, sizeof(pid_t));
+	started = calloc(numWorkers, sizeof(time_t));
+	restartAt = calloc(numWorkers, sizeof(time_t));
+	quickDeaths = calloc(numWorkers, sizeof(int));
+	if(workerPids == NULL || started == NULL || restartAt == NULL || quickDeaths == NULL) error("ERROR allocating worker table");
+
+	// No SA_RESTART, so wait() returns when we are asked to stop
+	stop_action.sa_handler = catchStop;
+	sigaction(SIGINT, &stop_action, NULL);
+	sigaction(SIGTERM, &stop_action, NULL);
+
+	for(int i = 0; i < numWorkers; i++){
+		workerPids[i] = spawnWorker(ports, numPorts, i, svc);
+		started[i] = time(NULL);
+	}
+
+	while(!stopRequested && running > 0){
+		pending = alive = 0;
+		for(int i = 0; i < numWorkers; i++){
+			if(workerPids[i] > 0){ alive = 1; }
+			if(restartAt[i] == 0){ continue; }
+			if(restartAt[i] > time(NULL)){ pending = 1; continue; }
+			workerPids[i] = spawnWorker(ports, numPorts, i, svc);
+			started[i] = time(NULL);
+			restartAt[i] = 0;
+			alive = 1;
+		}
+		if(!alive){ sleep(1); continue; }
+
+		// Keep reaping while a restart waits, so the other workers' deaths are timed right
+		pid = waitpid(-1, &status, pending ? WNOHANG : 0);
+		if(pid == 0){ sleep(1); continue; }
+		if(pid < 0){
+			if(errno == EINTR){ continue; }
+			break;
+		}
+
+		for(int i = 0; i < numWorkers; i++){
+			if(workerPids[i] != pid){ continue; }
+			metricsWorkerExited(i);
+			workerPids[i] = 0;
+			quickDeaths[i] = time(NULL) - started[i] < RESPAWN_QUICK ? quickDeaths[i] + 1 : 0;
+			if(quickDeaths[i] >= RESPAWN_TRIES){
+				fprintf(stderr, "SERVER ERROR: worker %d (pid %d) exited right after starting %d times in a row, giving up on it\n",
+					i, (int)pid, quickDeaths[i]);
+				running--;
+				break;
+			}
+
+			if(quickDeaths[i] > 0){ fprintf(stderr, "SERVER: worker %d (pid %d) exited, restarting it in %d s\n", i, (int)pid, quickDeaths[i]); }
+			else{ fprintf(stderr, "SERVER: worker %d (pid %d) exited, restarting it\n", i, (int)pid); }
+			restartAt[i] = time(NULL) + quickDeaths[i];
+		}
+	}
+
+	// Take the workers down with us
+	for(int i = 0; i < numWorkers; i++){
+		if(workerPids[i] > 0){ kill(workerPids[i], SIGTERM); }
+	}
+	while(wait(NULL) > 0 || errno == EINTR);
+
+	free(workerPids);
+	free(started);
+	free(restartAt);
+	free(quickDeaths);
+	return running == 0;
+}
+
+/*****************************
+ * Fork worker number index. The listening sockets are opened before the fork so
+ * a port that can't be bound is reported by the parent instead of turning into
+ * a restart loop. The worker is pinned to one core when the machine has enough.
+ *****************************/
+static pid_t spawnWorker(char* const* ports, int numPorts, int index, const struct otpService* svc){
+	int listenSocketFDs[MAX_PORTS];
+	cpu_set_t allowed, mine;
+	int seen = 0, target;
+	pid_t spawnPid;
+
+	openListeners(ports, numPorts, backlog, 1, listenSocketFDs);
+
+	spawnPid = fork();
+	switch(spawnPid){
+		case -1:
+			error("Spawning worker went wrong!");
+			break;
+
+		case 0:
+			signal(SIGINT, SIG_DFL);
+			signal(SIGTERM, SIG_DFL);
+			signal(SIGPIPE, SIG_IGN);
+			raiseFileLimit();
+			metricsUseSlot(index);
+			traceUseRing(index);
+
+			// Pin to the index-th core we are allowed to run on
+			if(sched_getaffinity(0, sizeof(allowed), &allowed) == 0 && CPU_COUNT(&allowed) > 1){
+				target = index % CPU_COUNT(&allowed);
+				for(int cpu = 0; cpu < CPU_SETSIZE; cpu++){
+					if(CPU_ISSET(cpu, &allowed) && seen++ == target){
+						CPU_ZERO(&mine);
+						CPU_SET(cpu, &mine);
+						sched_setaffinity(0, sizeof(mine), &mine);
+						break;
+					}
+				}
+			}
+
+			serveLoop(listenSocketFDs, numPorts, svc);
+			exit(1);
+	}
+
+	// Only the worker accepts on these sockets. If the parent kept them open, connections
+	// the kernel hashed to them would be stranded once the worker is gone.
+	// The shared UNIX sockets stay open for the next worker.
+	for(int i = 0; i < numPorts; i++){
+		if(unixSocketFDs[i] < 0){ close(listenSocketFDs[i]); }
+	}
+	return spawnPid;
+}
+
+static void catchStop(int signo){
+	(void)signo;
+	stopRequested = 1;
+}
+
+/*****************************
+ * Fork a child for every connection, at most admission.maxActive at a time.
+ * The listening sockets are always accepted from, so clients never pile up in
+ * the kernel: ones that arrive while every child is busy wait in the
+ * admission queue until a child finishes, and are answered busy when the
+ * queue is full or they have waited too long. SIGCHLD is blocked except
+ * inside ppoll(), which also wakes up for it.
+ *****************************/
+static void runForkServer(const int* listenSocketFDs, int numPorts, const struct otpService* svc){
+	struct pollfd pfds[MAX_PORTS + 1];
+	struct admitQueue waiting;
+	struct timespec timeout;
+	sigset_t blocked, unblocked;
+	int establishedConnectionFD, numFDs = numPorts, ms;
+
+	if(admitInit(&waiting, &admission) != 0) error("ERROR allocating admission queue");
+
+	// Setup signals for SIGCHLD
+	setupSignals();
+	sigemptyset(&blocked);
+	sigaddset(&blocked, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &blocked, &unblocked);
+	sigdelset(&unblocked, SIGCHLD);
+
+	// The metrics listener, if any, is polled after the client ports
+	for(int i = 0; i < numPorts; i++){
+		pfds[i].fd = listenSocketFDs[i];
+		pfds[i].events = POLLIN;
+		fcntl(pfds[i].fd, F_SETFL, fcntl(pfds[i].fd, F_GETFL) | O_NONBLOCK);
+	}
+	if(metricsSocketFD >= 0){
+		pfds[numFDs].fd = metricsSocketFD;
+		pfds[numFDs++].events = POLLIN;
+		fcntl(metricsSocketFD, F_SETFL, fcntl(metricsSocketFD, F_GETFL) | O_NONBLOCK);
+	}
+
+	// Run server forever
+	while(1){
+		// Children that finished made room for clients that have been waiting
+		while(childSlotFree() && (establishedConnectionFD = admitPop(&waiting)) >= 0){
+			forkChild(establishedConnectionFD, 0, &waiting, listenSocketFDs, numPorts, svc);
+		}
+
+		ms = admitTimeout(&waiting);
+		timeout.tv_sec = ms / 1000;
+		timeout.tv_nsec = (ms % 1000) * 1000000L;
+		if(ppoll(pfds, numFDs, ms < 0 ? NULL : &timeout, &unblocked) < 0){
+			if(errno == EINTR){ continue; }
+			error("ERROR polling listening sockets");
+		}
+
+		for(int i = 0; i < numFDs; i++){
+			if(!(pfds[i].revents & POLLIN)){ continue; }
+			if(i < numPorts){ metricsSampleQueue(i, pfds[i].fd); }
+
+			establishedConnectionFD = accept(pfds[i].fd, NULL, NULL); // Accept
+			if(establishedConnectionFD < 0){
+				if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED){
+					METRIC_ADD(acceptErrors, 1);
+					perror("ERROR on accept");
+				}
+				continue;
+			}
+
+			// Scrapes skip the queue and take no slot: the counters matter most when the daemon is overloaded
+			if(i == numPorts && numScrapers == MAX_SCRAPERS){ close(establishedConnectionFD); }
+			else if(i == numPorts){ forkChild(establishedConnectionFD, 1, &waiting, listenSocketFDs, numPorts, svc); }
+			else if(childSlotFree() && waiting.count == 0){ forkChild(establishedConnectionFD, 0, &waiting, listenSocketFDs, numPorts, svc); }
+			else{ admitPush(&waiting, establishedConnectionFD); }
+		}
+	}
+}
+
+/*****************************
+ * Fork a child to serve establishedConnectionFD, or to answer a metrics
+ * scrape on it if scrape is set. The child closes the numPorts listening
+ * sockets, which are the parent's to accept on.
+ *****************************/
+static void forkChild(int establishedConnectionFD, int scrape, struct admitQueue* waiting, const int* listenSocketFDs, int numPorts, const struct otpService* svc){
+	pid_t spawnPid = -5;
+
+	spawnPid = fork();
+	switch(spawnPid){
+		// Error
+		case -1:
+			perror("Spawning fork went wrong!\n");
+			exit(1);
+			break;
+
+		// Child process
+		case 0:
+			admitForget(waiting);		// The parent's to serve or turn away
+			for(int i = 0; i < numPorts; i++){
+				close(listenSocketFDs[i]);
+			}
+			if(metricsSocketFD >= 0){ close(metricsSocketFD); }
+			if(scrape){
+				serveMetrics(establishedConnectionFD);
+				close(establishedConnectionFD);
+				exit(0);
+			}
+
+			// Stream the request back through the transform one chunk at a time
+			if(serveConnection(establishedConnectionFD, svc) != 0){
+				close(establishedConnectionFD);
+				exit(1);
+			}
+
+			// Close the existing socket which is connected to the client
+			close(establishedConnectionFD);
+
+			// Exit child process
+			exit(0);
+			break;
+
+		// Parent process
+		default:
+			if(scrape){ scrapers[numScrapers++] = spawnPid; }
+			else{ numChildren += 1; }
+			close(establishedConnectionFD);		// The child owns the connection now
+			break;
+	}
+}
+
+/*****************************
+ * Fork mode: whether another client may get a child now
+ *****************************/
+static int childSlotFree(){
+	return admission.maxActive == 0 || numChildren < admission.maxActive;
+}
+
+/*****************************
+ * Read -T idle[,header[,body]], keeping the default for any left out
+ *****************************/
+static void parseLimits(const char* spec){
+	struct connLimits limits = { DEFAULT_IDLE_MS, DEFAULT_HEADER_MS, DEFAULT_BODY_MS };
+	unsigned int* fields[] = { &limits.idleMs, &limits.headerMs, &limits.bodyMs };
+	char* end;
+
+	for(int i = 0; i < 3 && *spec != '\0'; i++){
+		*fields[i] = strtoul(spec, &end, 10);
+		if(end == spec || (*end != ',' && *end != '\0')){ fprintf(stderr, "ERROR: -T takes idle,header,body in ms\n"); exit(1); }
+		spec = *end == ',' ? end + 1 : end;
+	}
+	connSetLimits(&limits);
+}
+
+/*****************************
+ * Every client is a file descriptor in the event loop, so allow as
+ * many as the hard limit permits instead of the usual 1024
+ *****************************/
+static void raiseFileLimit(){
+	struct rlimit limit;
+
+	if(getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max){
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+}
+
+/*******************
+ * Setting up signals to catch SIGCHLD
+ *******************/
+static void setupSignals(){
+	struct sigaction sigchild_action = {0};
+	sigchild_action.sa_handler = catchSIGCHLD;
+	sigchild_action.sa_flags = SA_RESTART;
+
+	sigaction(SIGCHLD, &sigchild_action, NULL);	// Register signal catcher
+}
+
+/*******************
+ * Any time a child terminates, SIGCHLD will call checkForTerm
+ *******************/
+static void catchSIGCHLD(int signo){
+	(void)signo;
+	checkForTerm();
+}
+
+/**********************
+ * Reap every child that has finished. SIGCHLD is only let in while the
+ * fork server waits in ppoll(), so this never races with a fork.
+ **********************/
+static void checkForTerm(){
+	int savedErrno = errno;
+	pid_t pid;
+	int i;
+
+	while((pid = waitpid(-1, NULL, WNOHANG)) > 0){
+		for(i = 0; i < numScrapers && scrapers[i] != pid; i++);
+		if(i < numScrapers){ scrapers[i] = scrapers[--numScrapers]; }
+		else{ numChildren -= 1; }
+	}
+	errno = savedErrno;
+}
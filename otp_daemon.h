@@ -0,0 +1,8 @@
+#ifndef OTP_DAEMON_H
+#define OTP_DAEMON_H
+
+#include "otp_conn.h"
+
+int daemonMain(int, char*[], const struct otpService*);
+
+#endif
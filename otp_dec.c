@@ -1,225 +1,142 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/socket.h>
-#include <netinet/in.h>
-#include <netdb.h> 
+#include "otp_client.h"
 
-#define h_addr h_addr_list[0] /* for backward compatibility */
-#define ORIGIN ' '		// If ORIGIN = '!', we are coming from otp_enc -- if ORIGIN = ' ', we are coming from otp_dec
+#define OPCODE BIN_OP_DECRYPT	// Binary request opcode, see otp_proto.h
 
 void error(const char *msg) { perror(msg); exit(0); } // Error function used for reporting issues
 
 /* argv[0] = otp_enc
- * argv[1] = plaintext
- * argv[2] = key file
- * argv[3] = port
+ * options: -r sends only the key's id, registering the key with the daemon
+ *          the first time, -o N starts N characters into the key,
+ *          -s sends every line of the ciphertext as its own request on one
+ *          connection and prints one line back for each
+ *          -u path connects to the daemon's UNIX socket at path instead of a port,
+ *          handing it ciphertext files of FD_PASS_MIN bytes or more as open files
+ * then: ciphertext (a file, a pipe, or - for stdin), key file, port (unless -u)
  */
 
 /* Function prototypes */
-int checkPlaintext(FILE*, int*);
-int getKeySize(FILE*);
-int checkSize(int, int);
-void populateBuffer(FILE*, int, FILE*, int, char*);
+int checkSize(size_t, size_t);
 
 int main(int argc, char *argv[])
 {
-	int socketFD, portNumber, charsWritten, charsRead;
-	struct sockaddr_in serverAddress;
-	struct hostent* serverHostInfo;	
-    
-	if (argc < 4) { fprintf(stderr, "USAGE: %s plaintext hostname port\n", argv[0]); exit(0); } // Check usage & args
-
-	// plaintext file vars
-	int textSize = 0;
-	FILE* plainFP;
-	plainFP = fopen(argv[1], "r");
-
-	if(plainFP == NULL){
+	int portNumber, socketFD, result, opt, inFD;
+	int keyRef = 0, session = 0, unixSocket = 0, count;
+	size_t keyOffset = 0, textSize;
+	char header[BIN_HEADER_SIZE];
+	struct binHeader req = { .op = OPCODE };
+	struct otpMessage* msgs;
+	struct inputFile plain, key;
+
+	while((opt = getopt(argc, argv, "rso:u:")) != -1){
+		switch(opt){
+			case 'r':
+				keyRef = 1;
+				break;
+			case 's':
+				session = 1;
+				break;
+			case 'o':
+				keyOffset = strtoul(optarg, NULL, 10);
+				break;
+			case 'u':
+				useSocketPath(optarg);
+				unixSocket = 1;
+				break;
+			default:
+				fprintf(stderr, "USAGE: %s [-r] [-s] [-o keyoffset] [-u socketpath] plaintext|- key [port]\n", argv[0]);
+				exit(0);
+		}
+	}
+	if (argc - optind < (unixSocket ? 2 : 3)) { fprintf(stderr, "USAGE: %s [-r] [-s] [-o keyoffset] [-u socketpath] plaintext|- key [port]\n", argv[0]); exit(0); } // Check usage & args
+	argv += optind - 1;		// From here on argv[1..3] are the positional arguments
+	if (keyOffset > 0 && !keyRef) { fprintf(stderr, "ERROR: -o needs -r\n"); exit(1); }
+	portNumber = unixSocket ? 0 : atoi(argv[3]); 				// Get the port number, convert to an integer from a string
+
+	// Stdin and pipes are read a chunk at a time and their output written as it comes back
+	inFD = openStream(argv[1]);
+	if(inFD >= 0){
+		if(session){ fprintf(stderr, "ERROR: -s needs a ciphertext file\n"); exit(1); }
+		if(keyRef){ return keyRefStream(portNumber, OPCODE, inFD, argv[2], keyOffset); }
+
+		if(mapInput(argv[2], &key) != 0){
+			fprintf(stderr, "ERROR: keyfile does not exist or is null.\n");
+			exit(1);
+		}
+		req.textSize = key.size;		// The key bounds how much text can follow
+		req.keySize = key.size;
+		formatBinHeader(header, &req);
+		socketFD = connectDaemon(portNumber);
+		result = streamInput(socketFD, header, BIN_HEADER_SIZE, inFD, key.data, key.size);
+		close(socketFD);
+		unmapInput(&key);
+		return result;
+	}
+
+	// Map the plaintext file. The daemon checks its characters as it goes.
+	if(mapInput(argv[1], &plain) != 0){
 		fprintf(stderr, "ERROR: plaintext file does not exist or is null.\n");
-		fclose(plainFP);
 		exit(1);
 	}
 
-	// Get keygen file
-	FILE* keyFP;
-	keyFP = fopen(argv[2], "r");
+	count = splitMessages(&plain, session, &msgs, &textSize);
+
+	if(keyRef){
+		// Only the plaintext is read here, the key stays on disk
+		result = keyRefRequest(portNumber, OPCODE, 0, msgs, count, argv[2], keyOffset, session);
+		free(msgs);
+		unmapInput(&plain);
+
+		// Add newline character
+		if(result == 0 && !session){ printf("\n"); }
+		return result;
+	}
 
-	if(keyFP == NULL){
+	// Map the key file the same way
+	if(mapInput(argv[2], &key) != 0){
 		fprintf(stderr, "ERROR: keyfile does not exist or is null.\n");
-		fclose(keyFP);
 		exit(1);
 	}
 
-	// Check validity of plaintext file
-	int textResult = checkPlaintext(plainFP, &textSize);
-	
 	// Check size of key vs. size of plaintext
-	int keySize = getKeySize(keyFP);
+	if(checkSize(textSize, key.size) != 0){ exit(1); }
 
-	if(textResult != 0 || checkSize(textSize, keySize) != 0){ 
-		fclose(plainFP);
-		fclose(keyFP);
-		exit(1);
-	}
+	socketFD = connectDaemon(portNumber);
 
-	// Populate buffer
-	char buffer[textSize + keySize + 21 + 1];	// +21 will be: origin number(1) +  plainfile size(char array size of 10) + keyfile size(char array size of 10) + 1 null character
-	memset(buffer, '-', sizeof(buffer));
-	populateBuffer(keyFP, keySize, plainFP, textSize, buffer);
-
-	// Set up the server address struct
-	memset((char*)&serverAddress, '\0', sizeof(serverAddress)); // Clear out the address struct
-	portNumber = atoi(argv[3]); 								// Get the port number, convert to an integer from a string
-	serverAddress.sin_family = AF_INET; 						// Create a network-capable socket
-	serverAddress.sin_port = htons(portNumber); 				// Store the port number
-	serverHostInfo = gethostbyname("localhost"); 				// Convert the machine name into a special form of address
-
-	if (serverHostInfo == NULL) { fprintf(stderr, "CLIENT: ERROR, no such host\n"); exit(0); }
-	memcpy((char*)&serverAddress.sin_addr.s_addr, (char*)serverHostInfo->h_addr, serverHostInfo->h_length); // Copy in the address
-
-	// Set up the socket
-	socketFD = socket(AF_INET, SOCK_STREAM, 0); 				// Create the socket
-	if (socketFD < 0) error("CLIENT: ERROR opening socket");
-	
-	// Connect to server
-	if (connect(socketFD, (struct sockaddr*)&serverAddress, sizeof(serverAddress)) < 0) // Connect socket to address
-		error("CLIENT: ERROR connecting");
-
-	// Send message to server
-	charsWritten = send(socketFD, buffer, strlen(buffer), 0);  	// Write to the server 
-	if (charsWritten < 0) error("CLIENT: ERROR writing to socket");
-	if (charsWritten < strlen(buffer)) printf("CLIENT: WARNING: Not all data written to socket!\n");
-
-	// Get return message from server
-	memset(buffer, '\0', sizeof(buffer)); 						// Clear out the buffer again for reuse
-	charsRead = recv(socketFD, buffer, sizeof(buffer) - 1, 0); 	// Read data from the socket, leaving \0 at end
-	if (charsRead < 0) error("CLIENT: ERROR reading from socket");
-
-	// Print message from serve
-	for(int i = 0; i < strlen(buffer); i++){
-		printf("%c", buffer[i]);
+	if(unixSocket && !session && textSize >= FD_PASS_MIN){
+		// A big file next door goes to the daemon as a descriptor, not as bytes
+		result = fdRequest(socketFD, OPCODE, argv[1], textSize, argv[2], key.size);
+	}
+	else{
+		// Send the messages straight from the mapped files and print the replies as they arrive
+		attachKey(msgs, count, OPCODE, key.data, key.size);
+		result = streamRequests(socketFD, msgs, count, session);
 	}
+	free(msgs);
 
 	// Add newline character
-	printf("\n");
+	if(result == 0 && !session){ printf("\n"); }
 
 	close(socketFD); // Close the socket
-	return 0;
-}
-
-/*********************
- * This function will populate the buffer array with the contents of the plainfile
- * and the key file. Buffer will be a concatenated version of all the information
- * needed to send to the server. The beginning of buffer will also contain information
- * for the server about plainfile size, keyfile size, and the origin location. Value of 0
- * will represent origin from otp_enc, value of 1 will be an origin from otp_dec. 
- * Buffer = origin number + plainfile Size + keyfile size + plainfile + keyfile
- *********************/
-void populateBuffer(FILE* keyFP, int keySize, FILE* plainFP, int textSize, char* buffer){
-
-	// Start at beginning of both files again
-	rewind(plainFP);
-	rewind(keyFP);
-
-	int bufferPos = 0;
-
-	char textSizeC[10];		// Character "string" version of text size (to be copied into buffer)
-	char keySizeC[10];		// Character "string" version of text size (to be copied into buffer)
-
-	// Clear textSizeC and keySizeC
-	memset(textSizeC, '-', sizeof(textSizeC));
-	memset(keySizeC, '-', sizeof(keySizeC));
-
-	// Convert int textSize and keySize into character array
-	sprintf(textSizeC, "%d", textSize);
-	sprintf(keySizeC, "%d", keySize);	
-
-	// sprintf adds null terminating character at the end, replace with '-'
-	textSizeC[strcspn(textSizeC, "\0")] = '-';
-	keySizeC[strcspn(keySizeC, "\0")] = '-';
-
-	// Print origin into buffer
-	buffer[bufferPos] = ORIGIN;	
-	bufferPos += 1;
-
-	// Print number of chars in plainfile
-	for(int i = 0; i < 10; i++){
-		buffer[bufferPos + i] = textSizeC[i];
-	}
-	bufferPos += 10;
-
-	// Print number of chars in keyfile
-	for(int i = 0; i < 10; i++){
-		buffer[bufferPos + i] = keySizeC[i];
-	}
-	bufferPos += 10;
-
-	// Put contents of plainfile into buffer
-	char c = fgetc(plainFP);
-	while(c != '\n'){	
-		buffer[bufferPos] = c;
-		bufferPos += 1;	
-		c = fgetc(plainFP);
-	}
-
-	// Put contents of keyfile into buffer	
-	c = fgetc(keyFP);
-	while(c != '\n'){	
-		buffer[bufferPos] = c;
-		bufferPos += 1;	
-		c = fgetc(keyFP);
-	}
-
-	// Add null terminator at end of string
-	buffer[bufferPos] = '\0';
+	unmapInput(&plain);
+	unmapInput(&key);
+	return result;
 }
 
 /*********************
  * This function checks text size against the key size. If text size
  * is greater than key size, return an error (1)
  *********************/
-int checkSize(int textSize, int keySize){
+int checkSize(size_t textSize, size_t keySize){
 	if(textSize > keySize){
 		fprintf(stderr, "ERROR: plaintext size is greater than keysize.\n");
 		return 1;
 	}
 	return 0;
 }
-
-/*********************
- * This function just gets the number of characters
- * in the key file.
- *********************/
-int getKeySize(FILE* fp){
-	int result = 0;
-	char c = fgetc(fp);
-
-	while(c != '\n'){	
-		result += 1;
-		c = fgetc(fp);
-	}
-	return result;
-}
-
-/*********************
- * This function checks to make sure all the letters
- * in the plaintext file (fp) are A - Z or a ' ' character.
- * Returns 1 if failed, returns 0 if everything is fine.
- *********************/
-int checkPlaintext(FILE* fp, int* size){
-	char c = fgetc(fp);
-
-	while(c != '\n'){
-		if(!(c >= 'A' && c <= 'Z' || c == ' ')){
-			fprintf(stderr, "ERROR: bad characters found in plaintext file.\n");
-			return 1;
-		}	
-		*size += 1;
-		c = fgetc(fp);
-	}
-	
-	return 0;
-}
@@ -0,0 +1,215 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/random.h>
+#include "otp_keygen.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
+// Function prototypes
+static size_t mapCharsScalar(char*, const unsigned char*, const unsigned char*);
+static int alwaysSupported();
+
+/*****************************
+ * Key the generator with 256 bits from the kernel and a random nonce
+ *****************************/
+void seedChacha(struct chacha* rng){
+	uint32_t seed[10];		// 8 words of key, 2 of nonce
+	size_t have = 0;
+	ssize_t n;
+
+	while(have < sizeof(seed)){
+		n = getrandom((char*)seed + have, sizeof(seed) - have, 0);
+		if(n < 0){
+			if(errno == EINTR){ continue; }
+			perror("ERROR getting random seed");
+			exit(1);
+		}
+		have += n;
+	}
+
+	rng->input[0] = 0x61707865;		// "expand 32-byte k"
+	rng->input[1] = 0x3320646e;
+	rng->input[2] = 0x79622d32;
+	rng->input[3] = 0x6b206574;
+	memcpy(rng->input + 4, seed, 8 * sizeof(uint32_t));
+	rng->input[12] = 0;				// Block counter, low and high word
+	rng->input[13] = 0;
+	rng->input[14] = seed[8];
+	rng->input[15] = seed[9];
+}
+
+#define ROTL(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+
+#define QUARTER(a, b, c, d) \
+	x[a] += x[b]; x[d] ^= x[a]; x[d] = ROTL(x[d], 16); \
+	x[c] += x[d]; x[b] ^= x[c]; x[b] = ROTL(x[b], 12); \
+	x[a] += x[b]; x[d] ^= x[a]; x[d] = ROTL(x[d], 8); \
+	x[c] += x[d]; x[b] ^= x[c]; x[b] = ROTL(x[b], 7);
+
+/*****************************
+ * Body of a refill with LANES blocks per pass, for a vector type vec of
+ * LANES 32-bit words. Runs RNG_BLOCKS / LANES passes.
+ *****************************/
+#define CHACHA_REFILL(vec, LANES) \
+	uint64_t counter = rng->input[12] | (uint64_t)rng->input[13] << 32; \
+	for(int pass = 0; pass < RNG_BLOCKS / (LANES); pass++){ \
+		vec x[16], start[16]; \
+		for(int w = 0; w < 16; w++){ \
+			for(int l = 0; l < (LANES); l++){ start[w][l] = rng->input[w]; } \
+		} \
+		for(int l = 0; l < (LANES); l++){ \
+			start[12][l] = (uint32_t)(counter + l); \
+			start[13][l] = (uint32_t)((counter + l) >> 32); \
+		} \
+		memcpy(x, start, sizeof(x)); \
+		for(int round = 0; round < 10; round++){ \
+			QUARTER(0, 4, 8, 12) \
+			QUARTER(1, 5, 9, 13) \
+			QUARTER(2, 6, 10, 14) \
+			QUARTER(3, 7, 11, 15) \
+			QUARTER(0, 5, 10, 15) \
+			QUARTER(1, 6, 11, 12) \
+			QUARTER(2, 7, 8, 13) \
+			QUARTER(3, 4, 9, 14) \
+		} \
+		for(int w = 0; w < 16; w++){ x[w] += start[w]; } \
+		memcpy(rng->out + pass * (LANES) * BLOCK_BYTES, x, sizeof(x)); \
+		counter += (LANES); \
+	} \
+	rng->input[12] = (uint32_t)counter; \
+	rng->input[13] = (uint32_t)(counter >> 32);
+
+/*****************************
+ * Refill kernels. 16 vector registers hold 4 lanes (SSE2) or 8 lanes (AVX2)
+ * of state without spilling, AVX-512 has 32 registers of 16 lanes.
+ *****************************/
+static void refillChachaGeneric(struct chacha* rng){
+	typedef uint32_t vec4 __attribute__((vector_size(16)));
+	CHACHA_REFILL(vec4, 4)
+}
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("avx2")))
+static void refillChachaAVX2(struct chacha* rng){
+	typedef uint32_t vec8 __attribute__((vector_size(32)));
+	CHACHA_REFILL(vec8, 8)
+}
+
+__attribute__((target("avx512f")))
+static void refillChachaAVX512(struct chacha* rng){
+	typedef uint32_t vec16 __attribute__((vector_size(64)));
+	CHACHA_REFILL(vec16, 16)
+}
+
+/*****************************
+ * AVX-512 VBMI2 version of mapCharsScalar(): two 128 entry byte permutes do
+ * the table lookup for 64 bytes at once, and a compress packs the accepted
+ * characters together. out needs 64 bytes of slack past what is kept.
+ *****************************/
+__attribute__((target("avx512f,avx512bw,avx512vbmi,avx512vbmi2")))
+static size_t mapCharsVBMI2(char* out, const unsigned char* random, const unsigned char* table){
+	__m512i t0 = _mm512_loadu_si512(table);
+	__m512i t1 = _mm512_loadu_si512(table + 64);
+	__m512i t2 = _mm512_loadu_si512(table + 128);
+	__m512i t3 = _mm512_loadu_si512(table + 192);
+	size_t have = 0;
+
+	for(int i = 0; i < RNG_BYTES; i += 64){
+		__m512i r = _mm512_loadu_si512(random + i);
+		__m512i low = _mm512_permutex2var_epi8(t0, r, t1);		// Uses the low 7 bits of each byte
+		__m512i high = _mm512_permutex2var_epi8(t2, r, t3);
+		__m512i c = _mm512_mask_blend_epi8(_mm512_movepi8_mask(r), low, high);
+		__mmask64 keep = _mm512_test_epi8_mask(c, c);
+
+		_mm512_storeu_si512(out + have, _mm512_maskz_compress_epi8(keep, c));
+		have += __builtin_popcountll(keep);
+	}
+	return have;
+}
+
+static int haveAVX2(){ __builtin_cpu_init(); return __builtin_cpu_supports("avx2") != 0; }
+static int haveAVX512(){ __builtin_cpu_init(); return __builtin_cpu_supports("avx512f") != 0; }
+static int haveVBMI2(){ __builtin_cpu_init(); return __builtin_cpu_supports("avx512vbmi2") != 0; }
+#endif
+
+static int alwaysSupported(){ return 1; }
+
+// Best first. keygenKernels() takes the first one of each the CPU supports.
+static const struct refillImpl refills[] = {
+#ifdef HAVE_X86_SIMD
+	{ "avx512", haveAVX512, refillChachaAVX512 },
+	{ "avx2", haveAVX2, refillChachaAVX2 },
+#endif
+	{ "generic", alwaysSupported, refillChachaGeneric },
+};
+
+static const struct mapImpl maps[] = {
+#ifdef HAVE_X86_SIMD
+	{ "vbmi2", haveVBMI2, mapCharsVBMI2 },
+#endif
+	{ "scalar", alwaysSupported, mapCharsScalar },
+};
+
+/*****************************
+ * Use the widest kernels this CPU supports
+ *****************************/
+void keygenKernels(refillFn* refill, mapFn* map){
+	for(size_t i = 0; i < sizeof(refills) / sizeof(refills[0]); i++){
+		if(refills[i].supported()){ *refill = refills[i].refill; break; }
+	}
+	for(size_t i = 0; i < sizeof(maps) / sizeof(maps[0]); i++){
+		if(maps[i].supported()){ *map = maps[i].map; break; }
+	}
+}
+
+/*****************************
+ * Every kernel compiled in, best first, whether or not this CPU supports
+ * it. Used by the benchmarks to compare them side by side.
+ *****************************/
+const struct refillImpl* refillImpls(int* count){
+	*count = sizeof(refills) / sizeof(refills[0]);
+	return refills;
+}
+
+const struct mapImpl* mapImpls(int* count){
+	*count = sizeof(maps) / sizeof(maps[0]);
+	return maps;
+}
+
+/*****************************
+ * Fill table with the characters we want in the keygen: A-Z, and ' '.
+ * 256 is not a multiple of 27, so bytes from 243 (9 * 27) up are mapped to
+ * 0 and thrown away, leaving every character exactly 9 bytes out of 243.
+ *****************************/
+void buildCharTable(unsigned char* table){
+	int lowerLimit = 65;	// 65 == 'A' in ASCII
+
+	for(int i = 0; i < 256; i++){
+		if(i >= 9 * NUM_KEY_CHARS){ table[i] = 0; }
+		else if(i % NUM_KEY_CHARS == NUM_KEY_CHARS - 1){ table[i] = ' '; }
+		else{ table[i] = lowerLimit + i % NUM_KEY_CHARS; }
+	}
+}
+
+/*****************************
+ * Turn RNG_BYTES random bytes into key characters at out, dropping the ones
+ * table rejects. Returns the number of characters kept. The store always
+ * happens and the position only moves on for accepted bytes, so there is no
+ * branch to mispredict.
+ *****************************/
+static size_t mapCharsScalar(char* out, const unsigned char* random, const unsigned char* table){
+	size_t have = 0;
+
+	for(int i = 0; i < RNG_BYTES; i++){
+		char c = table[random[i]];
+		out[have] = c;
+		have += c != 0;
+	}
+	return have;
+}
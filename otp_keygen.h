@@ -0,0 +1,51 @@
+#ifndef OTP_KEYGEN_H
+#define OTP_KEYGEN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define NUM_KEY_CHARS 27
+#define BLOCK_BYTES 64				// Output of one ChaCha block
+#define RNG_BLOCKS 16				// Blocks produced per refill
+#define RNG_BYTES (RNG_BLOCKS * BLOCK_BYTES)
+#define MAP_SLACK 64				// Bytes a map kernel may write past the characters it keeps
+
+/*****************************
+ * Random source: ChaCha20 keyed from getrandom(). Several blocks are computed
+ * at once with one vector lane per block, using GCC vector types so the same
+ * code builds for whichever vector width the CPU has. The lanes are written
+ * out word by word rather than block by block, which reorders the stream but
+ * doesn't change anything about how random it is.
+ *****************************/
+struct chacha {
+	uint32_t input[16];				// Constants, key, 64-bit block counter, 64-bit nonce
+	unsigned char out[RNG_BYTES];
+};
+
+/*****************************
+ * Refill computes the next RNG_BYTES of the stream into out. Map turns those
+ * bytes into key characters through the table from buildCharTable() and
+ * returns how many it kept.
+ *****************************/
+typedef void (*refillFn)(struct chacha*);
+typedef size_t (*mapFn)(char*, const unsigned char*, const unsigned char*);
+
+struct refillImpl {
+	const char* name;
+	int (*supported)(void);		// 1 if this CPU can run it
+	refillFn refill;
+};
+
+struct mapImpl {
+	const char* name;
+	int (*supported)(void);
+	mapFn map;
+};
+
+void seedChacha(struct chacha*);
+void buildCharTable(unsigned char*);
+void keygenKernels(refillFn*, mapFn*);
+const struct refillImpl* refillImpls(int*);
+const struct mapImpl* mapImpls(int*);
+
+#endif
@@ -0,0 +1,263 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "otp_keys.h"
+#include "otp_proto.h"
+
+/*****************************
+ * Daemon-side key registry.
+ *
+ * Every key lives in one file in the key directory and is mapped read-only,
+ * so a pad used by thousands of requests is read from disk once and shared
+ * through the page cache by every daemon and worker that maps it. Keys are
+ * found by id (see keyId) through an open addressing hash table.
+ *
+ * Uploaded keys are stored as <id>.key. A daemon that misses in its own table
+ * looks for that file before giving up, which is how otp_enc_d and otp_dec_d
+ * pointed at the same directory see each other's uploads.
+ *****************************/
+
+#define MIN_TABLE 64		// Starting hash table size, always a power of 2
+
+// Function prototypes
+static const struct otpKey* loadKeyFile(const char*);
+static int mapKeyFile(const char*, struct otpKey*);
+static const struct otpKey* insertKey(struct otpKey*);
+static int keyPath(char*, unsigned long long);
+
+// Global vars
+static char keyDir[KEY_PATH_MAX];
+static struct otpKey* table = NULL;
+static size_t tableSize = 0;
+static size_t numKeys = 0;
+
+/*****************************
+ * Use dir as the key directory and map every key already in it. Files whose
+ * path wouldn't fit in KEY_PATH_MAX are skipped.
+ * Returns the number of keys loaded, or -1 if dir can't be read.
+ *****************************/
+int keysOpen(const char* dir){
+	char path[KEY_PATH_MAX];
+	struct dirent* entry;
+	DIR* d;
+	int loaded = 0;
+
+	if(snprintf(keyDir, sizeof(keyDir), "%s", dir) >= (int)sizeof(keyDir)){
+		keyDir[0] = '\0';
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	d = opendir(dir);
+	if(d == NULL){
+		keyDir[0] = '\0';
+		return -1;
+	}
+
+	while((entry = readdir(d)) != NULL){
+		if(entry->d_name[0] == '.'){ continue; }	// Skips ., .. and unfinished uploads
+		if(snprintf(path, sizeof(path), "%s/%s", keyDir, entry->d_name) >= (int)sizeof(path)){ continue; }
+		if(loadKeyFile(path) != NULL){ loaded++; }
+	}
+
+	closedir(d);
+	return loaded;
+}
+
+int keysEnabled(){
+	return keyDir[0] != '\0';
+}
+
+const char* keysDirectory(){
+	return keyDir;
+}
+
+/*****************************
+ * Find a key by id. On a miss, <id>.key is looked for in the key directory
+ * in case another daemon registered it. Returns NULL if the key is unknown.
+ * The returned entry moves when the table grows, so callers should copy
+ * what they need out of it. The mapping itself never moves.
+ *****************************/
+const struct otpKey* keysFind(unsigned long long id){
+	char path[KEY_PATH_MAX];
+	const struct otpKey* key;
+
+	if(tableSize > 0){
+		for(size_t i = id & (tableSize - 1); table[i].data != NULL; i = (i + 1) & (tableSize - 1)){
+			if(table[i].id == id){ return &table[i]; }
+		}
+	}
+
+	if(!keysEnabled()){ return NULL; }
+
+	if(keyPath(path, id) != 0){ return NULL; }
+	key = loadKeyFile(path);
+	return (key != NULL && key->id == id) ? key : NULL;
+}
+
+/*****************************
+ * Start receiving a key of size characters with the given id.
+ * Returns -1 if there is no key directory or the file can't be created.
+ *****************************/
+int keysUploadBegin(struct keyUpload* upload, unsigned long long id, size_t size){
+	memset(upload, '\0', sizeof(*upload));
+	upload->id = id;
+	upload->size = size;
+	upload->fd = -1;
+
+	if(!keysEnabled() || size == 0){ return -1; }
+	if(keysFind(id) != NULL){ return 0; }	// Already have it, just swallow the bytes
+
+	if(snprintf(upload->path, sizeof(upload->path), "%s/.%016llx.%d.tmp", keyDir, id, (int)getpid()) >= (int)sizeof(upload->path)){ return -1; }
+	upload->fd = open(upload->path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	return upload->fd < 0 ? -1 : 0;
+}
+
+/*****************************
+ * Append len received characters to the upload
+ *****************************/
+int keysUploadWrite(struct keyUpload* upload, const char* buf, size_t len){
+	ssize_t n;
+
+	upload->written += len;
+	if(upload->fd < 0){ return 0; }
+
+	while(len > 0){
+		n = write(upload->fd, buf, len);
+		if(n < 0){
+			if(errno == EINTR){ continue; }
+			return -1;
+		}
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/*****************************
+ * All characters are in. Make the file durable, move it into place and map it.
+ * Returns -1 and discards the upload if its content doesn't match the id.
+ *****************************/
+int keysUploadFinish(struct keyUpload* upload){
+	char path[KEY_PATH_MAX];
+	struct otpKey key;
+
+	if(upload->fd < 0){ return 0; }		// Was already registered
+
+	if(fdatasync(upload->fd) < 0){ keysUploadAbort(upload); return -1; }
+	close(upload->fd);
+	upload->fd = -1;
+
+	if(mapKeyFile(upload->path, &key) != 0){
+		unlink(upload->path);
+		return -1;
+	}
+	if(key.id != upload->id || keyPath(path, upload->id) != 0 || rename(upload->path, path) < 0){
+		munmap((void*)key.data, key.mapped);
+		unlink(upload->path);
+		return -1;
+	}
+	return insertKey(&key) != NULL ? 0 : -1;
+}
+
+void keysUploadAbort(struct keyUpload* upload){
+	if(upload->fd < 0){ return; }
+	close(upload->fd);
+	unlink(upload->path);
+	upload->fd = -1;
+}
+
+/*****************************
+ * Map a key file and add it to the table.
+ * Returns NULL if the file can't be used as a key.
+ *****************************/
+static const struct otpKey* loadKeyFile(const char* path){
+	struct otpKey key;
+
+	if(mapKeyFile(path, &key) != 0){ return NULL; }
+	return insertKey(&key);
+}
+
+/*****************************
+ * Map a key file and work out its id. A single trailing newline, as
+ * written by keygen, is not part of the key. Returns -1 on failure.
+ *****************************/
+static int mapKeyFile(const char* path, struct otpKey* key){
+	struct stat info;
+	char* data;
+	size_t size;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if(fd < 0){ return -1; }
+
+	if(fstat(fd, &info) < 0 || !S_ISREG(info.st_mode) || info.st_size == 0){
+		close(fd);
+		return -1;
+	}
+
+	size = info.st_size;
+	data = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(data == MAP_FAILED){ return -1; }
+
+	if(data[size - 1] == '\n'){ size--; }
+	if(size == 0){ munmap(data, info.st_size); return -1; }
+
+	key->id = keyId(data, data + size - (size < KEY_SAMPLE ? size : KEY_SAMPLE), size);
+	key->data = data;
+	key->size = size;
+	key->mapped = info.st_size;
+	return 0;
+}
+
+/*****************************
+ * Add key to the hash table, growing it to stay at most half full.
+ * If the id is already present the new mapping is dropped.
+ *****************************/
+static const struct otpKey* insertKey(struct otpKey* key){
+	struct otpKey* old = table;
+	size_t oldSize = tableSize;
+	size_t i;
+
+	if(2 * (numKeys + 1) > tableSize){
+		tableSize = oldSize == 0 ? MIN_TABLE : 2 * oldSize;
+		table = calloc(tableSize, sizeof(struct otpKey));
+		if(table == NULL){
+			table = old;
+			tableSize = oldSize;
+			return NULL;
+		}
+		numKeys = 0;
+		for(i = 0; i < oldSize; i++){
+			if(old[i].data != NULL){ insertKey(&old[i]); }
+		}
+		free(old);
+	}
+
+	for(i = key->id & (tableSize - 1); table[i].data != NULL; i = (i + 1) & (tableSize - 1)){
+		if(table[i].id == key->id){
+			if(table[i].data != key->data){ munmap((void*)key->data, key->mapped); }
+			return &table[i];
+		}
+	}
+
+	table[i] = *key;
+	numKeys++;
+	return &table[i];
+}
+
+/*****************************
+ * Put the path of key id's file in path, KEY_PATH_MAX long.
+ * Returns -1 if it doesn't fit.
+ *****************************/
+static int keyPath(char* path, unsigned long long id){
+	return snprintf(path, KEY_PATH_MAX, "%s/%016llx.key", keyDir, id) >= KEY_PATH_MAX ? -1 : 0;
+}
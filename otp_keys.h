@@ -0,0 +1,39 @@
+#ifndef OTP_KEYS_H
+#define OTP_KEYS_H
+
+#include <stddef.h>
+
+#define KEY_PATH_MAX 4096		// Longest key file path
+
+/*****************************
+ * A key held by the registry, mapped read-only from its file
+ *****************************/
+struct otpKey {
+	unsigned long long id;
+	const char* data;
+	size_t size;
+	size_t mapped;			// Length of the mapping, including any trailing newline
+};
+
+/*****************************
+ * A key being received from a client. It is written to a hidden temporary
+ * file in the key directory and only renamed into place once complete.
+ *****************************/
+struct keyUpload {
+	unsigned long long id;
+	size_t size;
+	size_t written;
+	int fd;					// -1 if the key is already registered and the upload is discarded
+	char path[KEY_PATH_MAX];
+};
+
+int keysOpen(const char*);
+int keysEnabled();
+const char* keysDirectory();
+const struct otpKey* keysFind(unsigned long long);
+int keysUploadBegin(struct keyUpload*, unsigned long long, size_t);
+int keysUploadWrite(struct keyUpload*, const char*, size_t);
+int keysUploadFinish(struct keyUpload*);
+void keysUploadAbort(struct keyUpload*);
+
+#endif
@@ -0,0 +1,449 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include "otp_loop.h"
+#include "otp_wheel.h"
+#include "otp_metrics.h"
+
+#define MAX_EVENTS 64		// Events handled per epoll_wait() call
+#define MAX_PUMPS 16		// recv()/send() calls per connection per wakeup, so one big client can't starve the rest
+
+enum loopKind {
+	LOOP_CLIENT,			// Request connection
+	LOOP_LISTENER,			// Listening socket for requests
+	LOOP_METRICS_LISTENER,	// Listening socket for metrics scrapes
+	LOOP_SCRAPE				// Metrics scrape connection
+};
+
+/*****************************
+ * One accepted connection and the epoll events it is registered for.
+ * Listening sockets and scrapes get one too, with only conn.fd set.
+ *****************************/
+struct loopConn {
+	struct otpConn conn;
+	unsigned int events;
+	enum loopKind kind;
+	int index;						// Listeners: position in the list, for the metrics
+	struct metricsReply* scrape;	// Scrapes: request and reply
+	struct wheelTimer timer;		// Clients and scrapes: its deadline
+	struct loopConn* nextBusy;		// Clients: next in busyClients
+	int busy;						// Clients: in busyClients
+};
+
+// Function prototypes
+static int addListener(int, int, enum loopKind, int);
+static void acceptClients(int, struct loopConn*, const struct otpService*);
+static void startClient(int, int, const struct otpService*);
+static void acceptScrapes(int, int);
+static void serviceClient(int, struct loopConn*);
+static void serviceScrape(int, struct loopConn*);
+static int pumpClient(struct loopConn*);
+static void closeClient(int, struct loopConn*);
+static void workClients(int);
+static void expireTimers(int);
+
+// Global vars
+static struct admitQueue waiting;		// Accepted clients waiting for a slot
+static int activeClients = 0;			// Clients being served
+static struct timerWheel wheel;			// Client deadlines
+static struct loopConn* busyClients = NULL;	// Clients with work for connWork()
+
+/*****************************
+ * Serve every connection from a single process. The numListeners listening
+ * sockets and all client sockets are non-blocking and sit in one epoll set;
+ * each client is a connection state machine that moves forward whenever its
+ * socket is ready. metricsFD, if not -1, is a listening socket for metrics
+ * scrapes. With policy->maxActive set, clients past it wait for admission
+ * without being read from. Every client's deadline (see connDeadline()) sits
+ * in a timer wheel, which epoll_wait()'s timeout keeps turning, so expiring
+ * stalled clients costs nothing per wakeup but a list walk for the ticks
+ * that passed. Clients busy with work of their own get a piece of it done
+ * per pass, and epoll_wait() doesn't block while there are any. Only returns
+ * if epoll itself fails.
+ *****************************/
+int runEventLoop(const int* listenSocketFDs, int numListeners, int metricsFD, const struct admitPolicy* policy, const struct otpService* svc){
+	struct epoll_event events[MAX_EVENTS];
+	struct loopConn* listener;
+	int epollFD, count, fd;
+
+	if(admitInit(&waiting, policy) != 0){ perror("ERROR allocating admission queue"); return -1; }
+	wheelInit(&wheel);
+	epollFD = epoll_create1(EPOLL_CLOEXEC);
+	if(epollFD < 0){ perror("ERROR creating epoll instance"); return -1; }
+
+	for(int i = 0; i < numListeners; i++){
+		if(addListener(epollFD, listenSocketFDs[i], LOOP_LISTENER, i) != 0){ close(epollFD); return -1; }
+	}
+	if(metricsFD >= 0 && addListener(epollFD, metricsFD, LOOP_METRICS_LISTENER, -1) != 0){ close(epollFD); return -1; }
+
+	while(1){
+		// Wake up in time to shed the oldest waiting client once it has waited too long,
+		// or to close the first client whose deadline passes
+		count = epoll_wait(epollFD, events, MAX_EVENTS, busyClients != NULL ? 0 : wheelTimeout(&wheel, admitTimeout(&waiting)));
+		if(count < 0){
+			if(errno == EINTR){ continue; }
+			perror("ERROR on epoll_wait");
+			break;
+		}
+
+		for(int i = 0; i < count; i++){
+			listener = events[i].data.ptr;
+			switch(listener->kind){
+				case LOOP_LISTENER:
+					acceptClients(epollFD, listener, svc);
+					break;
+				case LOOP_METRICS_LISTENER:
+					acceptScrapes(epollFD, listener->conn.fd);
+					break;
+				case LOOP_SCRAPE:
+					serviceScrape(epollFD, listener);
+					break;
+				default:
+					serviceClient(epollFD, listener);
+					break;
+			}
+		}
+
+		workClients(epollFD);
+		expireTimers(epollFD);
+
+		// Clients that closed made room for ones that have been waiting
+		while(activeClients < policy->maxActive && (fd = admitPop(&waiting)) >= 0){
+			startClient(epollFD, fd, svc);
+		}
+	}
+
+	close(epollFD);
+	return -1;
+}
+
+/*****************************
+ * Make fd non-blocking and add it to the epoll set as a listener of the given
+ * kind. Returns -1 on failure.
+ *****************************/
+static int addListener(int epollFD, int fd, enum loopKind kind, int index){
+	struct epoll_event ev;
+	struct loopConn* listener;
+
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+	listener = calloc(1, sizeof(*listener));
+	if(listener == NULL){ perror("ERROR allocating listener"); return -1; }
+	listener->conn.fd = fd;
+	listener->kind = kind;
+	listener->index = index;
+
+	// Workers share the UNIX socket and metrics listeners, so a new client only wakes one of them
+	memset(&ev, '\0', sizeof(ev));
+	ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+	ev.data.ptr = listener;
+	if(epoll_ctl(epollFD, EPOLL_CTL_ADD, fd, &ev) < 0){
+		perror("ERROR adding listening socket to epoll");
+		free(listener);
+		return -1;
+	}
+	return 0;
+}
+
+/*****************************
+ * Accept every pending connection and serve it, or queue it for admission
+ * if this worker already serves as many as it may
+ *****************************/
+static void acceptClients(int epollFD, struct loopConn* listener, const struct otpService* svc){
+	const struct admitPolicy* policy = waiting.policy;
+	int fd;
+
+	metricsSampleQueue(listener->index, listener->conn.fd);
+
+	while(1){
+		fd = accept4(listener->conn.fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if(fd < 0){
+			if(errno == EINTR || errno == ECONNABORTED){ continue; }
+			if(errno != EAGAIN && errno != EWOULDBLOCK){
+				METRIC_ADD(acceptErrors, 1);
+				perror("ERROR on accept");
+			}
+			return;
+		}
+
+		if(policy->maxActive > 0 && (activeClients >= policy->maxActive || waiting.count > 0)){
+			admitPush(&waiting, fd);
+			continue;
+		}
+		startClient(epollFD, fd, svc);
+	}
+}
+
+/*****************************
+ * Serve accepted connection fd: register it for reading
+ *****************************/
+static void startClient(int epollFD, int fd, const struct otpService* svc){
+	struct epoll_event ev;
+	struct loopConn* client;
+
+	client = malloc(sizeof(*client));
+	if(client == NULL){
+		fprintf(stderr, "SERVER ERROR: out of memory for new connection.\n");
+		METRIC_ADD(rejected, 1);
+		close(fd);
+		return;
+	}
+	connInit(&client->conn, fd, svc);
+	client->events = EPOLLIN;
+	client->kind = LOOP_CLIENT;
+	client->timer.prev = NULL;
+	client->busy = 0;
+	activeClients++;
+
+	memset(&ev, '\0', sizeof(ev));
+	ev.events = client->events;
+	ev.data.ptr = client;
+	if(epoll_ctl(epollFD, EPOLL_CTL_ADD, fd, &ev) < 0){
+		perror("ERROR adding connection to epoll");
+		METRIC_ADD(rejected, 1);
+		closeClient(-1, client);
+		return;
+	}
+	wheelSet(&wheel, &client->timer, connDeadline(&client->conn));
+}
+
+/*****************************
+ * Accept pending metrics scrapes. They are answered from this loop too, which
+ * is cheap: a scrape only reads the counters.
+ *****************************/
+static void acceptScrapes(int epollFD, int listenSocketFD){
+	struct epoll_event ev;
+	struct loopConn* client;
+	int fd;
+
+	while(1){
+		fd = accept4(listenSocketFD, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if(fd < 0){
+			if(errno == EINTR || errno == ECONNABORTED){ continue; }
+			return;		// Another worker took it, or there are no more
+		}
+
+		client = calloc(1, sizeof(*client));
+		if(client == NULL || (client->scrape = calloc(1, sizeof(struct metricsReply))) == NULL){
+			free(client);
+			close(fd);
+			continue;
+		}
+		client->conn.fd = fd;
+		client->events = EPOLLIN;
+		client->kind = LOOP_SCRAPE;
+
+		memset(&ev, '\0', sizeof(ev));
+		ev.events = client->events;
+		ev.data.ptr = client;
+		if(epoll_ctl(epollFD, EPOLL_CTL_ADD, fd, &ev) < 0){
+			closeClient(-1, client);
+			continue;
+		}
+		wheelSet(&wheel, &client->timer, connScrapeDeadline());
+	}
+}
+
+/*****************************
+ * Read a scrape request until it is complete or the client stops sending,
+ * then send the page and close. A request that hasn't said GET gets the
+ * bare text without an HTTP header.
+ *****************************/
+static void serviceScrape(int epollFD, struct loopConn* client){
+	struct metricsReply* scrape = client->scrape;
+	struct epoll_event ev;
+	ssize_t n;
+
+	if(scrape->reply == NULL){
+		n = recv(client->conn.fd, scrape->request + scrape->have, sizeof(scrape->request) - scrape->have, 0);
+		if(n < 0){
+			if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR){ closeClient(epollFD, client); }
+			return;
+		}
+		if(n > 0 && !metricsReceived(scrape, n)){ return; }
+
+		scrape->reply = malloc(METRICS_REPLY_MAX);
+		if(scrape->reply == NULL){ closeClient(epollFD, client); return; }
+		scrape->len = metricsRender(scrape->reply, METRICS_REPLY_MAX, strncmp(scrape->request, "GET", 3) == 0);
+	}
+
+	while(scrape->sent < scrape->len){
+		n = send(client->conn.fd, scrape->reply + scrape->sent, scrape->len - scrape->sent, MSG_NOSIGNAL);
+		if(n < 0){
+			if(errno == EINTR){ continue; }
+			if(errno != EAGAIN && errno != EWOULDBLOCK){ break; }
+
+			// Socket full: wait until it drains
+			if(client->events != EPOLLOUT){
+				memset(&ev, '\0', sizeof(ev));
+				ev.events = EPOLLOUT;
+				ev.data.ptr = client;
+				epoll_ctl(epollFD, EPOLL_CTL_MOD, client->conn.fd, &ev);
+				client->events = EPOLLOUT;
+			}
+			return;
+		}
+		scrape->sent += n;
+	}
+	closeClient(epollFD, client);
+}
+
+/*****************************
+ * Move a ready client forward, then either retire it or update what
+ * epoll should wake us up for next.
+ *****************************/
+static void serviceClient(int epollFD, struct loopConn* client){
+	struct epoll_event ev;
+	char* inBuf;
+	const char* outBuf;
+	size_t len;
+	unsigned int want = 0;
+
+	if(pumpClient(client) != 0 || connFinished(&client->conn)){
+		closeClient(epollFD, client);
+		return;
+	}
+	wheelSet(&wheel, &client->timer, connDeadline(&client->conn));
+
+	if(connReadBuffer(&client->conn, &inBuf, &len)){ want |= EPOLLIN; }
+	if(connWriteBuffer(&client->conn, &outBuf, &len)){ want |= EPOLLOUT; }
+
+	if(want != client->events){
+		memset(&ev, '\0', sizeof(ev));
+		ev.events = want;
+		ev.data.ptr = client;
+		if(epoll_ctl(epollFD, EPOLL_CTL_MOD, client->conn.fd, &ev) < 0){
+			perror("ERROR updating connection in epoll");
+			closeClient(epollFD, client);
+			return;
+		}
+		client->events = want;
+	}
+
+	if(connBusy(&client->conn) && !client->busy){
+		client->nextBusy = busyClients;
+		busyClients = client;
+		client->busy = 1;
+	}
+}
+
+/*****************************
+ * Send and receive until the socket would block. Zero-copy notifications
+ * are reaped on the way; epoll reports them as EPOLLERR whatever the client
+ * is registered for. Returns -1 if the connection broke or the client went
+ * away in the middle of a request.
+ *****************************/
+static int pumpClient(struct loopConn* client){
+	struct otpConn* conn = &client->conn;
+	const char* outBuf;
+	char* inBuf;
+	size_t len;
+	ssize_t n;
+	unsigned int pending;
+	int progress = 1;
+
+	for(int i = 0; progress && i < MAX_PUMPS && !connFinished(conn); i++){
+		progress = 0;
+
+		if(conn->zcPending > 0){
+			pending = conn->zcPending;
+			if(connReapZeroCopy(conn) != 0){ return -1; }
+			progress = conn->zcPending < pending;
+		}
+
+		if(connWriteBuffer(conn, &outBuf, &len)){
+			n = connSend(conn, outBuf, len, MSG_NOSIGNAL);
+			if(n > 0){
+				connSent(conn, n);
+				progress = 1;
+			}
+			else if(n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR){
+				return -1;
+			}
+		}
+
+		if(connReadBuffer(conn, &inBuf, &len)){
+			n = connRecv(conn, inBuf, len, 0);
+			if(n > 0){
+				connReceived(conn, n);
+				progress = 1;
+			}
+			else if(n == 0){
+				// A client hanging up between requests is a normal goodbye,
+				// once whatever reply is still pending has gone out
+				if(connEndOfInput(conn) != 0){
+					fprintf(stderr, "SERVER ERROR: client closed the connection in the middle of a request.\n");
+					return -1;
+				}
+				progress = 1;
+			}
+			else if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR){
+				return -1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+/*****************************
+ * Retire a client or scrape. epollFD is -1 if it never made it into the epoll set.
+ *****************************/
+static void closeClient(int epollFD, struct loopConn* client){
+	struct loopConn** link;
+
+	if(epollFD >= 0){ epoll_ctl(epollFD, EPOLL_CTL_DEL, client->conn.fd, NULL); }
+	close(client->conn.fd);
+	wheelClear(&wheel, &client->timer);
+	if(client->kind == LOOP_SCRAPE){
+		free(client->scrape->reply);
+		free(client->scrape);
+	}
+	else{
+		if(client->busy){
+			for(link = &busyClients; *link != client; link = &(*link)->nextBusy);
+			*link = client->nextBusy;
+		}
+		connFree(&client->conn);
+		activeClients--;
+	}
+	free(client);
+}
+
+/*****************************
+ * Do a piece of every busy client's work, then serve it as if its socket
+ * were ready, which queues its reply once the work is done
+ *****************************/
+static void workClients(int epollFD){
+	struct loopConn* client = busyClients;
+	struct loopConn* next;
+
+	busyClients = NULL;
+	for(; client != NULL; client = next){
+		next = client->nextBusy;
+		client->busy = 0;
+		connWork(&client->conn);
+		serviceClient(epollFD, client);
+	}
+}
+
+/*****************************
+ * Close every client and scrape whose deadline has passed
+ *****************************/
+static void expireTimers(int epollFD){
+	struct wheelTimer* timer;
+	struct loopConn* client;
+
+	while((timer = wheelExpired(&wheel)) != NULL){
+		client = WHEEL_OWNER(timer, struct loopConn, timer);
+		if(client->kind == LOOP_CLIENT){ connExpire(&client->conn); }
+		closeClient(epollFD, client);
+	}
+}
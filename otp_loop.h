@@ -0,0 +1,9 @@
+#ifndef OTP_LOOP_H
+#define OTP_LOOP_H
+
+#include "otp_conn.h"
+#include "otp_admit.h"
+
+int runEventLoop(const int*, int, int, const struct admitPolicy*, const struct otpService*);
+
+#endif
@@ -0,0 +1,315 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "otp_metrics.h"
+
+#define HEAD_ROOM 160		// Bytes kept free in front of a rendered body for the HTTP header
+
+// Function prototypes
+static size_t appendf(char*, size_t, size_t, const char*, ...) __attribute__((format(printf, 4, 5)));
+static size_t renderBody(char*, size_t);
+static size_t renderHistogram(char*, size_t, size_t, const char*, const struct workerMetrics*, int);
+
+// Global vars
+static struct workerMetrics localSlot;		// Used until metricsInit() sets up the shared slots
+struct workerMetrics* metrics = &localSlot;
+static struct workerMetrics* slots = &localSlot;
+static int numSlots = 1;
+const char* const metricsOutcomeNames[NUM_OUTCOMES] = { "ok", "error", "bad_char", "unknown_key", "aborted", "timeout" };
+static const char* phaseNames[NUM_PHASES] = { "header", "transform", "request", "queue" };
+
+/*****************************
+ * Set up count counter slots in memory shared with every process forked
+ * from here, one per worker, and count into the first.
+ * Returns -1 if the memory can't be mapped.
+ *****************************/
+int metricsInit(int count){
+	void* shared = mmap(NULL, count * sizeof(struct workerMetrics), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+	if(shared == MAP_FAILED){ return -1; }
+	slots = shared;
+	numSlots = count;
+	metrics = &slots[0];
+	return 0;
+}
+
+/*****************************
+ * Count into slot index from now on. Called by each worker as it starts.
+ *****************************/
+void metricsUseSlot(int index){
+	if(index >= 0 && index < numSlots){ metrics = &slots[index]; }
+}
+
+/*****************************
+ * Worker index died and took its connections with it. Called by the parent
+ * before a replacement starts counting into the same slot.
+ *****************************/
+void metricsWorkerExited(int index){
+	struct workerMetrics* slot;
+
+	if(index < 0 || index >= numSlots){ return; }
+	slot = &slots[index];
+	__atomic_store_n(&slot->closed, __atomic_load_n(&slot->accepted, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+	memset(slot->queued, 0, sizeof(slot->queued));
+	__atomic_store_n(&slot->waiting, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&slot->poolIdleBytes, 0, __ATOMIC_RELAXED);
+}
+
+unsigned long long metricsNow(){
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*****************************
+ * Add ns to the histogram of phase. Bucket i holds durations up to 2^i us.
+ *****************************/
+void metricsObserve(enum metricsPhase phase, unsigned long long ns){
+	unsigned long long us = (ns + 999) / 1000;
+	int bucket = us <= 1 ? 0 : 64 - __builtin_clzll(us - 1);
+
+	if(bucket > METRICS_BUCKETS - 1){ bucket = METRICS_BUCKETS - 1; }
+	METRIC_ADD(phaseCount[phase][bucket], 1);
+	METRIC_ADD(phaseSum[phase], ns);
+}
+
+/*****************************
+ * Record how many connections are waiting in the accept queue of listening
+ * socket number index, fd. Only TCP sockets report it.
+ *****************************/
+void metricsSampleQueue(int index, int fd){
+	struct tcp_info info;
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(info);
+
+	if(index < 0 || index >= METRICS_LISTENERS){ return; }
+	if(getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len) != 0){ return; }
+
+	if(metrics->queuePort[index] == 0){
+		len = sizeof(addr);
+		if(getsockname(fd, (struct sockaddr*)&addr, &len) != 0 || addr.sin_family != AF_INET){ return; }
+		metrics->queuePort[index] = ntohs(addr.sin_port);
+	}
+	__atomic_store_n(&metrics->queued[index], info.tcpi_unacked, __ATOMIC_RELAXED);		// For a listener: connections not yet accepted
+}
+
+/*****************************
+ * Sum every slot into total
+ *****************************/
+void metricsTotals(struct workerMetrics* total){
+	const unsigned long long* from;
+	unsigned long long* to = (unsigned long long*)total;
+	size_t words = sizeof(*total) / sizeof(unsigned long long);
+
+	memset(total, 0, sizeof(*total));
+	for(int s = 0; s < numSlots; s++){
+		from = (const unsigned long long*)&slots[s];
+		for(size_t w = 0; w < words; w++){
+			to[w] += __atomic_load_n(&from[w], __ATOMIC_RELAXED);
+		}
+	}
+}
+
+/*****************************
+ * Account for n more bytes of a scrape request read into reply->request.
+ * Returns 1 once the request is complete: an HTTP header ends with a blank
+ * line, any other request with its first newline, and anything that fills
+ * the buffer is as much as will be read.
+ *****************************/
+int metricsReceived(struct metricsReply* reply, size_t n){
+	reply->have += n;
+	if(reply->have == sizeof(reply->request)){ return 1; }
+	if(reply->have >= 3 && strncmp(reply->request, "GET", 3) == 0){
+		return memmem(reply->request, reply->have, "\r\n\r\n", 4) != NULL
+			|| memmem(reply->request, reply->have, "\n\n", 2) != NULL;
+	}
+	return memchr(reply->request, '\n', reply->have) != NULL;
+}
+
+/*****************************
+ * Render the counters of every worker into buf, as an HTTP response when
+ * http is 1 and as the bare text page otherwise (e.g. for nc).
+ * Returns the length.
+ *****************************/
+size_t metricsRender(char* buf, size_t cap, int http){
+	char head[HEAD_ROOM];
+	size_t len, headLen;
+
+	if(cap <= HEAD_ROOM){ return 0; }
+	if(!http){ return renderBody(buf, cap); }
+
+	len = renderBody(buf + HEAD_ROOM, cap - HEAD_ROOM);
+	headLen = snprintf(head, sizeof(head), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+		"Content-Length: %zu\r\nConnection: close\r\n\r\n", len);
+	memcpy(buf, head, headLen);
+	memmove(buf + headLen, buf + HEAD_ROOM, len);
+	return headLen + len;
+}
+
+/*****************************
+ * Answer one scrape on a blocking socket: read the request, then send the
+ * page, giving up on a client that stalls either for a couple of seconds.
+ * Returns -1 if the send failed.
+ *****************************/
+int serveMetrics(int fd){
+	struct metricsReply reply;
+	struct timeval timeout = { 2, 0 };
+	ssize_t n;
+	size_t len;
+
+	memset(&reply, '\0', sizeof(reply));
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+	while(1){
+		n = recv(fd, reply.request + reply.have, sizeof(reply.request) - reply.have, 0);
+		if(n < 0 && errno == EINTR){ continue; }
+		if(n <= 0 || metricsReceived(&reply, n)){ break; }
+	}
+
+	reply.reply = malloc(METRICS_REPLY_MAX);
+	if(reply.reply == NULL){ return -1; }
+	len = metricsRender(reply.reply, METRICS_REPLY_MAX, strncmp(reply.request, "GET", 3) == 0);
+	for(size_t sent = 0; sent < len; sent += n){
+		n = send(fd, reply.reply + sent, len - sent, MSG_NOSIGNAL);
+		if(n < 0 && errno == EINTR){ n = 0; continue; }
+		if(n < 0){ free(reply.reply); return -1; }
+	}
+	free(reply.reply);
+	return 0;
+}
+
+/*****************************
+ * snprintf() at buf + len, never past cap. Returns the new length.
+ *****************************/
+static size_t appendf(char* buf, size_t cap, size_t len, const char* format, ...){
+	va_list args;
+	int n;
+
+	if(len >= cap){ return len; }
+	va_start(args, format);
+	n = vsnprintf(buf + len, cap - len, format, args);
+	va_end(args);
+	if(n < 0){ return len; }
+	return len + n < cap ? len + n : cap - 1;
+}
+
+/*****************************
+ * The text exposition format: totals first, then what each worker has done,
+ * so an uneven spread shows up
+ *****************************/
+static size_t renderBody(char* buf, size_t cap){
+	struct workerMetrics total;
+	unsigned long long ports[METRICS_LISTENERS], waiting[METRICS_LISTENERS];
+	int numPorts = 0, p;
+	size_t len = 0;
+
+	metricsTotals(&total);
+
+	len = appendf(buf, cap, len, "# HELP otp_requests_total Requests finished, by outcome.\n# TYPE otp_requests_total counter\n");
+	for(int i = 0; i < NUM_OUTCOMES; i++){
+		len = appendf(buf, cap, len, "otp_requests_total{outcome=\"%s\"} %llu\n", metricsOutcomeNames[i], total.requests[i]);
+	}
+	len = appendf(buf, cap, len, "# HELP otp_received_bytes_total Bytes read from client sockets.\n# TYPE otp_received_bytes_total counter\n"
+		"otp_received_bytes_total %llu\n", total.bytesIn);
+	len = appendf(buf, cap, len, "# HELP otp_sent_bytes_total Bytes written to client sockets.\n# TYPE otp_sent_bytes_total counter\n"
+		"otp_sent_bytes_total %llu\n", total.bytesOut);
+	len = appendf(buf, cap, len, "# HELP otp_transformed_chars_total Characters encrypted or decrypted.\n# TYPE otp_transformed_chars_total counter\n"
+		"otp_transformed_chars_total %llu\n", total.transformed);
+	len = appendf(buf, cap, len, "# HELP otp_connections_accepted_total Connections accepted.\n# TYPE otp_connections_accepted_total counter\n"
+		"otp_connections_accepted_total %llu\n", total.accepted);
+	len = appendf(buf, cap, len, "# HELP otp_connections_active Connections open now.\n# TYPE otp_connections_active gauge\n"
+		"otp_connections_active %llu\n", total.accepted - total.closed);
+	len = appendf(buf, cap, len, "# HELP otp_connections_rejected_total Connections closed as soon as they were accepted.\n# TYPE otp_connections_rejected_total counter\n"
+		"otp_connections_rejected_total %llu\n", total.rejected);
+	len = appendf(buf, cap, len, "# HELP otp_accept_errors_total Failed accept() calls, e.g. out of file descriptors.\n# TYPE otp_accept_errors_total counter\n"
+		"otp_accept_errors_total %llu\n", total.acceptErrors);
+	len = appendf(buf, cap, len, "# HELP otp_connections_shed_total Connections answered busy instead of served.\n# TYPE otp_connections_shed_total counter\n"
+		"otp_connections_shed_total %llu\n", total.shed);
+	len = appendf(buf, cap, len, "# HELP otp_connections_expired_total Connections closed because the client took too long.\n# TYPE otp_connections_expired_total counter\n"
+		"otp_connections_expired_total %llu\n", total.expired);
+	len = appendf(buf, cap, len, "# HELP otp_connections_waiting Connections accepted and waiting for admission.\n# TYPE otp_connections_waiting gauge\n"
+		"otp_connections_waiting %llu\n", total.waiting);
+	len = appendf(buf, cap, len, "# HELP otp_pool_hits_total Buffers reused from the buffer pool.\n# TYPE otp_pool_hits_total counter\n"
+		"otp_pool_hits_total %llu\n", total.poolHits);
+	len = appendf(buf, cap, len, "# HELP otp_pool_misses_total Buffers the buffer pool had to map.\n# TYPE otp_pool_misses_total counter\n"
+		"otp_pool_misses_total %llu\n", total.poolMisses);
+	len = appendf(buf, cap, len, "# HELP otp_pool_idle_bytes Memory the buffer pool holds for reuse.\n# TYPE otp_pool_idle_bytes gauge\n"
+		"otp_pool_idle_bytes %llu\n", total.poolIdleBytes);
+	len = appendf(buf, cap, len, "# HELP otp_zerocopy_sends_total Replies sent zero-copy.\n# TYPE otp_zerocopy_sends_total counter\n"
+		"otp_zerocopy_sends_total %llu\n", total.zeroCopySends);
+	len = appendf(buf, cap, len, "# HELP otp_zerocopy_copied_total Zero-copy sends the kernel copied after all.\n# TYPE otp_zerocopy_copied_total counter\n"
+		"otp_zerocopy_copied_total %llu\n", total.zeroCopyCopied);
+	len = appendf(buf, cap, len, "# HELP otp_pad_slices_total Key slices allocated to encrypt requests.\n# TYPE otp_pad_slices_total counter\n"
+		"otp_pad_slices_total %llu\n", total.padSlices);
+	len = appendf(buf, cap, len, "# HELP otp_pad_log_syncs_total Times the pad slice log was flushed to disk.\n# TYPE otp_pad_log_syncs_total counter\n"
+		"otp_pad_log_syncs_total %llu\n", total.padSyncs);
+	len = appendf(buf, cap, len, "# HELP otp_pad_failures_total Key slices that could not be reserved or logged.\n# TYPE otp_pad_failures_total counter\n"
+		"otp_pad_failures_total %llu\n", total.padFailures);
+
+	// Accept queues are per worker with SO_REUSEPORT, add them up by port
+	for(int s = 0; s < numSlots; s++){
+		for(int i = 0; i < METRICS_LISTENERS; i++){
+			if(slots[s].queuePort[i] == 0){ continue; }
+			for(p = 0; p < numPorts && ports[p] != slots[s].queuePort[i]; p++);
+			if(p == numPorts){
+				if(numPorts == METRICS_LISTENERS){ continue; }
+				ports[numPorts] = slots[s].queuePort[i];
+				waiting[numPorts++] = 0;
+			}
+			waiting[p] += __atomic_load_n(&slots[s].queued[i], __ATOMIC_RELAXED);
+		}
+	}
+	len = appendf(buf, cap, len, "# HELP otp_connections_queued Connections waiting to be accepted, as of each worker's last accept.\n# TYPE otp_connections_queued gauge\n");
+	for(p = 0; p < numPorts; p++){
+		len = appendf(buf, cap, len, "otp_connections_queued{port=\"%llu\"} %llu\n", ports[p], waiting[p]);
+	}
+
+	len = appendf(buf, cap, len, "# HELP otp_phase_seconds Time spent in each phase of a request.\n# TYPE otp_phase_seconds histogram\n");
+	for(int phase = 0; phase < NUM_PHASES; phase++){
+		len = renderHistogram(buf, cap, len, phaseNames[phase], &total, phase);
+	}
+
+	len = appendf(buf, cap, len, "# HELP otp_workers Worker slots.\n# TYPE otp_workers gauge\notp_workers %d\n", numSlots);
+	len = appendf(buf, cap, len, "# HELP otp_worker_requests_total Requests finished by each worker.\n# TYPE otp_worker_requests_total counter\n");
+	for(int s = 0; s < numSlots; s++){
+		unsigned long long done = 0;
+
+		for(int i = 0; i < NUM_OUTCOMES; i++){ done += __atomic_load_n(&slots[s].requests[i], __ATOMIC_RELAXED); }
+		len = appendf(buf, cap, len, "otp_worker_requests_total{worker=\"%d\"} %llu\n", s, done);
+	}
+	len = appendf(buf, cap, len, "# HELP otp_worker_connections_active Connections each worker has open.\n# TYPE otp_worker_connections_active gauge\n");
+	for(int s = 0; s < numSlots; s++){
+		len = appendf(buf, cap, len, "otp_worker_connections_active{worker=\"%d\"} %llu\n", s,
+			__atomic_load_n(&slots[s].accepted, __ATOMIC_RELAXED) - __atomic_load_n(&slots[s].closed, __ATOMIC_RELAXED));
+	}
+	return len;
+}
+
+static size_t renderHistogram(char* buf, size_t cap, size_t len, const char* name, const struct workerMetrics* total, int phase){
+	unsigned long long count = 0;
+
+	for(int i = 0; i < METRICS_BUCKETS; i++){
+		count += total->phaseCount[phase][i];
+		if(i == METRICS_BUCKETS - 1){
+			len = appendf(buf, cap, len, "otp_phase_seconds_bucket{phase=\"%s\",le=\"+Inf\"} %llu\n", name, count);
+		}
+		else{
+			len = appendf(buf, cap, len, "otp_phase_seconds_bucket{phase=\"%s\",le=\"%g\"} %llu\n", name, (1ULL << i) / 1e6, count);
+		}
+	}
+	len = appendf(buf, cap, len, "otp_phase_seconds_sum{phase=\"%s\"} %.9f\n", name, total->phaseSum[phase] / 1e9);
+	len = appendf(buf, cap, len, "otp_phase_seconds_count{phase=\"%s\"} %llu\n", name, count);
+	return len;
+}
@@ -0,0 +1,89 @@
+#ifndef OTP_METRICS_H
+#define OTP_METRICS_H
+
+#include <stddef.h>
+
+#define METRICS_BUCKETS 26			// Latency buckets: 1 us doubling up to 2^24 us, then +Inf
+#define METRICS_LISTENERS 16		// Listening sockets whose accept queue is tracked
+#define METRICS_REQUEST_MAX 2048	// Largest scrape request read before answering
+#define METRICS_REPLY_MAX 65536		// Room for a whole scrape reply
+
+enum metricsOutcome {
+	OUTCOME_OK,				// Reply sent in full
+	OUTCOME_ERROR,			// Rejected: malformed, wrong daemon, out of memory...
+	OUTCOME_BAD_CHAR,		// Text or key held a character outside the alphabet
+	OUTCOME_UNKNOWN_KEY,	// Key reference to a key the registry doesn't hold
+	OUTCOME_ABORTED,		// Client went away in the middle of the request
+	OUTCOME_TIMEOUT,		// Client took too long, see struct connLimits
+	NUM_OUTCOMES
+};
+
+enum metricsPhase {
+	PHASE_HEADER,			// First header byte to header parsed
+	PHASE_TRANSFORM,		// One chunk through the transform kernel
+	PHASE_REQUEST,			// Header parsed to the last of the reply queued
+	PHASE_QUEUE,			// Accepted to served, for connections that waited for admission
+	NUM_PHASES
+};
+
+/*****************************
+ * One process's counters. Every worker writes only its own slot, and each slot
+ * has its cache lines to itself, so counting never contends with another
+ * worker. Fork mode children all share slot 0, which is why updates are
+ * atomic adds rather than plain increments. Nothing ever takes a lock.
+ *****************************/
+struct workerMetrics {
+	unsigned long long requests[NUM_OUTCOMES];
+	unsigned long long bytesIn;				// Socket bytes received, headers and records included
+	unsigned long long bytesOut;
+	unsigned long long transformed;			// Characters through the transform
+	unsigned long long accepted;			// Connections
+	unsigned long long closed;
+	unsigned long long rejected;			// Connections dropped as soon as they were accepted
+	unsigned long long acceptErrors;		// accept() failures, e.g. out of file descriptors
+	unsigned long long shed;				// Connections answered busy instead of served
+	unsigned long long expired;				// Connections closed because a deadline passed
+	unsigned long long waiting;				// Connections in the admission queue now
+	unsigned long long poolHits;			// Buffers reused from the pool
+	unsigned long long poolMisses;			// Buffers the pool had to map
+	unsigned long long poolIdleBytes;		// Held by the pool for reuse now
+	unsigned long long zeroCopySends;		// Replies sent zero-copy
+	unsigned long long zeroCopyCopied;		// Of those, ones the kernel copied after all
+	unsigned long long padSlices;			// Key slices handed out, see otp_pads.c
+	unsigned long long padSyncs;			// Pad log fsyncs
+	unsigned long long padFailures;			// Key slices that couldn't be reserved or logged
+	unsigned long long queued[METRICS_LISTENERS];		// Accept queue length at the last wakeup
+	unsigned long long queuePort[METRICS_LISTENERS];	// Port of each tracked listener, 0 if unused
+	unsigned long long phaseCount[NUM_PHASES][METRICS_BUCKETS];
+	unsigned long long phaseSum[NUM_PHASES];			// ns
+} __attribute__((aligned(64)));
+
+/*****************************
+ * A scrape in progress on a non-blocking socket: the request being read,
+ * then the reply being sent
+ *****************************/
+struct metricsReply {
+	char request[METRICS_REQUEST_MAX];
+	size_t have;
+	char* reply;
+	size_t len;
+	size_t sent;
+};
+
+extern struct workerMetrics* metrics;		// This process's slot
+extern const char* const metricsOutcomeNames[NUM_OUTCOMES];
+
+#define METRIC_ADD(field, n) __atomic_fetch_add(&metrics->field, (n), __ATOMIC_RELAXED)
+
+int metricsInit(int);
+void metricsUseSlot(int);
+void metricsWorkerExited(int);
+unsigned long long metricsNow();
+void metricsObserve(enum metricsPhase, unsigned long long);
+void metricsSampleQueue(int, int);
+void metricsTotals(struct workerMetrics*);
+size_t metricsRender(char*, size_t, int);
+int metricsReceived(struct metricsReply*, size_t);
+int serveMetrics(int);
+
+#endif
@@ -0,0 +1,544 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <stdint.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "otp_cipher.h"
+#include "otp_keygen.h"
+#include "otp_proto.h"
+
+/* argv[0] = otp_microbench
+ * options: -s smallest size, -S largest size (bytes, k, m or g suffix; sizes go up
+ *          by 16 times from the smallest and end at the largest), -r trials per
+ *          measurement, the best counts, -t milliseconds each trial should at
+ *          least take, -f only runs cases whose name contains the given text,
+ *          -j prints JSON instead of text
+ *
+ * Times the transform kernels, character validation, header parsing and keygen
+ * character generation in isolation. Every kernel variant compiled in runs side by
+ * side with "current", the one the daemons and keygen pick on this CPU, and is
+ * reported relative to it. Hardware counters come from perf_event_open when the
+ * kernel allows it.
+ */
+
+#define TRIALS 5
+#define TRIAL_MS 20
+#define NUM_COUNTERS 4
+#define CHECK_SIZE 100003			// Odd size the kernels are checked against the scalar code at
+
+/*****************************
+ * One thing to time. run() does iters repetitions on size bytes and returns
+ * something derived from the result, so the work can't be optimized away.
+ *****************************/
+struct benchCase {
+	const char* group;			// "encrypt", "decrypt", "validate", "keygen" or "header"
+	char name[48];				// Variant
+	long long (*run)(const struct benchCase*, size_t, long long);
+	transformFn transform;
+	refillFn refill;
+	mapFn map;
+	int (*parse)(void);
+	size_t fixedSize;			// Headers: bytes parsed per call, sizes don't apply
+	int current;				// 1 for the variant in use on this CPU
+};
+
+/*****************************
+ * What one measurement found: the best trial's time, and its counters per byte
+ *****************************/
+struct measurement {
+	double nsPerByte;
+	double nsPerOp;
+	double counts[NUM_COUNTERS];	// Per byte, or -1 if not available
+};
+
+// Function prototypes
+static size_t parseBytes(const char*);
+static void fillRandom(char*, size_t);
+static unsigned long long nowNs();
+static void openCounters();
+static void startCounters();
+static void stopCounters(double*);
+static void measure(const struct benchCase*, size_t, struct measurement*);
+static int checkKernels();
+static int addCase(const char*, const char*, int);
+static void report(const struct benchCase*, size_t, const struct measurement*, double);
+static long long runTransform(const struct benchCase*, size_t, long long);
+static long long runValidate(const struct benchCase*, size_t, long long);
+static long long runKeygen(const struct benchCase*, size_t, long long);
+static long long runHeader(const struct benchCase*, size_t, long long);
+static int parseAsciiHeader();
+static int parseBinaryHeader();
+static int parseAsciiRecord();
+static int parseBinaryRecord();
+
+// Global vars
+static char* textBuf;
+static char* keyBuf;
+static char* outBuf;				// Transform output, also where keygen characters go
+static size_t outCap;
+static unsigned char charTable[256];
+static char asciiHeader[HEADER_SIZE];
+static char binaryHeader[BIN_HEADER_SIZE];
+static char asciiRecord[RECORD_SIZE];
+static char binaryRecord[BIN_RECORD_SIZE];
+static struct benchCase cases[64];
+static int numCases = 0;
+static const char* filter = NULL;
+static int trials = TRIALS;
+static unsigned long long trialNs = TRIAL_MS * 1000000ULL;
+static int json = 0;
+static int firstJSON = 1;
+static unsigned long long rngState = 0x9E3779B97F4A7C15ULL;
+static int counterFDs[NUM_COUNTERS] = { -1, -1, -1, -1 };
+static int counterSlot[NUM_COUNTERS];	// Position in the group read, -1 if the event didn't open
+static int numOpen = 0;
+static const char* counterNames[NUM_COUNTERS] = { "cycles", "instructions", "branch-misses", "cache-misses" };
+static const unsigned long long counterEvents[NUM_COUNTERS] = {
+	PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_BRANCH_MISSES, PERF_COUNT_HW_CACHE_MISSES
+};
+static const char* counterError = NULL;
+
+int main(int argc, char** argv){
+	size_t minSize = 16, maxSize = (size_t)1 << 30, size;
+	const struct cipherImpl* impls;
+	const struct refillImpl* refills;
+	const struct mapImpl* maps;
+	refillFn currentRefill = NULL;
+	mapFn currentMap = NULL;
+	struct measurement results[64];
+	struct binHeader fields;
+	int numImpls, numRefills, numMaps, opt, index;
+	const char* groups[] = { "encrypt", "decrypt", "validate", "keygen" };
+
+	while((opt = getopt(argc, argv, "s:S:r:t:f:j")) != -1){
+		switch(opt){
+			case 's': minSize = parseBytes(optarg); break;
+			case 'S': maxSize = parseBytes(optarg); break;
+			case 'r': trials = atoi(optarg); break;
+			case 't': trialNs = strtoull(optarg, NULL, 10) * 1000000ULL; break;
+			case 'f': filter = optarg; break;
+			case 'j': json = 1; break;
+			default:
+				fprintf(stderr, "USAGE: %s [-s minsize] [-S maxsize] [-r trials] [-t ms] [-f filter] [-j]\n", argv[0]);
+				return 1;
+		}
+	}
+	if(minSize < 1 || maxSize < minSize || maxSize > INT32_MAX || trials < 1){
+		fprintf(stderr, "ERROR: sizes are 1 to 2g with -s <= -S, and -r is at least 1\n");
+		return 1;
+	}
+
+	// Inputs are random characters from the alphabet, so every kernel takes its fast path
+	outCap = maxSize + RNG_BYTES + MAP_SLACK;
+	textBuf = malloc(maxSize);
+	keyBuf = malloc(maxSize);
+	outBuf = malloc(outCap);
+	if(textBuf == NULL || keyBuf == NULL || outBuf == NULL){ fprintf(stderr, "ERROR: out of memory\n"); return 1; }
+	fillRandom(textBuf, maxSize);
+	fillRandom(keyBuf, maxSize);
+	memset(outBuf, 0, outCap);
+	buildCharTable(charTable);
+
+	memset(&fields, '\0', sizeof(fields));
+	fields.op = BIN_OP_ENCRYPT;
+	fields.textSize = 123456789;
+	fields.keySize = 123456789;
+	formatBinHeader(binaryHeader, &fields);
+	formatHeader(asciiHeader, ORIGIN_ENC_STREAM, 123456789, 123456789);
+	formatRecord(asciiRecord, RECORD_DATA, CHUNK_SIZE);
+	formatBinRecord(binaryRecord, RECORD_DATA, CHUNK_SIZE);
+
+	if(checkKernels() != 0){ return 1; }
+
+	// Current implementations first, then every variant this CPU can run
+	impls = cipherImpls(&numImpls);
+	refills = refillImpls(&numRefills);
+	maps = mapImpls(&numMaps);
+	keygenKernels(&currentRefill, &currentMap);
+
+	if((index = addCase("encrypt", "current", 1)) >= 0){ cases[index].run = runTransform; cases[index].transform = encryptText; }
+	if((index = addCase("decrypt", "current", 1)) >= 0){ cases[index].run = runTransform; cases[index].transform = decryptText; }
+	for(int i = 0; i < numImpls; i++){
+		if(!impls[i].supported()){ continue; }
+		if((index = addCase("encrypt", impls[i].name, 0)) >= 0){ cases[index].run = runTransform; cases[index].transform = impls[i].encrypt; }
+		if((index = addCase("decrypt", impls[i].name, 0)) >= 0){ cases[index].run = runTransform; cases[index].transform = impls[i].decrypt; }
+	}
+	if((index = addCase("validate", "current", 1)) >= 0){ cases[index].run = runValidate; cases[index].transform = encryptText; }
+	if((index = addCase("validate", "scalar-precheck", 0)) >= 0){ cases[index].run = runValidate; }
+
+	if((index = addCase("keygen", "current", 1)) >= 0){
+		cases[index].run = runKeygen;
+		cases[index].refill = currentRefill;
+		cases[index].map = currentMap;
+	}
+	for(int r = 0; r < numRefills; r++){
+		for(int m = 0; m < numMaps; m++){
+			char name[48];
+
+			if(!refills[r].supported() || !maps[m].supported()){ continue; }
+			snprintf(name, sizeof(name), "%s+%s", refills[r].name, maps[m].name);
+			if((index = addCase("keygen", name, 0)) < 0){ continue; }
+			cases[index].run = runKeygen;
+			cases[index].refill = refills[r].refill;
+			cases[index].map = maps[m].map;
+		}
+	}
+
+	if((index = addCase("header", "ascii", 0)) >= 0){ cases[index].run = runHeader; cases[index].parse = parseAsciiHeader; cases[index].fixedSize = HEADER_SIZE; }
+	if((index = addCase("header", "binary", 0)) >= 0){ cases[index].run = runHeader; cases[index].parse = parseBinaryHeader; cases[index].fixedSize = BIN_HEADER_SIZE; }
+	if((index = addCase("header", "ascii-record", 0)) >= 0){ cases[index].run = runHeader; cases[index].parse = parseAsciiRecord; cases[index].fixedSize = RECORD_SIZE; }
+	if((index = addCase("header", "binary-record", 0)) >= 0){ cases[index].run = runHeader; cases[index].parse = parseBinaryRecord; cases[index].fixedSize = BIN_RECORD_SIZE; }
+
+	openCounters();
+	if(json){ printf("{\"cipher\": \"%s\", \"counters\": %s, \"results\": [\n", cipherInit(), numOpen > 0 ? "true" : "false"); }
+	else{
+		printf("otp_microbench: cipher %s, %d trials of at least %llu ms, best reported\n", cipherInit(), trials, trialNs / 1000000);
+		if(numOpen > 0){ printf("counters: per byte, from perf_event_open\n"); }
+		else{ printf("counters: not available (%s)\n", counterError); }
+		printf("\n%-9s %-22s %10s %9s %8s %7s %7s %6s %9s %9s\n", "group", "variant", "size", "ns/byte", "GB/s", "vs cur",
+			"cyc/B", "IPC", "brmiss/KB", "cmiss/KB");
+	}
+
+	// Side by side: every variant of a group at one size, then the next size. The
+	// last step is cut short so the largest size is always measured.
+	for(int g = 0; g < 4; g++){
+		for(size = minSize; ; size = size > maxSize / 16 ? maxSize : size * 16){
+			double baseline = 0;
+
+			for(int i = 0; i < numCases; i++){
+				if(strcmp(cases[i].group, groups[g]) != 0){ continue; }
+				measure(&cases[i], size, &results[i]);
+				if(cases[i].current){ baseline = results[i].nsPerByte; }
+				report(&cases[i], size, &results[i], baseline);
+			}
+			if(size == maxSize){ break; }
+		}
+	}
+	for(int i = 0; i < numCases; i++){
+		if(strcmp(cases[i].group, "header") != 0){ continue; }
+		measure(&cases[i], cases[i].fixedSize, &results[i]);
+		report(&cases[i], cases[i].fixedSize, &results[i], 0);
+	}
+
+	if(json){ printf("\n]}\n"); }
+	return 0;
+}
+
+/*****************************
+ * Read a byte count with an optional k, m or g suffix
+ *****************************/
+static size_t parseBytes(const char* text){
+	char* end;
+	size_t value = strtoull(text, &end, 10);
+
+	switch(*end){
+		case 'k': case 'K': return value << 10;
+		case 'm': case 'M': return value << 20;
+		case 'g': case 'G': return value << 30;
+		default: return value;
+	}
+}
+
+/*****************************
+ * Fill buf with characters from the 27 character alphabet (xorshift64*)
+ *****************************/
+static void fillRandom(char* buf, size_t len){
+	for(size_t i = 0; i < len; i++){
+		rngState ^= rngState >> 12;
+		rngState ^= rngState << 25;
+		rngState ^= rngState >> 27;
+		buf[i] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ "[(rngState * 2685821657736338717ULL >> 32) % 27];
+	}
+}
+
+static unsigned long long nowNs(){
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*****************************
+ * Open the hardware counters as one group on this thread, user space only so
+ * the default perf_event_paranoid setting allows it. Events the CPU or the
+ * hypervisor doesn't offer are left out. If even cycles can't be counted,
+ * counters are reported as not available.
+ *****************************/
+static void openCounters(){
+	struct perf_event_attr attr;
+	int fd;
+
+	for(int i = 0; i < NUM_COUNTERS; i++){
+		counterSlot[i] = -1;
+		memset(&attr, '\0', sizeof(attr));
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.size = sizeof(attr);
+		attr.config = counterEvents[i];
+		attr.disabled = counterFDs[0] < 0;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		attr.read_format = PERF_FORMAT_GROUP;
+
+		fd = syscall(SYS_perf_event_open, &attr, 0, -1, counterFDs[0], 0);
+		if(fd < 0){
+			if(i == 0){
+				counterError = errno == EACCES || errno == EPERM ? "perf_event_paranoid forbids it" :
+					errno == ENOENT || errno == EOPNOTSUPP ? "no hardware events here" : strerror(errno);
+				return;
+			}
+			continue;
+		}
+		counterFDs[i] = fd;
+		counterSlot[i] = numOpen++;
+	}
+}
+
+static void startCounters(){
+	if(numOpen == 0){ return; }
+	ioctl(counterFDs[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+	ioctl(counterFDs[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+}
+
+/*****************************
+ * Stop the counters and store what they counted in counts, -1 for any that
+ * isn't open
+ *****************************/
+static void stopCounters(double* counts){
+	uint64_t values[1 + NUM_COUNTERS];
+
+	for(int i = 0; i < NUM_COUNTERS; i++){ counts[i] = -1; }
+	if(numOpen == 0){ return; }
+
+	ioctl(counterFDs[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+	if(read(counterFDs[0], values, sizeof(values)) < (ssize_t)((1 + numOpen) * sizeof(uint64_t))){ return; }
+	for(int i = 0; i < NUM_COUNTERS; i++){
+		if(counterSlot[i] >= 0){ counts[i] = values[1 + counterSlot[i]]; }
+	}
+}
+
+/*****************************
+ * Time c at size: double the repetitions until one trial takes trialNs, then
+ * keep the fastest of trials trials. Counters are the fastest trial's.
+ *****************************/
+static void measure(const struct benchCase* c, size_t size, struct measurement* m){
+	static volatile long long sink;
+	unsigned long long start, elapsed, best = ~0ULL;
+	double counts[NUM_COUNTERS];
+	long long iters = 1;
+
+	sink += c->run(c, size, 1);		// Warm up caches and the page tables
+	while(1){
+		start = nowNs();
+		sink += c->run(c, size, iters);
+		elapsed = nowNs() - start;
+		if(elapsed >= trialNs || iters > (1LL << 40)){ break; }
+		iters *= elapsed * 2 < trialNs ? 2 : 1 + trialNs / (elapsed + 1);
+	}
+
+	for(int t = 0; t < trials; t++){
+		startCounters();
+		start = nowNs();
+		sink += c->run(c, size, iters);
+		elapsed = nowNs() - start;
+		stopCounters(counts);
+
+		if(elapsed < best){
+			best = elapsed;
+			m->nsPerByte = (double)elapsed / iters / size;
+			m->nsPerOp = (double)elapsed / iters;
+			for(int i = 0; i < NUM_COUNTERS; i++){
+				m->counts[i] = counts[i] < 0 ? -1 : counts[i] / iters / size;
+			}
+		}
+	}
+}
+
+/*****************************
+ * Every kernel must match the scalar code exactly, on good input and on a bad
+ * character, before its numbers mean anything. Returns 1 if one doesn't.
+ *****************************/
+static int checkKernels(){
+	const struct cipherImpl* impls;
+	size_t size, bad;
+	char* expect;
+	int numImpls, result = 0, got, want;
+
+	// The input buffers are smaller than CHECK_SIZE if -S is
+	size = outCap - RNG_BYTES - MAP_SLACK < CHECK_SIZE ? outCap - RNG_BYTES - MAP_SLACK : CHECK_SIZE;
+	bad = size * 2 / 3;
+
+	impls = cipherImpls(&numImpls);
+	expect = malloc(size);
+	if(expect == NULL){ fprintf(stderr, "ERROR: out of memory\n"); return 1; }
+
+	for(int i = 0; i < numImpls; i++){
+		if(!impls[i].supported()){ continue; }
+		for(int dir = 0; dir < 2; dir++){
+			transformFn scalar = dir ? decryptTextScalar : encryptTextScalar;
+			transformFn kernel = dir ? impls[i].decrypt : impls[i].encrypt;
+
+			want = scalar(expect, textBuf, keyBuf, size);
+			got = kernel(outBuf, textBuf, keyBuf, size);
+			if(got != want || memcmp(outBuf, expect, size) != 0){
+				fprintf(stderr, "ERROR: %s %s doesn't match the scalar code\n", impls[i].name, dir ? "decrypt" : "encrypt");
+				result = 1;
+			}
+
+			// A bad character in the key must be reported at its offset
+			keyBuf[bad] = '*';
+			want = scalar(expect, textBuf, keyBuf, size);
+			got = kernel(outBuf, textBuf, keyBuf, size);
+			keyBuf[bad] = 'A';
+			if(got != want){
+				fprintf(stderr, "ERROR: %s %s reports a bad character at %d, not %d\n", impls[i].name, dir ? "decrypt" : "encrypt", got, want);
+				result = 1;
+			}
+		}
+	}
+	free(expect);
+	return result;
+}
+
+/*****************************
+ * Add a case called group/name unless -f filters it out. Returns its index, or -1.
+ *****************************/
+static int addCase(const char* group, const char* name, int current){
+	char full[64];
+	struct benchCase* c;
+
+	snprintf(full, sizeof(full), "%s/%s", group, name);
+	if(filter != NULL && strstr(full, filter) == NULL){ return -1; }
+	if(numCases == (int)(sizeof(cases) / sizeof(cases[0]))){ return -1; }
+
+	c = &cases[numCases];
+	memset(c, '\0', sizeof(*c));
+	c->group = group;
+	snprintf(c->name, sizeof(c->name), "%s", name);
+	c->current = current;
+	return numCases++;
+}
+
+/*****************************
+ * Print one measurement. baseline is the current variant's ns/byte at this
+ * size, 0 if there is none.
+ *****************************/
+static void report(const struct benchCase* c, size_t size, const struct measurement* m, double baseline){
+	const double* n = m->counts;
+	double ratio = baseline > 0 ? baseline / m->nsPerByte : 0;
+
+	if(json){
+		printf("%s  {\"group\": \"%s\", \"variant\": \"%s\", \"size\": %zu, \"ns_per_byte\": %.4f, \"ns_per_op\": %.1f, \"gb_per_s\": %.3f",
+			firstJSON ? "" : ",\n", c->group, c->name, size, m->nsPerByte, m->nsPerOp, 1 / m->nsPerByte);
+		if(ratio > 0){ printf(", \"vs_current\": %.3f", ratio); }
+		for(int i = 0; i < NUM_COUNTERS; i++){
+			if(n[i] >= 0){ printf(", \"%s_per_byte\": %.5f", counterNames[i], n[i]); }
+		}
+		printf("}");
+		firstJSON = 0;
+		return;
+	}
+
+	printf("%-9s %-22s %10zu %9.4f %8.3f", c->group, c->name, size, m->nsPerByte, 1 / m->nsPerByte);
+	if(ratio > 0){ printf(" %6.2fx", ratio); }
+	else{ printf(" %7s", "-"); }
+	if(n[0] >= 0){ printf(" %7.3f", n[0]); } else{ printf(" %7s", "-"); }
+	if(n[0] > 0 && n[1] >= 0){ printf(" %6.2f", n[1] / n[0]); } else{ printf(" %6s", "-"); }
+	if(n[2] >= 0){ printf(" %9.3f", n[2] * 1024); } else{ printf(" %9s", "-"); }
+	if(n[3] >= 0){ printf(" %9.3f", n[3] * 1024); } else{ printf(" %9s", "-"); }
+	if(c->fixedSize > 0){ printf("  %.1f ns/op", m->nsPerOp); }
+	printf("\n");
+}
+
+static long long runTransform(const struct benchCase* c, size_t size, long long iters){
+	long long sum = 0;
+
+	for(long long i = 0; i < iters; i++){
+		sum += c->transform(outBuf, textBuf, keyBuf, size);
+	}
+	return sum + outBuf[size - 1];
+}
+
+/*****************************
+ * Find a bad character at the end of the text. With a transform that is what
+ * the clients and daemons do now: the kernel validates as it goes and reports
+ * the offset. Without one it checks text and key one character at a time, the
+ * way the clients did before they left it to the kernels.
+ *****************************/
+static long long runValidate(const struct benchCase* c, size_t size, long long iters){
+	long long sum = 0;
+	char saved = textBuf[size - 1];
+
+	textBuf[size - 1] = '*';
+	for(long long i = 0; i < iters; i++){
+		if(c->transform != NULL){ sum += c->transform(outBuf, textBuf, keyBuf, size); continue; }
+		for(size_t j = 0; j < size; j++){
+			if(!validChar(textBuf[j]) || !validChar(keyBuf[j])){ sum += j; break; }
+		}
+		sum++;
+	}
+	textBuf[size - 1] = saved;
+	return sum;
+}
+
+/*****************************
+ * Generate size key characters into outBuf, refill and map like keygen does
+ *****************************/
+static long long runKeygen(const struct benchCase* c, size_t size, long long iters){
+	static struct chacha rng;
+	static int seeded = 0;
+	size_t have;
+
+	if(!seeded){ seedChacha(&rng); seeded = 1; }
+	for(long long i = 0; i < iters; i++){
+		for(have = 0; have < size; ){
+			c->refill(&rng);
+			have += c->map(outBuf + have, rng.out, charTable);
+		}
+	}
+	return outBuf[size - 1];
+}
+
+static long long runHeader(const struct benchCase* c, size_t size, long long iters){
+	long long sum = 0;
+
+	(void)size;
+	for(long long i = 0; i < iters; i++){
+		sum += c->parse();
+	}
+	return sum;
+}
+
+/*****************************
+ * Header parsers under test, each on a header formatted by main()
+ *****************************/
+static int parseAsciiHeader(){
+	size_t textSize, keySize;
+
+	return parseSize(asciiHeader + 1, &textSize) + parseSize(asciiHeader + 1 + SIZE_FIELD, &keySize) + (int)textSize;
+}
+
+static int parseBinaryHeader(){
+	struct binHeader fields;
+
+	return parseBinHeader(binaryHeader, &fields) + (int)fields.textSize;
+}
+
+static int parseAsciiRecord(){
+	char type;
+	size_t size;
+
+	return parseRecord(asciiRecord, &type, &size) + (int)size;
+}
+
+static int parseBinaryRecord(){
+	char type;
+	size_t size;
+
+	return parseBinRecord(binaryRecord, &type, &size) + (int)size;
+}
@@ -0,0 +1,265 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include "otp_pads.h"
+#include "otp_metrics.h"
+
+/*****************************
+ * Pad slice allocator.
+ *
+ * A registered key doubles as a pad that encrypt requests take slices of, so
+ * no two messages are ever encrypted with the same key characters. Taking a
+ * slice is a compare-and-swap on the shared counter in the key's state file,
+ * .<id>.state, whichever worker or daemon does it.
+ *
+ * That a slice was taken must survive a crash, so every slice is appended to
+ * the key's log, .<id>.slices, as "A offset length". Slices are only handed
+ * out below the reserved mark, which the log records as "R mark" and is on
+ * disk before the counter passes it: one fdatasync() per batch of PAD_BATCH
+ * characters, or 1/PAD_BATCH_SHARE of a smaller key, instead of one per
+ * slice, and the slice lines written since go down with it. After a reboot the counters are rebuilt from the log and restart at the
+ * last mark, skipping whatever of the batch was not handed out; within one
+ * boot the state file is always current and is trusted as it is.
+ *
+ * Both files start with a '.', which keeps keysOpen() from taking them for keys.
+ *****************************/
+
+#define PAD_MAGIC 0x31534441504f5450ULL		// "PTOPADS1"
+#define LOG_LINE 64							// Longest log line
+
+/*****************************
+ * A key this process allocates from
+ *****************************/
+struct pad {
+	unsigned long long id;
+	size_t size;
+	struct padState* state;
+	int stateFD;		// flock()ed while the counters are recovered or the mark moves
+	int logFD;
+};
+
+// Function prototypes
+static struct pad* openPad(const struct otpKey*);
+static int recoverPad(struct pad*, const char*);
+static int reserve(struct pad*, unsigned long long);
+static int appendLog(struct pad*, const char*);
+static void readBootId(char*);
+static int padFailed(const char*);
+
+// Global vars
+static struct pad pads[MAX_PADS];
+static int numPads = 0;
+
+/*****************************
+ * Take a slice of len characters of key that no earlier allocation got, and
+ * store where it starts in offset. Returns 1 if the key has less than len
+ * characters left, and -1 if the slice can't be recorded.
+ *****************************/
+int padsAllocate(const struct otpKey* key, size_t len, size_t* offset){
+	unsigned long long start;
+	char line[LOG_LINE];
+	struct pad* pad;
+
+	pad = openPad(key);
+	if(pad == NULL){ return padFailed("SERVER ERROR opening key slice log"); }
+
+	// The mark moves first, so nothing is claimed that a crash could hand out
+	// again, and nothing is claimed at all if the mark can't be written
+	start = __atomic_load_n(&pad->state->next, __ATOMIC_ACQUIRE);
+	do{
+		if(len > pad->size || start > pad->size - len){ return 1; }
+		if(start + len > __atomic_load_n(&pad->state->reserved, __ATOMIC_ACQUIRE) && reserve(pad, start + len) != 0){
+			return padFailed("SERVER ERROR reserving key slices");
+		}
+	} while(!__atomic_compare_exchange_n(&pad->state->next, &start, start + len, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+	// The mark covers the slice now, so without its line it is lost, not handed out twice
+	snprintf(line, sizeof(line), "A %llu %zu\n", start, len);
+	if(appendLog(pad, line) != 0){ return padFailed("SERVER ERROR logging key slice"); }
+	METRIC_ADD(padSlices, 1);
+	*offset = start;
+	return 0;
+}
+
+/*****************************
+ * The pad for key, opening its state file and log the first time.
+ * Returns NULL if they can't be opened.
+ *****************************/
+static struct pad* openPad(const struct otpKey* key){
+	char logPath[KEY_PATH_MAX], statePath[KEY_PATH_MAX];
+	struct pad* pad;
+	struct stat info;
+	int dirFD;
+
+	for(int i = 0; i < numPads; i++){
+		if(pads[i].id == key->id){ return &pads[i]; }
+	}
+	if(numPads == MAX_PADS){
+		errno = EMFILE;
+		return NULL;
+	}
+
+	if(snprintf(logPath, sizeof(logPath), "%s/.%016llx.slices", keysDirectory(), key->id) >= (int)sizeof(logPath)
+		|| snprintf(statePath, sizeof(statePath), "%s/.%016llx.state", keysDirectory(), key->id) >= (int)sizeof(statePath)){
+		errno = ENAMETOOLONG;
+		return NULL;
+	}
+
+	pad = &pads[numPads];
+	pad->id = key->id;
+	pad->size = key->size;
+
+	pad->logFD = open(logPath, O_WRONLY | O_APPEND | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+	if(pad->logFD >= 0){
+		// A new log has to be found after a crash as well
+		dirFD = open(keysDirectory(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if(dirFD >= 0){
+			fsync(dirFD);
+			close(dirFD);
+		}
+	}
+	else if(errno == EEXIST){ pad->logFD = open(logPath, O_WRONLY | O_APPEND | O_CLOEXEC); }
+	if(pad->logFD < 0){ return NULL; }
+
+	pad->stateFD = open(statePath, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if(pad->stateFD < 0){
+		close(pad->logFD);
+		return NULL;
+	}
+
+	if(flock(pad->stateFD, LOCK_EX) != 0){
+		close(pad->stateFD);
+		close(pad->logFD);
+		return NULL;
+	}
+	pad->state = MAP_FAILED;
+	if(fstat(pad->stateFD, &info) == 0 && ((size_t)info.st_size >= sizeof(struct padState) || ftruncate(pad->stateFD, sizeof(struct padState)) == 0)){
+		pad->state = mmap(NULL, sizeof(struct padState), PROT_READ | PROT_WRITE, MAP_SHARED, pad->stateFD, 0);
+	}
+	if(pad->state == MAP_FAILED || recoverPad(pad, logPath) != 0){
+		flock(pad->stateFD, LOCK_UN);
+		if(pad->state != MAP_FAILED){ munmap(pad->state, sizeof(struct padState)); }
+		close(pad->stateFD);
+		close(pad->logFD);
+		return NULL;
+	}
+	flock(pad->stateFD, LOCK_UN);
+
+	numPads++;
+	return pad;
+}
+
+/*****************************
+ * Make the state file right for this boot, with its lock held. The first
+ * opener since boot rebuilds it from the log at logPath: anything up to the
+ * last mark may have been handed out, so slicing resumes from there.
+ * Returns -1 if the log can't be read.
+ *****************************/
+static int recoverPad(struct pad* pad, const char* logPath){
+	struct padState* state = pad->state;
+	unsigned long long mark = 0, end = 0, next, offset, len;
+	char bootId[sizeof(state->bootId)];
+	char line[LOG_LINE];
+	FILE* log;
+
+	readBootId(bootId);
+	if(state->magic == PAD_MAGIC && bootId[0] != '\0' && strcmp(state->bootId, bootId) == 0){ return 0; }
+
+	log = fopen(logPath, "re");
+	if(log == NULL){ return -1; }
+	while(fgets(line, sizeof(line), log) != NULL){
+		// A line cut off by a crash has no newline and is ignored
+		if(strchr(line, '\n') == NULL){ continue; }
+		if(sscanf(line, "R %llu", &offset) == 1 && offset > mark){ mark = offset; }
+		if(sscanf(line, "A %llu %llu", &offset, &len) == 2 && offset + len > end){ end = offset + len; }
+	}
+	fclose(log);
+
+	// Only a mark in the log is known to be on disk. The counter never goes back,
+	// in case a process that has the pad open already is slicing it.
+	if(end < mark){ end = mark; }
+	next = state->magic == PAD_MAGIC ? __atomic_load_n(&state->next, __ATOMIC_ACQUIRE) : 0;
+	while(next < end && !__atomic_compare_exchange_n(&state->next, &next, end, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+	if(state->magic != PAD_MAGIC || state->reserved < mark){ __atomic_store_n(&state->reserved, mark, __ATOMIC_RELEASE); }
+	memcpy(state->bootId, bootId, sizeof(state->bootId));
+	__atomic_store_n(&state->magic, PAD_MAGIC, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/*****************************
+ * Move the reserved mark past end and put it on disk, together with the slice
+ * lines before it. Another process may have moved it already while this one
+ * waited for the lock. Returns -1 if the log can't be written.
+ *****************************/
+static int reserve(struct pad* pad, unsigned long long end){
+	unsigned long long batch = pad->size / PAD_BATCH_SHARE, mark;
+	char line[LOG_LINE];
+	int result = 0;
+
+	// A reboot skips what is left of the batch, which mustn't be most of a small key
+	if(batch > PAD_BATCH){ batch = PAD_BATCH; }
+	if(batch == 0){ batch = 1; }
+
+	if(flock(pad->stateFD, LOCK_EX) != 0){ return -1; }
+	if(__atomic_load_n(&pad->state->reserved, __ATOMIC_ACQUIRE) < end){
+		mark = end + batch < pad->size ? end + batch : pad->size;
+		snprintf(line, sizeof(line), "R %llu\n", mark);
+		if(appendLog(pad, line) != 0 || fdatasync(pad->logFD) != 0){ result = -1; }
+		else{
+			__atomic_store_n(&pad->state->reserved, mark, __ATOMIC_RELEASE);
+			METRIC_ADD(padSyncs, 1);
+		}
+	}
+	flock(pad->stateFD, LOCK_UN);
+	return result;
+}
+
+/*****************************
+ * Append one line to the log. O_APPEND keeps lines from several processes
+ * whole. Returns -1 on failure.
+ *****************************/
+static int appendLog(struct pad* pad, const char* line){
+	size_t len = strlen(line);
+	ssize_t n;
+
+	do{
+		n = write(pad->logFD, line, len);
+	} while(n < 0 && errno == EINTR);
+	return n == (ssize_t)len ? 0 : -1;
+}
+
+/*****************************
+ * Report why a slice couldn't be had, with errno, and count it.
+ * Returns -1 for padsAllocate() to pass on.
+ *****************************/
+static int padFailed(const char* msg){
+	perror(msg);
+	METRIC_ADD(padFailures, 1);
+	return -1;
+}
+
+/*****************************
+ * This boot's id, or "" if the kernel doesn't say, which makes every open
+ * recover from the log
+ *****************************/
+static void readBootId(char* bootId){
+	ssize_t n = -1;
+	int fd;
+
+	fd = open("/proc/sys/kernel/random/boot_id", O_RDONLY | O_CLOEXEC);
+	if(fd >= 0){
+		n = read(fd, bootId, sizeof(((struct padState*)0)->bootId) - 1);
+		close(fd);
+	}
+	if(n < 0){ n = 0; }
+	bootId[n] = '\0';
+	if(n > 0 && bootId[n - 1] == '\n'){ bootId[n - 1] = '\0'; }
+}
@@ -0,0 +1,25 @@
+#ifndef OTP_PADS_H
+#define OTP_PADS_H
+
+#include <stddef.h>
+#include "otp_keys.h"
+
+#define PAD_BATCH (4ULL << 20)	// Most key characters made safe to hand out per log fsync
+#define PAD_BATCH_SHARE 64		// A smaller key gets a batch of this share of it
+#define MAX_PADS 64				// Keys one process allocates slices of
+
+/*****************************
+ * Where slicing a key has got to, in a file in the key directory mapped by
+ * every process that allocates from the key, so workers and restarted
+ * daemons carry on from the same place
+ *****************************/
+struct padState {
+	unsigned long long magic;
+	char bootId[40];				// Boot the counters were last recovered in
+	unsigned long long next;		// First key character no slice has had
+	unsigned long long reserved;	// Slices may be handed out below this: the log has it on disk
+};
+
+int padsAllocate(const struct otpKey*, size_t, size_t*);
+
+#endif
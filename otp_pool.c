@@ -0,0 +1,99 @@
+#define _GNU_SOURCE
+#include <stddef.h>
+#include <sys/mman.h>
+#include "otp_pool.h"
+#include "otp_metrics.h"
+
+// Function prototypes
+static int sizeClass(size_t);
+
+// Global vars
+static void* freeLists[POOL_CLASSES];		// Idle buffers of each class, linked through their first word
+static size_t idleBytes;
+
+/*****************************
+ * Class a buffer of size bytes comes from, POOL_CLASSES if it is too big
+ * to keep
+ *****************************/
+static int sizeClass(size_t size){
+	int shift = POOL_MIN_SHIFT;
+
+	while(shift < POOL_MIN_SHIFT + POOL_CLASSES && ((size_t)1 << shift) < size){ shift++; }
+	return shift - POOL_MIN_SHIFT;
+}
+
+/*****************************
+ * A page aligned buffer of at least size bytes, or NULL if out of memory.
+ * Buffers are this process's alone and are reused as they were left, not
+ * zeroed: one handed back by poolPut() has had its pages faulted in already,
+ * which is the point. Give it back with poolPut() and the same size.
+ *****************************/
+void* poolGet(size_t size){
+	int class = sizeClass(size);
+	size_t length;
+	void* buf;
+
+	if(class < POOL_CLASSES && freeLists[class] != NULL){
+		buf = freeLists[class];
+		freeLists[class] = *(void**)buf;
+		length = (size_t)1 << (class + POOL_MIN_SHIFT);
+		idleBytes -= length;
+		METRIC_ADD(poolHits, 1);
+		METRIC_ADD(poolIdleBytes, -(unsigned long long)length);
+		return buf;
+	}
+
+	METRIC_ADD(poolMisses, 1);
+	length = class < POOL_CLASSES ? (size_t)1 << (class + POOL_MIN_SHIFT) : size;
+	buf = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(buf == MAP_FAILED){ return NULL; }
+	if(length >= (size_t)1 << POOL_HUGE_SHIFT){ madvise(buf, length, MADV_HUGEPAGE); }		// Best effort
+	return buf;
+}
+
+/*****************************
+ * Hand back buf, got from poolGet(size). It is kept for the next poolGet()
+ * of its class unless the pool already holds POOL_KEEP_BYTES.
+ *****************************/
+void poolPut(void* buf, size_t size){
+	int class = sizeClass(size);
+	size_t length;
+
+	if(buf == NULL){ return; }
+	length = class < POOL_CLASSES ? (size_t)1 << (class + POOL_MIN_SHIFT) : size;
+	if(class == POOL_CLASSES || idleBytes + length > POOL_KEEP_BYTES){
+		munmap(buf, length);
+		return;
+	}
+
+	*(void**)buf = freeLists[class];
+	freeLists[class] = buf;
+	idleBytes += length;
+	METRIC_ADD(poolIdleBytes, length);
+}
+
+/*****************************
+ * Unmap buf, got from poolGet(size), instead of keeping it
+ *****************************/
+void poolDrop(void* buf, size_t size){
+	int class = sizeClass(size);
+
+	if(buf == NULL){ return; }
+	munmap(buf, class < POOL_CLASSES ? (size_t)1 << (class + POOL_MIN_SHIFT) : size);
+}
+
+/*****************************
+ * Unmap every idle buffer
+ *****************************/
+void poolDrain(){
+	void* buf;
+
+	for(int class = 0; class < POOL_CLASSES; class++){
+		while((buf = freeLists[class]) != NULL){
+			freeLists[class] = *(void**)buf;
+			munmap(buf, (size_t)1 << (class + POOL_MIN_SHIFT));
+		}
+	}
+	METRIC_ADD(poolIdleBytes, -(unsigned long long)idleBytes);
+	idleBytes = 0;
+}
@@ -0,0 +1,16 @@
+#ifndef OTP_POOL_H
+#define OTP_POOL_H
+
+#include <stddef.h>
+
+#define POOL_MIN_SHIFT 12			// Smallest class: one 4 KB page
+#define POOL_CLASSES 13				// Classes double up to 16 MB, larger buffers are mapped and unmapped each time
+#define POOL_HUGE_SHIFT 21			// Classes from 2 MB up ask for transparent huge pages
+#define POOL_KEEP_BYTES (64UL << 20)	// Most idle memory the pool holds on to
+
+void* poolGet(size_t);
+void poolPut(void*, size_t);
+void poolDrop(void*, size_t);
+void poolDrain();
+
+#endif
@@ -0,0 +1,287 @@
+#include <stdio.h>
+#include <string.h>
+#include "otp_proto.h"
+
+// Function prototypes
+static void putLE(char*, unsigned long long, int);
+static unsigned long long getLE(const char*, int);
+
+/*****************************
+ * Write the text form of size into a SIZE_FIELD wide field,
+ * padding the unused characters on the right with '-'.
+ * The field is not null terminated.
+ *****************************/
+void formatSize(char* field, size_t size){
+	char digits[SIZE_FIELD + 1];
+	int len = snprintf(digits, sizeof(digits), "%zu", size);
+
+	memset(field, '-', SIZE_FIELD);
+	memcpy(field, digits, len);
+}
+
+/*****************************
+ * Read a size written by formatSize(). Returns 0 on success and
+ * 1 if the field holds anything other than digits followed by padding.
+ *****************************/
+int parseSize(const char* field, size_t* size){
+	size_t result = 0;
+	int i = 0;
+
+	while(i < SIZE_FIELD && field[i] >= '0' && field[i] <= '9'){
+		result = result * 10 + (field[i] - '0');
+		i++;
+	}
+
+	// Need at least one digit, and only padding after the digits
+	if(i == 0){ return 1; }
+	for(; i < SIZE_FIELD; i++){
+		if(field[i] != '-'){ return 1; }
+	}
+
+	*size = result;
+	return 0;
+}
+
+/*****************************
+ * Build a HEADER_SIZE request header in header
+ *****************************/
+void formatHeader(char* header, char origin, size_t textSize, size_t keySize){
+	header[0] = origin;
+	formatSize(header + 1, textSize);
+	formatSize(header + 1 + SIZE_FIELD, keySize);
+}
+
+/*****************************
+ * Build a RECORD_SIZE record header in record
+ *****************************/
+void formatRecord(char* record, char type, size_t size){
+	record[0] = type;
+	formatSize(record + 1, size);
+}
+
+/*****************************
+ * Split a RECORD_SIZE record header into its type and payload size.
+ * Returns 1 if the record is malformed.
+ *****************************/
+int parseRecord(const char* record, char* type, size_t* size){
+	if(record[0] != RECORD_DATA && record[0] != RECORD_END && record[0] != RECORD_ERROR && record[0] != RECORD_UNKNOWN_KEY
+		&& record[0] != RECORD_BAD_CHAR){
+		return 1;
+	}
+	*type = record[0];
+	return parseSize(record + 1, size);
+}
+
+/*****************************
+ * Full header size for a request starting with origin. Every header is
+ * at least HEADER_SIZE long, so that much can always be read first.
+ *****************************/
+size_t headerSize(char origin){
+	if((unsigned char)origin == BIN_MAGIC_BYTE){
+		return BIN_HEADER_SIZE;
+	}
+	if(origin == ORIGIN_ENC_KEYREF || origin == ORIGIN_DEC_KEYREF || origin == ORIGIN_REGISTER){
+		return EXT_HEADER_SIZE;
+	}
+	return HEADER_SIZE;
+}
+
+/*****************************
+ * Build an EXT_HEADER_SIZE header for a key reference or registration request
+ *****************************/
+void formatKeyHeader(char* header, char origin, size_t size, size_t keyOffset, unsigned long long id){
+	char digits[KEY_ID_FIELD + 1];
+
+	header[0] = origin;
+	formatSize(header + 1, size);
+	formatSize(header + 1 + SIZE_FIELD, keyOffset);
+	snprintf(digits, sizeof(digits), "%016llx", id);
+	memcpy(header + HEADER_SIZE, digits, KEY_ID_FIELD);
+}
+
+/*****************************
+ * Read the 16 hex digit key id written by formatKeyHeader().
+ * Returns 1 if the field is not valid hex.
+ *****************************/
+int parseKeyId(const char* field, unsigned long long* id){
+	unsigned long long result = 0;
+	int digit;
+
+	for(int i = 0; i < KEY_ID_FIELD; i++){
+		if(field[i] >= '0' && field[i] <= '9'){ digit = field[i] - '0'; }
+		else if(field[i] >= 'a' && field[i] <= 'f'){ digit = field[i] - 'a' + 10; }
+		else{ return 1; }
+		result = (result << 4) | digit;
+	}
+
+	*id = result;
+	return 0;
+}
+
+/*****************************
+ * Id of a key of size characters. head holds its first min(size, KEY_SAMPLE)
+ * characters and tail its last min(size, KEY_SAMPLE). This is a 64-bit FNV-1a
+ * hash over the size and both samples. Pads are random, so two different pads
+ * never share their samples, and anyone holding a key file can work out its
+ * id without reading the whole thing. It is a name, not a checksum.
+ *****************************/
+unsigned long long keyId(const char* head, const char* tail, size_t size){
+	unsigned long long hash = 14695981039346656037ULL;
+	size_t sample = size < KEY_SAMPLE ? size : KEY_SAMPLE;
+
+	for(int i = 0; i < 8; i++){
+		hash = (hash ^ ((size >> (8 * i)) & 0xFF)) * 1099511628211ULL;
+	}
+	for(size_t i = 0; i < sample; i++){
+		hash = (hash ^ (unsigned char)head[i]) * 1099511628211ULL;
+	}
+	for(size_t i = 0; i < sample; i++){
+		hash = (hash ^ (unsigned char)tail[i]) * 1099511628211ULL;
+	}
+	return hash;
+}
+
+/*****************************
+ * Build the BAD_CHAR_SIZE payload of a bad character record
+ *****************************/
+void formatBadChar(char* payload, size_t offset, char where){
+	formatSize(payload, offset);
+	payload[SIZE_FIELD] = where;
+}
+
+/*****************************
+ * Read a bad character payload of len bytes.
+ * Returns 1 if it is malformed.
+ *****************************/
+int parseBadChar(const char* payload, size_t len, size_t* offset, char* where){
+	if(len != BAD_CHAR_SIZE || parseSize(payload, offset) != 0){ return 1; }
+	if(payload[SIZE_FIELD] != BAD_CHAR_TEXT && payload[SIZE_FIELD] != BAD_CHAR_KEY){ return 1; }
+	*where = payload[SIZE_FIELD];
+	return 0;
+}
+
+/*****************************
+ * Build a BIN_HEADER_SIZE binary request header in header
+ *****************************/
+void formatBinHeader(char* header, const struct binHeader* fields){
+	putLE(header, BIN_MAGIC | ((unsigned long long)BIN_VERSION << 24), 4);
+	header[4] = fields->op;
+	header[5] = fields->flags;
+	putLE(header + 6, 0, 2);
+	putLE(header + 8, fields->textSize, 8);
+	putLE(header + 16, fields->keySize, 8);
+	putLE(header + 24, fields->keyOffset, 8);
+	putLE(header + 32, fields->keyId, 8);
+}
+
+/*****************************
+ * Read a binary request header. Returns 1 if it is not one,
+ * and 2 if it is one of a version this build doesn't speak.
+ *****************************/
+int parseBinHeader(const char* header, struct binHeader* fields){
+	unsigned long long word = getLE(header, 4);
+
+	if((word & 0xFFFFFF) != BIN_MAGIC){ return 1; }
+	if((word >> 24) != BIN_VERSION){ return 2; }
+
+	fields->op = header[4];
+	fields->flags = header[5];
+	fields->textSize = getLE(header + 8, 8);
+	fields->keySize = getLE(header + 16, 8);
+	fields->keyOffset = getLE(header + 24, 8);
+	fields->keyId = getLE(header + 32, 8);
+	return 0;
+}
+
+/*****************************
+ * Build a BIN_RECORD_SIZE record header in record
+ *****************************/
+void formatBinRecord(char* record, char type, size_t size){
+	record[0] = type;
+	putLE(record + 1, 0, 3);
+	putLE(record + 4, size, 4);
+}
+
+/*****************************
+ * Split a BIN_RECORD_SIZE record header into its type and payload size.
+ * Returns 1 if the record is malformed.
+ *****************************/
+int parseBinRecord(const char* record, char* type, size_t* size){
+	if(record[0] != RECORD_DATA && record[0] != RECORD_END && record[0] != RECORD_ERROR && record[0] != RECORD_UNKNOWN_KEY
+		&& record[0] != RECORD_BAD_CHAR && record[0] != RECORD_FD && record[0] != RECORD_BUSY && record[0] != RECORD_SLICE){
+		return 1;
+	}
+	*type = record[0];
+	*size = getLE(record + 4, 4);
+	return 0;
+}
+
+/*****************************
+ * Build the BIN_BAD_CHAR_SIZE payload of a binary bad character record
+ *****************************/
+void formatBinBadChar(char* payload, size_t offset, char where){
+	putLE(payload, offset, 8);
+	payload[8] = where;
+}
+
+/*****************************
+ * Read a binary bad character payload of len bytes.
+ * Returns 1 if it is malformed.
+ *****************************/
+int parseBinBadChar(const char* payload, size_t len, size_t* offset, char* where){
+	if(len != BIN_BAD_CHAR_SIZE){ return 1; }
+	if(payload[8] != BAD_CHAR_TEXT && payload[8] != BAD_CHAR_KEY){ return 1; }
+	*offset = getLE(payload, 8);
+	*where = payload[8];
+	return 0;
+}
+
+/*****************************
+ * Build the BIN_BUSY_SIZE payload of a busy record
+ *****************************/
+void formatBinBusy(char* payload, unsigned int retryMs){
+	putLE(payload, retryMs, 4);
+}
+
+/*****************************
+ * Read a busy payload of len bytes. Returns 1 if it is malformed.
+ *****************************/
+int parseBinBusy(const char* payload, size_t len, unsigned int* retryMs){
+	if(len != BIN_BUSY_SIZE){ return 1; }
+	*retryMs = getLE(payload, 4);
+	return 0;
+}
+
+/*****************************
+ * Build the BIN_SLICE_SIZE payload of a slice record
+ *****************************/
+void formatBinSlice(char* payload, size_t offset){
+	putLE(payload, offset, 8);
+}
+
+/*****************************
+ * Read a slice payload of len bytes. Returns 1 if it is malformed.
+ *****************************/
+int parseBinSlice(const char* payload, size_t len, size_t* offset){
+	if(len != BIN_SLICE_SIZE){ return 1; }
+	*offset = getLE(payload, 8);
+	return 0;
+}
+
+/*****************************
+ * Store the low bytes of value little-endian, whatever this machine's byte order
+ *****************************/
+static void putLE(char* field, unsigned long long value, int bytes){
+	for(int i = 0; i < bytes; i++){
+		field[i] = (char)(value >> (8 * i));
+	}
+}
+
+static unsigned long long getLE(const char* field, int bytes){
+	unsigned long long value = 0;
+
+	for(int i = 0; i < bytes; i++){
+		value |= (unsigned long long)(unsigned char)field[i] << (8 * i);
+	}
+	return value;
+}
@@ -0,0 +1,161 @@
+#ifndef OTP_PROTO_H
+#define OTP_PROTO_H
+
+#include <stddef.h>
+
+/*****************************
+ * Wire format shared by the clients and the daemons.
+ *
+ * Every request starts with a HEADER_SIZE header:
+ * header[0] = origin. See the ORIGIN_* values below
+ * header[1 - 10] = text form of the number of characters in the plaintext, padded with '-'
+ * header[11 - 20] = text form of the number of characters in the key, padded with '-'
+ *
+ * Legacy requests ('!' and ' ') are followed by the whole plaintext and then the
+ * whole key, and the reply is the raw transformed text.
+ *
+ * Streamed requests ('E' and 'D') are followed by a series of records. Each data
+ * record carries up to CHUNK_SIZE characters of text immediately followed by the
+ * same number of key characters, and an end record closes the request. The reply
+ * uses the same record layout, one data record per request record. For streamed
+ * and key reference requests the plaintext size is an upper bound: the end record
+ * may come sooner, which lets a client stream input whose length it doesn't know.
+ *
+ * Key reference requests ('e' and 'd') use a key the daemon already holds in its
+ * key registry, so their records carry only text. They have an EXT_HEADER_SIZE header:
+ * header[0] = origin
+ * header[1 - 10] = text form of the number of characters in the plaintext
+ * header[11 - 20] = text form of the offset into the key to start at
+ * header[21 - 36] = key id, 16 hex digits (see keyId)
+ *
+ * A key registration request ('R') uses the same header with the key size in
+ * place of the plaintext size and an offset of 0, followed by the raw key.
+ * The reply is an end record, or an error record if the key was not stored.
+ *
+ * The daemon checks every text and key character as it transforms them. The
+ * first one outside A-Z and ' ' ends the request with a bad character record,
+ * whose BAD_CHAR_SIZE payload is the text offset it was found at (a size
+ * field) followed by BAD_CHAR_TEXT or BAD_CHAR_KEY.
+ *
+ * Binary requests are what the clients send now. Their first byte can't be an
+ * ASCII origin, so a daemon tells them apart from everything above by it. The
+ * BIN_HEADER_SIZE header is fixed fields, integers little-endian:
+ * header[0 - 3] = BIN_MAGIC in the low 24 bits, BIN_VERSION in the top 8
+ * header[4] = opcode, one of the BIN_OP_* values below
+ * header[5] = flags, BIN_FLAG_* values
+ * header[6 - 7] = reserved, 0
+ * header[8 - 15] = number of characters in the plaintext (an upper bound, as above)
+ * header[16 - 23] = number of characters in the key, or the key size to register
+ * header[24 - 31] = offset into a registered key to start at
+ * header[32 - 39] = key id for key references and registration
+ *
+ * Encrypt and decrypt requests are followed by records like streamed requests,
+ * with BIN_FLAG_KEY_REF making them key reference requests. An encrypt request
+ * that also has BIN_FLAG_ALLOCATE leaves the offset to the daemon, which hands
+ * out a slice of the key no earlier allocation got, textSize characters long,
+ * and names it in a RECORD_SLICE record ahead of the reply data. Its
+ * BIN_SLICE_SIZE payload is the key offset as 64 bits. Register is followed
+ * by the raw key. Ping and stats have no body: ping is answered with an end
+ * record, stats with a data record of "name value" lines and an end record.
+ * Binary requests use BIN_RECORD_SIZE records: the type, 3 reserved bytes and
+ * the payload size as 32 bits. A bad character payload is the offset as 64 bits
+ * followed by BAD_CHAR_TEXT or BAD_CHAR_KEY.
+ *
+ * Over a UNIX socket, an encrypt or decrypt request with BIN_FLAG_FDS has no
+ * records at all: the header is sent together with two descriptors (SCM_RIGHTS),
+ * a file holding the text and one holding the key, both read from offset 0.
+ * The reply is a RECORD_FD record, sent together with a descriptor of a memory
+ * file holding the transformed text, and an end record. No text crosses the
+ * socket either way.
+ *
+ * A daemon with no room for a connection may answer it with a RECORD_BUSY
+ * record as soon as it is accepted, before reading any of it, and close it.
+ * The BIN_BUSY_SIZE payload is how long to wait before trying again, in ms as
+ * 32 bits. The record is binary whatever the client was going to send.
+ *****************************/
+
+#define ORIGIN_ENC '!'			// Legacy request from otp_enc
+#define ORIGIN_DEC ' '			// Legacy request from otp_dec
+#define ORIGIN_ENC_STREAM 'E'	// Streamed request from otp_enc
+#define ORIGIN_DEC_STREAM 'D'	// Streamed request from otp_dec
+#define ORIGIN_ENC_KEYREF 'e'	// Streamed request from otp_enc using a registered key
+#define ORIGIN_DEC_KEYREF 'd'	// Streamed request from otp_dec using a registered key
+#define ORIGIN_REGISTER 'R'		// Store a key in the daemon's key registry
+
+#define HEADER_SIZE 21			// origin(1) + plaintext size(10) + key size(10)
+#define EXT_HEADER_SIZE 37		// HEADER_SIZE + key id(16)
+#define SIZE_FIELD 10			// Width of a text form size field
+#define LEGACY_TEXT_MAX (64UL << 20)	// Largest plaintext a legacy request may send, the daemon holds all of it
+#define KEY_ID_FIELD 16			// Width of a hex key id
+#define KEY_SAMPLE 4096			// Characters from each end of a key that go into its id
+#define RECORD_SIZE 11			// record type(1) + payload size(10)
+#define CHUNK_SIZE 65520		// Largest payload a single record may carry, see CHUNK_BUFFER in otp_conn.c
+
+#define RECORD_DATA '+'			// Payload follows
+#define RECORD_END '.'			// Request or reply is complete, payload size is 0
+#define RECORD_ERROR '-'		// Payload is an error message, connection closes after it
+#define RECORD_UNKNOWN_KEY '?'	// Like RECORD_ERROR, but the key id is not registered
+#define RECORD_BAD_CHAR '#'		// Like RECORD_ERROR, but says where the bad input is
+#define RECORD_FD '='			// Binary only: payload size is 0, the reply is in the descriptor sent with it
+#define RECORD_BUSY '~'			// Binary only: the daemon is overloaded and served nothing, payload is when to retry
+#define RECORD_SLICE '@'		// Binary only: payload is the key offset the daemon allocated for the request
+
+#define BIN_MAGIC 0x544FF1		// "\xF1OT" read little-endian
+#define BIN_MAGIC_BYTE 0xF1		// First byte of every binary request
+#define BIN_VERSION 1
+#define BIN_HEADER_SIZE 40		// See the layout above
+#define BIN_RECORD_SIZE 8		// record type(1) + reserved(3) + payload size(4)
+#define MAX_HEADER_SIZE BIN_HEADER_SIZE	// Largest header of any kind
+
+#define BIN_OP_ENCRYPT 1
+#define BIN_OP_DECRYPT 2
+#define BIN_OP_REGISTER 3		// Store a key in the daemon's key registry
+#define BIN_OP_PING 4			// Check the daemon is alive
+#define BIN_OP_STATS 5			// Ask for the daemon's counters
+
+#define BIN_FLAG_KEY_REF 0x01	// Use the registered key keyId instead of sending one
+#define BIN_FLAG_FDS 0x02		// Text and key are files whose descriptors come with the header
+#define BIN_FLAG_ALLOCATE 0x04	// With BIN_FLAG_KEY_REF: the daemon picks an unused key offset
+
+#define BAD_CHAR_SIZE 11		// offset(10) + where(1)
+#define BIN_BAD_CHAR_SIZE 9		// offset(8) + where(1)
+#define BIN_BUSY_SIZE 4			// retry after ms(4)
+#define BIN_SLICE_SIZE 8		// key offset(8)
+#define BAD_CHAR_TEXT 'T'		// The bad character was in the text
+#define BAD_CHAR_KEY 'K'		// The bad character was in the key
+
+/*****************************
+ * Fields of a binary request header
+ *****************************/
+struct binHeader {
+	unsigned char op;
+	unsigned char flags;
+	unsigned long long textSize;
+	unsigned long long keySize;
+	unsigned long long keyOffset;
+	unsigned long long keyId;
+};
+
+void formatSize(char*, size_t);
+int parseSize(const char*, size_t*);
+void formatHeader(char*, char, size_t, size_t);
+void formatRecord(char*, char, size_t);
+int parseRecord(const char*, char*, size_t*);
+size_t headerSize(char);
+void formatKeyHeader(char*, char, size_t, size_t, unsigned long long);
+int parseKeyId(const char*, unsigned long long*);
+unsigned long long keyId(const char*, const char*, size_t);
+void formatBadChar(char*, size_t, char);
+int parseBadChar(const char*, size_t, size_t*, char*);
+void formatBinHeader(char*, const struct binHeader*);
+int parseBinHeader(const char*, struct binHeader*);
+void formatBinRecord(char*, char, size_t);
+int parseBinRecord(const char*, char*, size_t*);
+void formatBinBadChar(char*, size_t, char);
+int parseBinBadChar(const char*, size_t, size_t*, char*);
+void formatBinBusy(char*, unsigned int);
+int parseBinBusy(const char*, size_t, unsigned int*);
+void formatBinSlice(char*, size_t);
+int parseBinSlice(const char*, size_t, size_t*);
+
+#endif
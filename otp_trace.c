@@ -0,0 +1,145 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include "otp_trace.h"
+#include "otp_metrics.h"
+
+// Function prototypes
+static size_t stampf(char*, size_t, size_t, const char*, const struct traceRecord*, int);
+static void logSlow(const struct traceRecord*, unsigned long long);
+
+// Global vars
+int tracing = 0;
+static struct traceFileHeader* traceFile = NULL;
+static struct traceRing* ring = NULL;		// This process's ring, NULL if there is no trace file
+static int ringIndex = 0;
+static unsigned long long slowNs = 0;		// Log requests slower than this, 0 for never
+
+/*****************************
+ * Create the trace file at path with a ring for each of workers workers and
+ * map it shared, so every process forked from here writes into it with plain
+ * stores and the records survive the daemon. Records go into the first ring
+ * until traceUseRing() picks another. Returns -1 and sets errno on failure.
+ *****************************/
+int traceOpen(const char* path, int workers){
+	size_t ringSize = sizeof(struct traceRing) + TRACE_SLOTS * sizeof(struct traceRecord);
+	size_t size = sizeof(struct traceFileHeader) + workers * ringSize;
+	void* mapped;
+	int fd, err;
+
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if(fd < 0){ return -1; }
+	// Allocate every block now, so a full disk fails here rather than faulting a worker later
+	err = posix_fallocate(fd, 0, size);
+	if(err != 0){ close(fd); errno = err; return -1; }
+	mapped = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(mapped == MAP_FAILED){ return -1; }
+
+	traceFile = mapped;
+	memcpy(traceFile->magic, TRACE_MAGIC, sizeof(traceFile->magic));
+	traceFile->version = TRACE_VERSION;
+	traceFile->workers = workers;
+	traceFile->slots = TRACE_SLOTS;
+	traceFile->recordSize = sizeof(struct traceRecord);
+	traceFile->startNs = metricsNow();
+
+	ring = traceRingAt(traceFile, 0);
+	tracing = 1;
+	return 0;
+}
+
+/*****************************
+ * Log the whole timeline of every request that takes ns or longer from its
+ * first header byte to its last reply byte
+ *****************************/
+void traceSlowAfter(unsigned long long ns){
+	slowNs = ns;
+	tracing = 1;
+}
+
+/*****************************
+ * Write into ring index from now on. Called by each worker as it starts.
+ *****************************/
+void traceUseRing(int index){
+	if(traceFile == NULL || index < 0 || index >= (int)traceFile->workers){ return; }
+	ring = traceRingAt(traceFile, index);
+	ringIndex = index;
+}
+
+/*****************************
+ * Ring number index of a mapped trace file
+ *****************************/
+struct traceRing* traceRingAt(struct traceFileHeader* file, int index){
+	size_t ringSize = sizeof(struct traceRing) + file->slots * sizeof(struct traceRecord);
+
+	return (struct traceRing*)((char*)(file + 1) + index * ringSize);
+}
+
+/*****************************
+ * A request's timeline is complete. Claim the next ring slot and fill it in;
+ * the slot's seq is cleared first and set last, so a reader can tell a torn
+ * record from a whole one. Fork mode children share a ring, which is why the
+ * claim is an atomic add. No locks and no system calls, except to log a slow
+ * request.
+ *****************************/
+void traceCommit(struct traceRecord* rec){
+	struct traceRecord* slot;
+	unsigned long long pos;
+	unsigned long long start = rec->stamps[TRACE_HEADER_START];
+	unsigned long long end = rec->stamps[TRACE_SENT] != 0 ? rec->stamps[TRACE_SENT] : rec->stamps[TRACE_QUEUED];
+
+	rec->worker = ringIndex;
+	if(ring != NULL){
+		pos = __atomic_fetch_add(&ring->head, 1, __ATOMIC_RELAXED);
+		slot = &ring->records[pos & (TRACE_SLOTS - 1)];
+		__atomic_store_n(&slot->seq, 0, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+		memcpy((char*)slot + offsetof(struct traceRecord, stamps), (char*)rec + offsetof(struct traceRecord, stamps),
+			sizeof(*rec) - offsetof(struct traceRecord, stamps));
+		__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+	}
+
+	if(slowNs != 0 && start != 0 && end >= start + slowNs){ logSlow(rec, end - start); }
+}
+
+/*****************************
+ * One line on stderr with every stamp of rec as ms after its first header byte
+ *****************************/
+static void logSlow(const struct traceRecord* rec, unsigned long long ns){
+	char line[512];
+	size_t len;
+
+	len = snprintf(line, sizeof(line), "SERVER: slow request, worker %d conn %u op %c %u chars %s in %.3f ms:",
+		rec->worker, rec->conn, rec->op, rec->chars,
+		rec->outcome < NUM_OUTCOMES ? metricsOutcomeNames[rec->outcome] : "?", ns / 1e6);
+	len = stampf(line, sizeof(line), len, "header", rec, TRACE_HEADER);
+	len = stampf(line, sizeof(line), len, "body", rec, TRACE_BODY);
+	len = stampf(line, sizeof(line), len, "transform", rec, TRACE_TRANSFORM);
+	len += snprintf(line + len, sizeof(line) - len, " (kernel %.3f)", rec->transformNs / 1e6);
+	len = stampf(line, sizeof(line), len, "queued", rec, TRACE_QUEUED);
+	len = stampf(line, sizeof(line), len, "sent", rec, TRACE_SENT);
+	if(len > sizeof(line) - 2){ len = sizeof(line) - 2; }
+	line[len++] = '\n';
+	line[len] = '\0';
+	fputs(line, stderr);
+}
+
+/*****************************
+ * Append " name +ms" for stamp which of rec to line, or " name -" if the
+ * request never got there. Returns the new length.
+ *****************************/
+static size_t stampf(char* line, size_t cap, size_t len, const char* name, const struct traceRecord* rec, int which){
+	if(len >= cap){ return len; }
+	if(rec->stamps[which] == 0){
+		return len + snprintf(line + len, cap - len, " %s -", name);
+	}
+	return len + snprintf(line + len, cap - len, " %s +%.3f", name, (rec->stamps[which] - rec->stamps[TRACE_HEADER_START]) / 1e6);
+}
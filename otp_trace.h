@@ -0,0 +1,63 @@
+#ifndef OTP_TRACE_H
+#define OTP_TRACE_H
+
+#define TRACE_MAGIC "OTPTRACE"
+#define TRACE_VERSION 1
+#define TRACE_SLOTS 65536		// Records per worker ring, a power of 2
+
+enum traceStamp {
+	TRACE_ACCEPT,			// Connection accepted, first request on a connection only
+	TRACE_HEADER_START,		// First header byte received
+	TRACE_HEADER,			// Header parsed
+	TRACE_BODY,				// Last request byte received
+	TRACE_TRANSFORM,		// Last chunk through the transform
+	TRACE_QUEUED,			// Reply complete and queued, or the request given up
+	TRACE_SENT,				// Last reply byte handed to the kernel
+	NUM_STAMPS
+};
+
+/*****************************
+ * The timeline of one request. Stamps are CLOCK_MONOTONIC ns, 0 for a point
+ * the request never reached.
+ *****************************/
+struct traceRecord {
+	unsigned long long seq;		// Ring position + 1 once the record is whole, 0 while it is written
+	unsigned long long stamps[NUM_STAMPS];
+	unsigned long long transformNs;		// Time spent inside the transform, all chunks
+	unsigned int conn;			// Connection number within the worker
+	unsigned int chars;			// Characters transformed
+	unsigned char worker;
+	unsigned char outcome;		// enum metricsOutcome
+	char op;					// 'e'ncrypt, 'd'ecrypt, 'r'egister, '-' anything else
+	unsigned char pad[5];
+};
+
+/*****************************
+ * Layout of a trace file: this header, then one ring per worker. Each ring is
+ * a head counter on its own cache line followed by TRACE_SLOTS records.
+ *****************************/
+struct traceFileHeader {
+	char magic[8];
+	unsigned int version;
+	unsigned int workers;
+	unsigned int slots;
+	unsigned int recordSize;
+	unsigned long long startNs;		// When the file was opened, the base for timestamps
+	char pad[32];
+};
+
+struct traceRing {
+	unsigned long long head;		// Records ever written to this ring
+	char pad[56];
+	struct traceRecord records[];
+};
+
+extern int tracing;		// 1 if anything consumes the full timelines
+
+int traceOpen(const char*, int);
+void traceSlowAfter(unsigned long long);
+void traceUseRing(int);
+void traceCommit(struct traceRecord*);
+struct traceRing* traceRingAt(struct traceFileHeader*, int);
+
+#endif
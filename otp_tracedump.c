@@ -0,0 +1,135 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "otp_trace.h"
+#include "otp_metrics.h"
+
+/* argv[0] = otp_tracedump
+ * argv[last] = trace file written by a daemon started with -t
+ * options: -w only dumps the given worker, -s only dumps requests that took at
+ *          least the given milliseconds
+ *
+ * Prints the request timelines in a trace file as Chrome trace event JSON, for
+ * chrome://tracing or Perfetto. Each worker is a process and each connection a
+ * thread; a request is a span holding its header, body and reply spans, with
+ * an instant where its last chunk left the transform. Works on the file of a
+ * daemon that is still running: records being written are skipped.
+ */
+
+// Function prototypes
+static void dumpRecord(const struct traceRecord*, unsigned long long);
+static void span(const char*, const struct traceRecord*, unsigned long long, int, int);
+static void event(const char*);
+
+// Global vars
+static int firstEvent = 1;
+static unsigned long long minNs = 0;
+
+int main(int argc, char** argv){
+	struct traceFileHeader* file;
+	struct traceRing* ring;
+	struct traceRecord rec;
+	struct stat st;
+	unsigned long long head, seq;
+	int fd, opt, onlyWorker = -1;
+	char meta[128];
+
+	while((opt = getopt(argc, argv, "w:s:")) != -1){
+		switch(opt){
+			case 'w': onlyWorker = atoi(optarg); break;
+			case 's': minNs = atof(optarg) * 1e6; break;
+			default:
+				fprintf(stderr, "USAGE: %s [-w worker] [-s minms] tracefile\n", argv[0]);
+				return 1;
+		}
+	}
+	if(optind != argc - 1){ fprintf(stderr, "USAGE: %s [-w worker] [-s minms] tracefile\n", argv[0]); return 1; }
+
+	fd = open(argv[optind], O_RDONLY);
+	if(fd < 0 || fstat(fd, &st) != 0){ perror("ERROR opening trace file"); return 1; }
+	if((size_t)st.st_size < sizeof(*file)){ fprintf(stderr, "ERROR: %s is not a trace file\n", argv[optind]); return 1; }
+	file = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(file == MAP_FAILED){ perror("ERROR mapping trace file"); return 1; }
+
+	if(memcmp(file->magic, TRACE_MAGIC, sizeof(file->magic)) != 0 || file->version != TRACE_VERSION
+		|| file->recordSize != sizeof(struct traceRecord) || file->slots == 0 || (file->slots & (file->slots - 1)) != 0
+		|| (size_t)st.st_size < sizeof(*file) + file->workers * (sizeof(struct traceRing) + file->slots * sizeof(struct traceRecord))){
+		fprintf(stderr, "ERROR: %s is not a trace file this version can read\n", argv[optind]);
+		return 1;
+	}
+
+	printf("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+	for(int w = 0; w < (int)file->workers; w++){
+		if(onlyWorker >= 0 && w != onlyWorker){ continue; }
+		snprintf(meta, sizeof(meta), "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"worker %d\"}}", w, w);
+		event(meta);
+
+		// The ring holds the last slots records written to it
+		ring = traceRingAt(file, w);
+		head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		for(unsigned long long pos = head > file->slots ? head - file->slots : 0; pos < head; pos++){
+			seq = __atomic_load_n(&ring->records[pos & (file->slots - 1)].seq, __ATOMIC_ACQUIRE);
+			rec = ring->records[pos & (file->slots - 1)];
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			if(seq != pos + 1 || __atomic_load_n(&ring->records[pos & (file->slots - 1)].seq, __ATOMIC_RELAXED) != seq){
+				continue;		// Still being written, or already overwritten
+			}
+			dumpRecord(&rec, file->startNs);
+		}
+	}
+	printf("\n]}\n");
+	return 0;
+}
+
+/*****************************
+ * The events for one request, timestamps relative to base
+ *****************************/
+static void dumpRecord(const struct traceRecord* rec, unsigned long long base){
+	const unsigned long long* s = rec->stamps;
+	unsigned long long end = s[TRACE_SENT] != 0 ? s[TRACE_SENT] : s[TRACE_QUEUED];
+	char buf[320];
+
+	if(s[TRACE_HEADER_START] == 0 || end < s[TRACE_HEADER_START]){ return; }
+	if(end < s[TRACE_HEADER_START] + minNs){ return; }
+
+	snprintf(buf, sizeof(buf),
+		"{\"name\":\"request\",\"ph\":\"X\",\"pid\":%d,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f,"
+		"\"args\":{\"op\":\"%c\",\"chars\":%u,\"outcome\":\"%s\",\"transform_us\":%.3f}}",
+		rec->worker, rec->conn, (s[TRACE_HEADER_START] - base) / 1e3, (end - s[TRACE_HEADER_START]) / 1e3,
+		rec->op, rec->chars, rec->outcome < NUM_OUTCOMES ? metricsOutcomeNames[rec->outcome] : "?", rec->transformNs / 1e3);
+	event(buf);
+
+	span("connect", rec, base, TRACE_ACCEPT, TRACE_HEADER_START);
+	span("header", rec, base, TRACE_HEADER_START, TRACE_HEADER);
+	span("body", rec, base, TRACE_HEADER, TRACE_BODY);
+	span("reply", rec, base, TRACE_QUEUED, TRACE_SENT);
+	if(s[TRACE_TRANSFORM] != 0){
+		snprintf(buf, sizeof(buf), "{\"name\":\"transform done\",\"ph\":\"i\",\"s\":\"t\",\"pid\":%d,\"tid\":%u,\"ts\":%.3f}",
+			rec->worker, rec->conn, (s[TRACE_TRANSFORM] - base) / 1e3);
+		event(buf);
+	}
+}
+
+/*****************************
+ * A span from stamp from to stamp to, if the request reached both
+ *****************************/
+static void span(const char* name, const struct traceRecord* rec, unsigned long long base, int from, int to){
+	char buf[160];
+
+	if(rec->stamps[from] == 0 || rec->stamps[to] < rec->stamps[from]){ return; }
+	snprintf(buf, sizeof(buf), "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}",
+		name, rec->worker, rec->conn, (rec->stamps[from] - base) / 1e3, (rec->stamps[to] - rec->stamps[from]) / 1e3);
+	event(buf);
+}
+
+static void event(const char* json){
+	printf("%s\n%s", firstEvent ? "" : ",", json);
+	firstEvent = 0;
+}
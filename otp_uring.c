@@ -0,0 +1,871 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "otp_uring.h"
+#include "otp_wheel.h"
+#include "otp_metrics.h"
+
+#define RING_ENTRIES 1024	// Submission queue entries, the completion queue gets 4 times as many
+#define FIXED_FILES 1024	// Clients that get a fixed file slot and a registered staging buffer
+#define STAGE_SIZE 4096		// Staging buffer per fixed client: a read takes every small request already sent
+#define OP_BITS 3			// Low bits of user_data saying which operation completed
+
+enum ringOp {
+	OP_NONE,		// Nothing to do when it completes: close, cancel
+	OP_ACCEPT,
+	OP_RECV,
+	OP_SEND,
+	OP_FILES,		// A client's socket going into its fixed file slot
+	OP_RELEASE,		// A fixed file slot being emptied, user_data holds the slot
+	OP_WORK			// A no-op that gives a busy client its next turn
+};
+
+enum ringKind {
+	RING_CLIENT,			// Request connection
+	RING_LISTENER,			// Listening socket for requests
+	RING_METRICS_LISTENER,	// Listening socket for metrics scrapes
+	RING_SCRAPE				// Metrics scrape connection
+};
+
+/*****************************
+ * One accepted connection and what it has in flight. Listening sockets and
+ * scrapes get one too, with only conn.fd set. It is freed only once every
+ * operation submitted for it has completed, since each completion points
+ * back at it.
+ *****************************/
+struct ringConn {
+	struct otpConn conn;
+	enum ringKind kind;
+	int index;			// Listeners: position in the list, for the metrics
+	int unixSocket;		// Descriptors may come along: recvmsg()/sendmsg() straight to and from conn
+	int multishot;		// Listeners: one accept keeps completing for every connection
+	int accepted;		// Listeners: accepted since the queue was last sampled
+	int slot;			// Clients: fixed file slot holding the socket, -1 if it has none
+	int inFlight;		// Operations submitted and not completed yet
+	int recving;
+	int sending;
+	int passing;		// The send in flight carries conn.sendFD
+	int zeroCopying;	// The send in flight is zero-copy
+	int staged;			// The recv in flight reads into stage
+	int working;		// Its OP_WORK is in flight
+	int closing;		// Freed once nothing is in flight
+	char* stage;		// Registered buffer small reads land in, NULL if it has none
+	size_t stageOff;
+	size_t stageLen;	// Staged bytes the connection hasn't taken yet
+	struct msghdr recvMsg;
+	struct msghdr sendMsg;
+	struct iovec recvIov;
+	struct iovec sendIov;
+	union connControl recvControl;
+	union connControl sendControl;
+	struct metricsReply* scrape;	// Scrapes: request and reply
+	struct wheelTimer timer;		// Clients and scrapes: its deadline
+};
+
+/*****************************
+ * The submission and completion queues, shared with the kernel
+ *****************************/
+struct ring {
+	int fd;
+	unsigned int* sqHead;
+	unsigned int* sqTail;
+	unsigned int sqMask;
+	unsigned int sqEntries;
+	unsigned int tail;			// Our copy of *sqTail, ahead of it by what isn't submitted yet
+	struct io_uring_sqe* sqes;
+	unsigned int* cqHead;
+	unsigned int* cqTail;
+	unsigned int cqMask;
+	struct io_uring_cqe* cqes;
+};
+
+// Function prototypes
+static int ringSetup();
+static void ringRegister();
+static int ringSupports(int);
+static struct io_uring_sqe* ringGet();
+static int ringEnter(int, int);
+static void reapCompletions(const struct otpService*);
+static int addListener(int, enum ringKind, int);
+static void submitAccept(struct ringConn*);
+static void acceptDone(struct ringConn*, int, unsigned int, const struct otpService*);
+static void sampleListeners();
+static void startClient(int, int, const struct otpService*);
+static void serviceClient(struct ringConn*, enum ringOp, int, unsigned int);
+static void pumpClient(struct ringConn*);
+static void submitRecv(struct ringConn*, char*, size_t);
+static void submitSend(struct ringConn*, const char*, size_t);
+static void submitWork(struct ringConn*);
+static struct io_uring_sqe* submitOp(struct ringConn*, int, enum ringOp);
+static void closeClient(struct ringConn*);
+static void submitCancel(struct ringConn*, enum ringOp);
+static void reapClient(struct ringConn*);
+static void releaseClient(struct ringConn*);
+static void startScrape(int);
+static void serviceScrape(struct ringConn*, enum ringOp, int);
+static void expireTimers();
+static int isUnixSocket(int);
+static unsigned long long opData(struct ringConn*, enum ringOp);
+
+// Global vars
+static struct ring ring;
+static struct admitQueue waiting;		// Accepted clients waiting for a slot
+static int activeClients = 0;			// Clients being served
+static struct timerWheel wheel;			// Client deadlines
+static struct ringConn** listeners;		// Request listeners, for sampling their queues
+static int numListeners = 0;
+static char* stages = NULL;				// FIXED_FILES staging buffers of STAGE_SIZE, NULL if they couldn't be mapped
+static int registered = 0;				// 1 if stages is registered with the ring
+static int sendZC = 0;					// 1 if the kernel has zero-copy sends (6.0)
+static int freeSlots[FIXED_FILES];		// Fixed file slots no client holds
+static int numFree = 0;
+static const int noFile = -1;			// What an emptied slot holds
+
+/*****************************
+ * Serve every connection from a single process through io_uring. Accepts,
+ * receives, sends and closes are all submitted to one ring and handed to the
+ * kernel together, one io_uring_enter() per pass that also waits for the
+ * next completions, so a small request costs a share of a syscall instead
+ * of several. Accepted sockets go into fixed file slots, and small reads land
+ * in registered staging buffers from which the connection state machine
+ * takes its header, records and data; one read usually carries a whole
+ * request, or several pipelined ones. Reads the state machine wants bigger
+ * than a staging buffer go straight where it wants them. UNIX socket clients
+ * use recvmsg()/sendmsg() into the connection instead, for the descriptors
+ * that come along. A client busy with work of its own (see connBusy()) does
+ * a piece of it each time a no-op it submitted completes. Admission and
+ * deadlines work as in runEventLoop().
+ * Returns 1 without serving anything if the kernel lacks io_uring or the
+ * features it needs (5.11), so the caller can fall back to epoll, and -1 if
+ * the ring fails later on.
+ *****************************/
+int runUringLoop(const int* listenSocketFDs, int count, int metricsFD, const struct admitPolicy* policy, const struct otpService* svc){
+	int fd;
+
+	if(ringSetup() != 0){ return 1; }
+	if(admitInit(&waiting, policy) != 0){ perror("ERROR allocating admission queue"); return -1; }
+	wheelInit(&wheel);
+	ringRegister();
+	sendZC = ringSupports(IORING_OP_SEND_ZC);
+
+	listeners = calloc(count, sizeof(*listeners));
+	if(listeners == NULL){ perror("ERROR allocating listeners"); return -1; }
+	for(int i = 0; i < count; i++){
+		if(addListener(listenSocketFDs[i], RING_LISTENER, i) != 0){ return -1; }
+	}
+	if(metricsFD >= 0 && addListener(metricsFD, RING_METRICS_LISTENER, -1) != 0){ return -1; }
+
+	while(1){
+		// Submit everything queued since the last pass and wait for completions, waking up
+		// in time to shed the oldest waiting client or close the first one past its deadline
+		if(ringEnter(1, wheelTimeout(&wheel, admitTimeout(&waiting))) != 0){
+			perror("ERROR on io_uring_enter");
+			break;
+		}
+
+		reapCompletions(svc);
+		sampleListeners();
+		expireTimers();
+
+		// Clients that closed made room for ones that have been waiting
+		while(activeClients < policy->maxActive && (fd = admitPop(&waiting)) >= 0){
+			startClient(fd, isUnixSocket(fd), svc);
+		}
+	}
+
+	return -1;
+}
+
+/*****************************
+ * Create the ring and map its queues. Returns -1 with errno set if the kernel
+ * can't provide one we can use.
+ *****************************/
+static int ringSetup(){
+	struct io_uring_params params;
+	size_t ringSize;
+	unsigned int* array;
+	char* sq;
+
+	memset(&params, '\0', sizeof(params));
+	params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN | IORING_SETUP_SINGLE_ISSUER;
+	params.cq_entries = RING_ENTRIES * 4;
+	ring.fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &params);
+	if(ring.fd < 0 && errno == EINVAL){
+		// Kernels before 6.0 don't know all of those
+		memset(&params, '\0', sizeof(params));
+		params.flags = IORING_SETUP_CQSIZE;
+		params.cq_entries = RING_ENTRIES * 4;
+		ring.fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &params);
+	}
+	if(ring.fd < 0){ return -1; }
+
+	// One mapping for both queues, no dropped completions and a timeout for io_uring_enter()
+	if((params.features & (IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG))
+		!= (IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG)){
+		close(ring.fd);
+		errno = ENOSYS;
+		return -1;
+	}
+
+	ringSize = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	if(params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe) > ringSize){
+		ringSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	}
+	sq = mmap(NULL, ringSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+	if(sq == MAP_FAILED){ close(ring.fd); return -1; }
+	ring.sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+	if(ring.sqes == MAP_FAILED){ munmap(sq, ringSize); close(ring.fd); return -1; }
+
+	ring.sqHead = (unsigned int*)(sq + params.sq_off.head);
+	ring.sqTail = (unsigned int*)(sq + params.sq_off.tail);
+	ring.sqMask = *(unsigned int*)(sq + params.sq_off.ring_mask);
+	ring.sqEntries = params.sq_entries;
+	ring.tail = *ring.sqTail;
+	ring.cqHead = (unsigned int*)(sq + params.cq_off.head);
+	ring.cqTail = (unsigned int*)(sq + params.cq_off.tail);
+	ring.cqMask = *(unsigned int*)(sq + params.cq_off.ring_mask);
+	ring.cqes = (struct io_uring_cqe*)(sq + params.cq_off.cqes);
+
+	// SQEs are used in ring order, so the index array never changes
+	array = (unsigned int*)(sq + params.sq_off.array);
+	for(unsigned int i = 0; i < params.sq_entries; i++){
+		array[i] = i;
+	}
+	return 0;
+}
+
+/*****************************
+ * Register an empty fixed file table and the staging buffers. Either can
+ * fail, on a low file or locked memory limit, and the clients then use
+ * plain descriptors or unregistered buffers instead.
+ *****************************/
+static void ringRegister(){
+	static int files[FIXED_FILES];
+	struct iovec iov;
+
+	for(int i = 0; i < FIXED_FILES; i++){
+		files[i] = -1;
+	}
+	if(syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_FILES, files, FIXED_FILES) != 0){
+		perror("SERVER: no fixed files for io_uring");
+		return;
+	}
+	for(int i = FIXED_FILES - 1; i >= 0; i--){
+		freeSlots[numFree++] = i;
+	}
+
+	stages = mmap(NULL, (size_t)FIXED_FILES * STAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(stages == MAP_FAILED){
+		stages = NULL;
+		return;
+	}
+	iov.iov_base = stages;
+	iov.iov_len = (size_t)FIXED_FILES * STAGE_SIZE;
+	registered = syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_BUFFERS, &iov, 1) == 0;
+	if(!registered){ perror("SERVER: no registered buffers for io_uring"); }
+}
+
+/*****************************
+ * Whether the kernel knows opcode
+ *****************************/
+static int ringSupports(int opcode){
+	struct io_uring_probe* probe;
+	int supported;
+
+	probe = calloc(1, sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op));
+	if(probe == NULL){ return 0; }
+	supported = syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_PROBE, probe, 256) == 0
+		&& opcode <= probe->last_op && (probe->ops[opcode].flags & IO_URING_OP_SUPPORTED);
+	free(probe);
+	return supported;
+}
+
+/*****************************
+ * The next free SQE, cleared. A full queue is handed to the kernel first.
+ *****************************/
+static struct io_uring_sqe* ringGet(){
+	struct io_uring_sqe* sqe;
+
+	while(ring.tail - __atomic_load_n(ring.sqHead, __ATOMIC_ACQUIRE) >= ring.sqEntries){
+		if(ringEnter(0, -1) != 0){ perror("ERROR on io_uring_enter"); exit(1); }
+	}
+	sqe = &ring.sqes[ring.tail & ring.sqMask];
+	memset(sqe, '\0', sizeof(*sqe));
+	ring.tail++;
+	return sqe;
+}
+
+/*****************************
+ * Submit the queued SQEs and, if wait is set, wait up to ms (forever if -1)
+ * for at least one completion. Returns -1 if the ring failed.
+ *****************************/
+static int ringEnter(int wait, int ms){
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	unsigned int submit;
+
+	__atomic_store_n(ring.sqTail, ring.tail, __ATOMIC_RELEASE);
+	submit = ring.tail - __atomic_load_n(ring.sqHead, __ATOMIC_ACQUIRE);
+	if(!wait && submit == 0){ return 0; }
+
+	memset(&arg, '\0', sizeof(arg));
+	if(ms >= 0){
+		ts.tv_sec = ms / 1000;
+		ts.tv_nsec = (ms % 1000) * 1000000LL;
+		arg.ts = (unsigned long long)(uintptr_t)&ts;
+	}
+	if(syscall(__NR_io_uring_enter, ring.fd, submit, wait ? 1 : 0, IORING_ENTER_EXT_ARG | (wait ? IORING_ENTER_GETEVENTS : 0), &arg, sizeof(arg)) < 0){
+		// Timed out, interrupted, or completions must be reaped before more can be submitted
+		if(errno != ETIME && errno != EINTR && errno != EBUSY && errno != EAGAIN){ return -1; }
+	}
+	return 0;
+}
+
+/*****************************
+ * Handle every completion posted so far
+ *****************************/
+static void reapCompletions(const struct otpService* svc){
+	unsigned int head = *ring.cqHead;
+	struct io_uring_cqe* cqe;
+	struct ringConn* rc;
+	unsigned long long data;
+	unsigned int flags;
+	enum ringOp op;
+	int res;
+
+	while(head != __atomic_load_n(ring.cqTail, __ATOMIC_ACQUIRE)){
+		cqe = &ring.cqes[head & ring.cqMask];
+		data = cqe->user_data;
+		res = cqe->res;
+		flags = cqe->flags;
+		__atomic_store_n(ring.cqHead, ++head, __ATOMIC_RELEASE);
+
+		op = data & ((1 << OP_BITS) - 1);
+		if(op == OP_NONE){ continue; }
+		if(op == OP_RELEASE){
+			freeSlots[numFree++] = data >> OP_BITS;
+			continue;
+		}
+
+		rc = (struct ringConn*)(uintptr_t)(data & ~((1ULL << OP_BITS) - 1));
+		switch(rc->kind){
+			case RING_LISTENER:
+			case RING_METRICS_LISTENER:
+				acceptDone(rc, res, flags, svc);
+				break;
+			case RING_SCRAPE:
+				serviceScrape(rc, op, res);
+				break;
+			default:
+				serviceClient(rc, op, res, flags);
+				break;
+		}
+	}
+}
+
+/*****************************
+ * Start accepting on fd as a listener of the given kind. Returns -1 on failure.
+ *****************************/
+static int addListener(int fd, enum ringKind kind, int index){
+	struct ringConn* listener;
+
+	listener = calloc(1, sizeof(*listener));
+	if(listener == NULL){ perror("ERROR allocating listener"); return -1; }
+	listener->conn.fd = fd;
+	listener->kind = kind;
+	listener->index = index;
+	listener->unixSocket = isUnixSocket(fd);
+	listener->multishot = 1;
+	listener->slot = -1;
+	if(kind == RING_LISTENER){ listeners[numListeners++] = listener; }
+
+	// The ring waits for connections itself; a non-blocking socket could make it give up instead
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+	submitAccept(listener);
+	return 0;
+}
+
+/*****************************
+ * Accept on listener. Where the kernel has it (5.19), one multishot accept
+ * keeps completing for every new connection.
+ *****************************/
+static void submitAccept(struct ringConn* listener){
+	struct io_uring_sqe* sqe = submitOp(listener, IORING_OP_ACCEPT, OP_ACCEPT);
+
+	sqe->accept_flags = SOCK_CLOEXEC;
+	if(listener->multishot){ sqe->ioprio = IORING_ACCEPT_MULTISHOT; }
+}
+
+/*****************************
+ * A connection was accepted on listener, or the accept failed. Serve it,
+ * queue it for admission if this worker already serves as many as it may,
+ * or answer it if it is a scrape.
+ *****************************/
+static void acceptDone(struct ringConn* listener, int res, unsigned int flags, const struct otpService* svc){
+	const struct admitPolicy* policy = waiting.policy;
+
+	if(res == -EINVAL && listener->multishot){
+		listener->multishot = 0;		// Kernel without multishot accept
+		submitAccept(listener);
+		return;
+	}
+	if(!(flags & IORING_CQE_F_MORE)){ submitAccept(listener); }		// Not armed any more
+
+	if(res < 0){
+		if(res != -EINTR && res != -EAGAIN && res != -ECONNABORTED && listener->kind == RING_LISTENER){
+			METRIC_ADD(acceptErrors, 1);
+			fprintf(stderr, "ERROR on accept: %s\n", strerror(-res));
+		}
+		return;
+	}
+
+	if(listener->kind == RING_METRICS_LISTENER){
+		startScrape(res);
+		return;
+	}
+	listener->accepted = 1;
+	if(policy->maxActive > 0 && (activeClients >= policy->maxActive || waiting.count > 0)){
+		admitPush(&waiting, res);
+		return;
+	}
+	startClient(res, listener->unixSocket, svc);
+}
+
+/*****************************
+ * Sample the accept queue of every listener that accepted since the last
+ * pass, once per pass rather than once per connection
+ *****************************/
+static void sampleListeners(){
+	for(int i = 0; i < numListeners; i++){
+		if(!listeners[i]->accepted){ continue; }
+		metricsSampleQueue(listeners[i]->index, listeners[i]->conn.fd);
+		listeners[i]->accepted = 0;
+	}
+}
+
+/*****************************
+ * Serve accepted connection fd: put it in a fixed file slot if one is free,
+ * and submit its first recv linked behind that
+ *****************************/
+static void startClient(int fd, int unixSocket, const struct otpService* svc){
+	struct io_uring_sqe* sqe;
+	struct ringConn* client;
+
+	client = malloc(sizeof(*client));
+	if(client == NULL){
+		fprintf(stderr, "SERVER ERROR: out of memory for new connection.\n");
+		METRIC_ADD(rejected, 1);
+		close(fd);
+		return;
+	}
+	connInit(&client->conn, fd, svc);
+	client->kind = RING_CLIENT;
+	client->unixSocket = unixSocket;
+	client->slot = -1;
+	client->inFlight = client->recving = client->sending = client->passing = client->zeroCopying = client->staged = client->working = client->closing = 0;
+	client->stage = NULL;
+	client->stageOff = client->stageLen = 0;
+	client->scrape = NULL;
+	client->timer.prev = NULL;
+	activeClients++;
+
+	if(numFree > 0){
+		// Leave room for the recv: the link only holds within one submission
+		if(ring.tail - __atomic_load_n(ring.sqHead, __ATOMIC_ACQUIRE) + 2 > ring.sqEntries && ringEnter(0, -1) != 0){
+			perror("ERROR on io_uring_enter");
+			exit(1);
+		}
+		client->slot = freeSlots[--numFree];
+		if(!unixSocket && stages != NULL){ client->stage = stages + (size_t)client->slot * STAGE_SIZE; }
+
+		sqe = ringGet();
+		sqe->opcode = IORING_OP_FILES_UPDATE;
+		sqe->fd = -1;
+		sqe->addr = (uintptr_t)&client->conn.fd;
+		sqe->len = 1;
+		sqe->off = client->slot;
+		sqe->flags = IOSQE_IO_LINK;
+		sqe->user_data = opData(client, OP_FILES);
+		client->inFlight++;
+	}
+
+	pumpClient(client);
+	reapClient(client);
+}
+
+/*****************************
+ * One of client's operations completed with res and the CQE flags. A
+ * zero-copy send completes twice: once sent, and once the kernel is done
+ * with the pages, which keeps it in flight until then.
+ *****************************/
+static void serviceClient(struct ringConn* client, enum ringOp op, int res, unsigned int flags){
+	struct otpConn* conn = &client->conn;
+
+	client->inFlight--;
+	if(op == OP_SEND && (flags & IORING_CQE_F_NOTIF)){
+		connZeroCopyDone(conn, 1, (res & IORING_NOTIF_USAGE_ZC_COPIED) != 0);
+		if(!client->closing){ pumpClient(client); }
+		reapClient(client);
+		return;
+	}
+
+	switch(op){
+		case OP_FILES:
+			// No slot after all: the linked recv is cancelled and goes again on the plain descriptor
+			if(res < 0){
+				freeSlots[numFree++] = client->slot;
+				client->slot = -1;
+				client->stage = NULL;
+			}
+			break;
+
+		case OP_RECV:
+			client->recving = 0;
+			if(res > 0 && !client->staged && client->unixSocket){ connTakeFDs(conn, &client->recvMsg); }
+			if(client->closing){ break; }
+
+			if(res > 0){
+				if(client->staged){
+					client->stageOff = 0;
+					client->stageLen = res;
+				}
+				else{ connReceived(conn, res); }
+			}
+			else if(res == 0){
+				// A client hanging up between requests is a normal goodbye,
+				// once whatever reply is still pending has gone out
+				if(connEndOfInput(conn) != 0){
+					fprintf(stderr, "SERVER ERROR: client closed the connection in the middle of a request.\n");
+					closeClient(client);
+				}
+			}
+			else if(res != -ECANCELED && res != -EINTR && res != -EAGAIN){
+				closeClient(client);
+			}
+			break;
+
+		case OP_SEND:
+			client->sending = 0;
+			if(flags & IORING_CQE_F_MORE){
+				client->inFlight++;
+				connZeroCopyQueued(conn);
+			}
+			if(res > 0 && client->passing){ connGaveFD(conn); }
+			client->passing = 0;
+			if(client->closing){ break; }
+
+			if(res > 0){ connSent(conn, res); }
+			else if(res == -EINVAL && client->zeroCopying){ sendZC = 0; }		// Before 6.2: sent again without
+			else if(res != -EINTR && res != -EAGAIN){ closeClient(client); }
+			client->zeroCopying = 0;
+			break;
+
+		case OP_WORK:
+			client->working = 0;
+			if(!client->closing){ connWork(conn); }
+			break;
+
+		default:
+			break;
+	}
+
+	if(!client->closing){ pumpClient(client); }
+	reapClient(client);
+}
+
+/*****************************
+ * Feed the connection what is staged, then submit whatever I/O it wants
+ * that isn't in flight already. The reply to one request can be in flight
+ * while the next one is read and transformed, as it would sit in the
+ * socket buffer otherwise.
+ *****************************/
+static void pumpClient(struct ringConn* client){
+	struct otpConn* conn = &client->conn;
+	const char* outBuf;
+	char* inBuf;
+	size_t len, n;
+
+	while(client->stageLen > 0 && connReadBuffer(conn, &inBuf, &len)){
+		n = len < client->stageLen ? len : client->stageLen;
+		memcpy(inBuf, client->stage + client->stageOff, n);
+		client->stageOff += n;
+		client->stageLen -= n;
+		connReceived(conn, n);
+	}
+
+	if(connFinished(conn)){
+		closeClient(client);
+		return;
+	}
+
+	if(!client->sending && connWriteBuffer(conn, &outBuf, &len)){ submitSend(client, outBuf, len); }
+	if(!client->recving && client->stageLen == 0 && connReadBuffer(conn, &inBuf, &len)){ submitRecv(client, inBuf, len); }
+	if(!client->working && connBusy(conn)){ submitWork(client); }
+	wheelSet(&wheel, &client->timer, connDeadline(conn));
+}
+
+/*****************************
+ * Read for client into buf, which wants len bytes. Small reads go through
+ * the staging buffer, taking along whatever else the client has sent;
+ * bigger ones go straight to buf.
+ *****************************/
+static void submitRecv(struct ringConn* client, char* buf, size_t len){
+	struct io_uring_sqe* sqe;
+
+	client->staged = 0;
+	if(client->unixSocket){
+		connPrepareRecv(&client->recvMsg, &client->recvIov, &client->recvControl, buf, len);
+		sqe = submitOp(client, IORING_OP_RECVMSG, OP_RECV);
+		sqe->addr = (uintptr_t)&client->recvMsg;
+		sqe->len = 1;
+		sqe->msg_flags = MSG_CMSG_CLOEXEC;
+	}
+	else if(client->stage != NULL && len < STAGE_SIZE){
+		sqe = submitOp(client, registered ? IORING_OP_READ_FIXED : IORING_OP_RECV, OP_RECV);
+		sqe->addr = (uintptr_t)client->stage;
+		sqe->len = STAGE_SIZE;
+		sqe->buf_index = 0;
+		client->staged = 1;
+	}
+	else{
+		sqe = submitOp(client, IORING_OP_RECV, OP_RECV);
+		sqe->addr = (uintptr_t)buf;
+		sqe->len = len;
+	}
+	client->recving = 1;
+}
+
+/*****************************
+ * Send buf for client, with the descriptor waiting in conn.sendFD if any,
+ * or zero-copy if it is big enough
+ *****************************/
+static void submitSend(struct ringConn* client, const char* buf, size_t len){
+	struct io_uring_sqe* sqe;
+
+	if(client->conn.sendFD >= 0){
+		connPrepareSend(&client->conn, &client->sendMsg, &client->sendIov, &client->sendControl, buf, len);
+		sqe = submitOp(client, IORING_OP_SENDMSG, OP_SEND);
+		sqe->addr = (uintptr_t)&client->sendMsg;
+		sqe->len = 1;
+		client->passing = 1;
+	}
+	else if(sendZC && connZeroCopy(&client->conn, len)){
+		sqe = submitOp(client, IORING_OP_SEND_ZC, OP_SEND);
+		sqe->addr = (uintptr_t)buf;
+		sqe->len = len;
+		sqe->ioprio = IORING_SEND_ZC_REPORT_USAGE;
+		client->zeroCopying = 1;
+	}
+	else{
+		sqe = submitOp(client, IORING_OP_SEND, OP_SEND);
+		sqe->addr = (uintptr_t)buf;
+		sqe->len = len;
+	}
+	sqe->msg_flags = MSG_NOSIGNAL;
+	client->sending = 1;
+}
+
+/*****************************
+ * Give client another turn at its work once the ring has been round, behind
+ * whatever the other clients have completed by then
+ *****************************/
+static void submitWork(struct ringConn* client){
+	struct io_uring_sqe* sqe = ringGet();
+
+	sqe->opcode = IORING_OP_NOP;
+	sqe->fd = -1;
+	sqe->user_data = opData(client, OP_WORK);
+	client->inFlight++;
+	client->working = 1;
+}
+
+/*****************************
+ * Queue an operation on rc's socket, through its fixed file slot if it has
+ * one, to complete back to rc as op
+ *****************************/
+static struct io_uring_sqe* submitOp(struct ringConn* rc, int opcode, enum ringOp op){
+	struct io_uring_sqe* sqe = ringGet();
+
+	sqe->opcode = opcode;
+	if(rc->slot >= 0){
+		sqe->fd = rc->slot;
+		sqe->flags = IOSQE_FIXED_FILE;
+	}
+	else{ sqe->fd = rc->conn.fd; }
+	sqe->user_data = opData(rc, op);
+	rc->inFlight++;
+	return sqe;
+}
+
+/*****************************
+ * Stop serving client and cancel what it has in flight. It is freed by
+ * reapClient() once the last of that has completed.
+ *****************************/
+static void closeClient(struct ringConn* client){
+	if(client->closing){ return; }
+	client->closing = 1;
+	wheelClear(&wheel, &client->timer);
+
+	if(client->recving){ submitCancel(client, OP_RECV); }
+	if(client->sending){ submitCancel(client, OP_SEND); }
+}
+
+static void submitCancel(struct ringConn* client, enum ringOp op){
+	struct io_uring_sqe* sqe = ringGet();
+
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = opData(client, op);
+	sqe->user_data = OP_NONE;
+}
+
+static void reapClient(struct ringConn* client){
+	if(client->closing && client->inFlight == 0){ releaseClient(client); }
+}
+
+/*****************************
+ * Free a client or scrape with nothing in flight. Its fixed file slot is
+ * emptied and its descriptor closed in the next submission; the slot is
+ * free for another client once emptying it completes.
+ *****************************/
+static void releaseClient(struct ringConn* client){
+	struct io_uring_sqe* sqe;
+
+	if(client->slot >= 0){
+		sqe = ringGet();
+		sqe->opcode = IORING_OP_FILES_UPDATE;
+		sqe->fd = -1;
+		sqe->addr = (uintptr_t)&noFile;
+		sqe->len = 1;
+		sqe->off = client->slot;
+		sqe->user_data = ((unsigned long long)client->slot << OP_BITS) | OP_RELEASE;
+	}
+	sqe = ringGet();
+	sqe->opcode = IORING_OP_CLOSE;
+	sqe->fd = client->conn.fd;
+	sqe->user_data = OP_NONE;
+
+	if(client->kind == RING_SCRAPE){
+		wheelClear(&wheel, &client->timer);
+		free(client->scrape->reply);
+		free(client->scrape);
+	}
+	else{
+		connFree(&client->conn);
+		activeClients--;
+	}
+	free(client);
+}
+
+/*****************************
+ * Answer a metrics scrape on fd from this loop, which is cheap: a scrape
+ * only reads the counters
+ *****************************/
+static void startScrape(int fd){
+	struct ringConn* client;
+	struct io_uring_sqe* sqe;
+
+	client = calloc(1, sizeof(*client));
+	if(client == NULL || (client->scrape = calloc(1, sizeof(struct metricsReply))) == NULL){
+		free(client);
+		close(fd);
+		return;
+	}
+	client->conn.fd = fd;
+	client->kind = RING_SCRAPE;
+	client->slot = -1;
+
+	sqe = submitOp(client, IORING_OP_RECV, OP_RECV);
+	sqe->addr = (uintptr_t)client->scrape->request;
+	sqe->len = sizeof(client->scrape->request);
+	wheelSet(&wheel, &client->timer, connScrapeDeadline());
+}
+
+/*****************************
+ * Read a scrape request until it is complete or the client stops sending,
+ * then send the page and close. A request that hasn't said GET gets the
+ * bare text without an HTTP header.
+ *****************************/
+static void serviceScrape(struct ringConn* client, enum ringOp op, int res){
+	struct metricsReply* scrape = client->scrape;
+	struct io_uring_sqe* sqe;
+
+	client->inFlight--;
+	if(res < 0 || client->closing){
+		releaseClient(client);
+		return;
+	}
+
+	if(op == OP_RECV){
+		if(res > 0 && !metricsReceived(scrape, res)){
+			sqe = submitOp(client, IORING_OP_RECV, OP_RECV);
+			sqe->addr = (uintptr_t)(scrape->request + scrape->have);
+			sqe->len = sizeof(scrape->request) - scrape->have;
+			return;
+		}
+
+		scrape->reply = malloc(METRICS_REPLY_MAX);
+		if(scrape->reply == NULL){
+			releaseClient(client);
+			return;
+		}
+		scrape->len = metricsRender(scrape->reply, METRICS_REPLY_MAX, strncmp(scrape->request, "GET", 3) == 0);
+	}
+	else if(res == 0){
+		releaseClient(client);
+		return;
+	}
+	else{ scrape->sent += res; }
+
+	if(scrape->sent < scrape->len){
+		sqe = submitOp(client, IORING_OP_SEND, OP_SEND);
+		sqe->addr = (uintptr_t)(scrape->reply + scrape->sent);
+		sqe->len = scrape->len - scrape->sent;
+		sqe->msg_flags = MSG_NOSIGNAL;
+		return;
+	}
+	releaseClient(client);
+}
+
+/*****************************
+ * Close every client and scrape whose deadline has passed. A scrape has one
+ * operation in flight, which is cancelled; serviceScrape() frees it once
+ * that completes.
+ *****************************/
+static void expireTimers(){
+	struct wheelTimer* timer;
+	struct ringConn* client;
+
+	while((timer = wheelExpired(&wheel)) != NULL){
+		client = WHEEL_OWNER(timer, struct ringConn, timer);
+		if(client->kind == RING_SCRAPE){
+			client->closing = 1;
+			submitCancel(client, client->scrape->reply == NULL ? OP_RECV : OP_SEND);
+			continue;
+		}
+		connExpire(&client->conn);
+		closeClient(client);
+		reapClient(client);
+	}
+}
+
+static int isUnixSocket(int fd){
+	int domain;
+	socklen_t len = sizeof(domain);
+
+	return getsockopt(fd, SOL_SOCKET, SO_DOMAIN, &domain, &len) == 0 && domain == AF_UNIX;
+}
+
+static unsigned long long opData(struct ringConn* rc, enum ringOp op){
+	return (unsigned long long)(uintptr_t)rc | op;
+}
@@ -0,0 +1,9 @@
+#ifndef OTP_URING_H
+#define OTP_URING_H
+
+#include "otp_conn.h"
+#include "otp_admit.h"
+
+int runUringLoop(const int*, int, int, const struct admitPolicy*, const struct otpService*);
+
+#endif
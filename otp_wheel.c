@@ -0,0 +1,85 @@
+#include <string.h>
+#include "otp_wheel.h"
+#include "otp_metrics.h"
+
+/*****************************
+ * Start with no deadlines, at the current tick
+ *****************************/
+void wheelInit(struct timerWheel* wheel){
+	memset(wheel, '\0', sizeof(*wheel));
+	wheel->tick = metricsNow() / WHEEL_TICK_NS;
+}
+
+/*****************************
+ * File timer under the tick deadline (metricsNow() ns) falls in, rounded up
+ * so it never expires early, or take it out of the wheel if deadline is 0
+ *****************************/
+void wheelSet(struct timerWheel* wheel, struct wheelTimer* timer, unsigned long long deadline){
+	unsigned long long tick = (deadline + WHEEL_TICK_NS - 1) / WHEEL_TICK_NS;
+	struct wheelTimer** slot;
+
+	if(deadline == 0){
+		wheelClear(wheel, timer);
+		return;
+	}
+	if(tick <= wheel->tick){ tick = wheel->tick + 1; }		// Already due: the next pass takes it
+	if(timer->prev != NULL && timer->tick == tick){ return; }
+
+	wheelClear(wheel, timer);
+	slot = &wheel->slots[tick & (WHEEL_SLOTS - 1)];
+	timer->tick = tick;
+	timer->next = *slot;
+	timer->prev = slot;
+	if(*slot != NULL){ (*slot)->prev = &timer->next; }
+	*slot = timer;
+	wheel->count++;
+}
+
+void wheelClear(struct timerWheel* wheel, struct wheelTimer* timer){
+	if(timer->prev == NULL){ return; }
+	*timer->prev = timer->next;
+	if(timer->next != NULL){ timer->next->prev = timer->prev; }
+	timer->prev = NULL;
+	wheel->count--;
+}
+
+/*****************************
+ * Take out and return a timer whose tick has passed, or NULL once there are
+ * none left. Call it until it returns NULL.
+ *****************************/
+struct wheelTimer* wheelExpired(struct timerWheel* wheel){
+	unsigned long long now = metricsNow() / WHEEL_TICK_NS;
+	struct wheelTimer* timer;
+
+	if(now - wheel->tick > WHEEL_SLOTS){ wheel->tick = now - WHEEL_SLOTS; }
+	while(wheel->count > 0 && wheel->tick < now){
+		for(timer = wheel->slots[(wheel->tick + 1) & (WHEEL_SLOTS - 1)]; timer != NULL; timer = timer->next){
+			if(timer->tick <= now){
+				wheelClear(wheel, timer);
+				return timer;
+			}
+		}
+		wheel->tick++;
+	}
+	wheel->tick = now;
+	return NULL;
+}
+
+/*****************************
+ * Poll timeout in ms: other, or sooner if a tick holding a timer comes first
+ *****************************/
+int wheelTimeout(struct timerWheel* wheel, int other){
+	unsigned long long now, due;
+	int ms;
+
+	if(wheel->count == 0){ return other; }
+	for(unsigned long long tick = wheel->tick + 1; tick <= wheel->tick + WHEEL_SLOTS; tick++){
+		if(wheel->slots[tick & (WHEEL_SLOTS - 1)] == NULL){ continue; }
+
+		now = metricsNow();
+		due = tick * WHEEL_TICK_NS;
+		ms = due > now ? (int)((due - now + 999999) / 1000000) : 0;
+		return (other >= 0 && other < ms) ? other : ms;
+	}
+	return other;
+}
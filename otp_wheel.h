@@ -0,0 +1,39 @@
+#ifndef OTP_WHEEL_H
+#define OTP_WHEEL_H
+
+#include <stddef.h>
+
+#define WHEEL_SLOTS 512		// Timer wheel slots, a power of 2
+#define WHEEL_TICK_NS 16000000ULL	// Deadline resolution, the wheel turns once every WHEEL_SLOTS ticks (~8 s)
+
+// The struct a wheelTimer is embedded in as member
+#define WHEEL_OWNER(timer, type, member) ((type*)((char*)(timer) - offsetof(type, member)))
+
+/*****************************
+ * One deadline, embedded in whatever it belongs to. prev is NULL while
+ * it isn't set.
+ *****************************/
+struct wheelTimer {
+	struct wheelTimer* next;	// The others in its slot
+	struct wheelTimer** prev;	// The pointer to this one
+	unsigned long long tick;	// Tick the deadline falls in
+};
+
+/*****************************
+ * Deadlines by the tick they fall in, modulo WHEEL_SLOTS, so setting or
+ * clearing one costs nothing and expiring them only a list walk for the
+ * ticks that passed. Slots also hold deadlines a whole turn or more away.
+ *****************************/
+struct timerWheel {
+	struct wheelTimer* slots[WHEEL_SLOTS];
+	unsigned long long tick;	// Last tick whose deadlines have been dealt with
+	int count;
+};
+
+void wheelInit(struct timerWheel*);
+void wheelSet(struct timerWheel*, struct wheelTimer*, unsigned long long);
+void wheelClear(struct timerWheel*, struct wheelTimer*);
+struct wheelTimer* wheelExpired(struct timerWheel*);
+int wheelTimeout(struct timerWheel*, int);
+
+#endif